@@ -0,0 +1,485 @@
+#ifndef LOOKUP_CACHE_CPP_INCLUDED
+#define LOOKUP_CACHE_CPP_INCLUDED
+
+// lookup_cache
+// Author: Jordan Chandler
+
+// Long-lived cache of lookup_results owned by a lookup_get instance so
+// responses survive across request() calls.  Cached results are shared with
+// the callers they are delivered to rather than copied.
+//
+// Entries are kept in least recently used order and evicted from the cold
+// end whenever the cache grows past its memory budget.  Successful (200)
+// responses live for ttl, while negative responses (403, 404 and other
+// statuses) live for the usually shorter negative_ttl.  Transport failures
+// (status 0) and rate limit responses (429) are never cached.
+//
+// An entry can also ask to be refreshed before it expires.  A hit in the last
+// refresh_ahead share of its lifetime is returned as usual but also tells the
+// caller to request the id again in the background, and an entry that has
+// expired is still returned for stale_while_revalidate afterwards, asking for
+// the same refresh, rather than being dropped.  Each entry asks at most once
+// per refresh_retry, so a refresh that could not be started or failed is
+// asked for again later without a stream of hits asking at once.
+//
+// With compress set, payloads of at least compress_min_bytes are held
+// deflated and inflated into a fresh result on every hit, trading a little
+// CPU per hit for several times as many entries in the same budget.  The
+// first payloads inserted are also gathered into a preset dictionary of up to
+// dictionary_bytes; once it is full every later payload is deflated against
+// it, which is what makes compressing small JSON objects worthwhile.
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+#include "lookup_result.cpp"
+#include "lookup_compress.cpp"
+
+// Sizing and expiry settings for a lookup_cache
+struct lookup_cache_options
+{
+    // Approximate upper bound on memory held by cached entries
+    size_t max_bytes = 64 * 1024 * 1024;
+
+    // Lifetime of a 200 (OK) response
+    std::chrono::milliseconds ttl = std::chrono::minutes(10);
+
+    // Lifetime of a 403, 404 or other negative response
+    std::chrono::milliseconds negative_ttl = std::chrono::seconds(30);
+
+    // Share of an entry's lifetime, at its end, in which hits ask for a
+    // background refresh.  0 disables refresh-ahead.
+    double refresh_ahead = 0;
+
+    // Time after expiry during which an entry is still returned, asking for a
+    // background refresh.  0 drops entries as they expire.
+    std::chrono::milliseconds stale_while_revalidate = std::chrono::milliseconds::zero();
+
+    // Least time between two refresh requests of one entry
+    std::chrono::milliseconds refresh_retry = std::chrono::seconds(1);
+
+    // Hold payloads deflated, inflating them on every hit
+    bool compress = false;
+
+    // Payloads shorter than this are held as they are
+    size_t compress_min_bytes = 128;
+
+    // Size of the dictionary trained from the first payloads; 0 for none
+    size_t dictionary_bytes = 16 * 1024;
+};
+
+// Snapshot of a lookup_cache's counters
+struct lookup_cache_stats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;
+    uint64_t expirations = 0;
+
+    // Hits answered by expired entries within stale_while_revalidate
+    uint64_t stale_hits = 0;
+
+    // Hits that asked for a background refresh
+    uint64_t refresh_requests = 0;
+
+    size_t entries = 0;
+    size_t bytes = 0;
+
+    // Entries held deflated, and the payload bytes deflating them saved
+    size_t compressed_entries = 0;
+    size_t compressed_savings = 0;
+
+    // Size of the trained dictionary; 0 until training has finished
+    size_t dictionary_bytes = 0;
+};
+
+class lookup_cache
+{
+public:
+    lookup_cache(const lookup_cache_options &options = lookup_cache_options())
+        : options(options) {}
+
+    // Find a usable result for id: a live one, or an expired one within
+    // stale_while_revalidate.  Entries past that are dropped and reported as
+    // misses.  refresh is set when the caller should request id again in the
+    // background.  Returns nullptr on a miss.
+    lookup_result_ptr find(const std::string &id, bool &refresh)
+    {
+        refresh = false;
+        held found;
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            auto it = index.find(std::string_view(id));
+            if (it == index.end())
+            {
+                misses.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            auto entry = it->second;
+            auto now = std::chrono::steady_clock::now();
+            if (entry->expires + options.stale_while_revalidate <= now)
+            {
+                expirations.fetch_add(1, std::memory_order_relaxed);
+                misses.fetch_add(1, std::memory_order_relaxed);
+                erase(entry);
+                return nullptr;
+            }
+            if (entry->expires <= now)
+            {
+                stale_hits.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (entry->refresh_at <= now)
+            {
+                refresh = true;
+                entry->refresh_at = now + options.refresh_retry;
+                refresh_requests.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Move the entry to the hot end of the LRU list
+            lru.splice(lru.begin(), lru, entry);
+            found = held(*entry);
+        }
+        // Inflate outside the lock so hits on other ids are not held up
+        lookup_result_ptr result = restore(found);
+        if (result)
+        {
+            hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    // Find a usable result for id, ignoring any refresh it asks for
+    lookup_result_ptr find(const std::string &id)
+    {
+        bool refresh;
+        return find(id, refresh);
+    }
+
+    // Like find(), but returns only live results, and neither counts a hit or miss nor refreshes the entry's LRU position
+    lookup_result_ptr peek(const std::string &id)
+    {
+        held found;
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            auto it = index.find(std::string_view(id));
+            if (it == index.end() || it->second->expires <= std::chrono::steady_clock::now())
+            {
+                return nullptr;
+            }
+            found = held(*it->second);
+        }
+        return restore(found);
+    }
+
+    // Whether a live result for id is cached.  Counts nothing, refreshes
+    // nothing and inflates nothing.
+    bool contains(const std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        auto it = index.find(std::string_view(id));
+        return it != index.end() && it->second->expires > std::chrono::steady_clock::now();
+    }
+
+    // Cache a result, sharing it rather than copying it unless its payload is compressed.
+    // Replaces any existing entry for its id.  Statuses that must be retried are ignored.
+    // A zero ttl selects the lifetime configured for the result's status.
+    void insert(lookup_result_ptr result, std::chrono::milliseconds ttl = std::chrono::milliseconds::zero())
+    {
+        if (result->status == 0 || result->status == 429)
+        {
+            return;
+        }
+        if (ttl.count() == 0)
+        {
+            ttl = (result->status == 200) ? options.ttl : options.negative_ttl;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto expires = now + ttl;
+        auto refresh_at = std::chrono::steady_clock::time_point::max();
+        if (options.refresh_ahead > 0)
+        {
+            auto fresh = ttl * (1 - options.refresh_ahead);
+            refresh_at = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(fresh);
+        }
+        else if (options.stale_while_revalidate.count() > 0)
+        {
+            refresh_at = expires;
+        }
+        size_t inflated_size = 0;
+        bool with_dictionary = false;
+        if (options.compress && result->payload.size() >= options.compress_min_bytes)
+        {
+            result = deflated(std::move(result), inflated_size, with_dictionary);
+        }
+        size_t size = entry_size(*result);
+        if (size > options.max_bytes)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(accessor);
+        auto it = index.find(std::string_view(result->id));
+        if (it != index.end())
+        {
+            erase(it->second);
+        }
+
+        lru.push_front(entry{std::move(result), expires, refresh_at, size, inflated_size, with_dictionary});
+        index.emplace(std::string_view(lru.front().result->id), lru.begin());
+        bytes += size;
+        if (inflated_size)
+        {
+            compressed_entries++;
+            compressed_savings += inflated_size - lru.front().result->payload.size();
+        }
+        insertions.fetch_add(1, std::memory_order_relaxed);
+
+        // Evict from the cold end until the cache fits its budget
+        while (bytes > options.max_bytes && !lru.empty())
+        {
+            erase(std::prev(lru.end()));
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Remove every entry.  Counters are preserved.
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        index.clear();
+        lru.clear();
+        bytes = 0;
+        compressed_entries = 0;
+        compressed_savings = 0;
+    }
+
+    lookup_cache_stats stats()
+    {
+        lookup_cache_stats snapshot;
+        snapshot.hits = hits.load(std::memory_order_relaxed);
+        snapshot.misses = misses.load(std::memory_order_relaxed);
+        snapshot.insertions = insertions.load(std::memory_order_relaxed);
+        snapshot.evictions = evictions.load(std::memory_order_relaxed);
+        snapshot.expirations = expirations.load(std::memory_order_relaxed);
+        snapshot.stale_hits = stale_hits.load(std::memory_order_relaxed);
+        snapshot.refresh_requests = refresh_requests.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(accessor);
+        snapshot.entries = index.size();
+        snapshot.bytes = bytes;
+        snapshot.compressed_entries = compressed_entries;
+        snapshot.compressed_savings = compressed_savings;
+        if (trained.load(std::memory_order_acquire))
+        {
+            snapshot.dictionary_bytes = dictionary.size();
+        }
+        return snapshot;
+    }
+
+private:
+    struct entry
+    {
+        lookup_result_ptr result;
+        std::chrono::steady_clock::time_point expires;
+
+        // When the next hit asks for a refresh
+        std::chrono::steady_clock::time_point refresh_at;
+
+        size_t size;
+
+        // Size of the payload before it was deflated; 0 if it is held as it is
+        size_t inflated_size;
+
+        // The payload was deflated against the dictionary
+        bool with_dictionary;
+    };
+
+    // What find() and peek() take from an entry to finish outside the lock
+    struct held
+    {
+        held() = default;
+
+        explicit held(const entry &from)
+            : result(from.result), inflated_size(from.inflated_size), with_dictionary(from.with_dictionary) {}
+
+        lookup_result_ptr result;
+        size_t inflated_size = 0;
+        bool with_dictionary = false;
+    };
+
+    // A copy of result holding its payload deflated, or result itself if
+    // deflating would not shrink it.  Sets inflated_size and with_dictionary
+    // for the copy.
+    lookup_result_ptr deflated(lookup_result_ptr result, size_t &inflated_size, bool &with_dictionary)
+    {
+        with_dictionary = trained.load(std::memory_order_acquire);
+        if (!with_dictionary)
+        {
+            train(result->payload);
+        }
+        std::string packed;
+        if (!lookup_compressor::deflate(result->payload, with_dictionary ? dictionary : std::string_view(), packed) ||
+            packed.size() >= result->payload.size())
+        {
+            return result;
+        }
+        inflated_size = result->payload.size();
+        return with_payload(*result, std::move(packed));
+    }
+
+    // The result an entry stands for: its own if held as it is, otherwise a
+    // fresh copy with the payload inflated.  nullptr if inflating fails.
+    lookup_result_ptr restore(const held &found)
+    {
+        if (found.inflated_size == 0)
+        {
+            return found.result;
+        }
+        std::string payload;
+        if (!lookup_compressor::inflate(found.result->payload, found.inflated_size,
+                                        found.with_dictionary ? dictionary : std::string_view(), payload))
+        {
+            return nullptr;
+        }
+        return with_payload(*found.result, std::move(payload));
+    }
+
+    // A copy of from carrying payload instead of its own
+    static lookup_result_ptr with_payload(const lookup_result &from, std::string payload)
+    {
+        auto copy = std::make_shared<lookup_result>();
+        copy->id = from.id;
+        copy->timestamp = from.timestamp;
+        copy->created = from.created;
+        copy->dispatched = from.dispatched;
+        copy->status = from.status;
+        copy->outcome = from.outcome;
+        copy->hedged = from.hedged;
+        copy->hedge_won = from.hedge_won;
+        copy->timings = from.timings;
+        copy->payload = std::move(payload);
+        return copy;
+    }
+
+    // Add a payload to the dictionary being trained.  Payloads are appended
+    // until dictionary_bytes is reached; the dictionary is then frozen and
+    // used for every payload deflated afterwards.  Payloads deflated while it
+    // is still being trained are deflated without it.
+    void train(const std::string &payload)
+    {
+        std::lock_guard<std::mutex> lock(training);
+        if (options.dictionary_bytes == 0 || trained.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        size_t room = options.dictionary_bytes - dictionary.size();
+        dictionary.append(payload, 0, room);
+        if (dictionary.size() >= options.dictionary_bytes)
+        {
+            trained.store(true, std::memory_order_release);
+        }
+    }
+
+    // Approximate the heap cost of an entry, including list and index nodes
+    static size_t entry_size(const lookup_result &result)
+    {
+        return sizeof(entry) + sizeof(lookup_result) + result.id.size() + result.payload.size() + 64;
+    }
+
+    // Unlink an entry.  Caller holds accessor.
+    void erase(std::list<entry>::iterator it)
+    {
+        bytes -= it->size;
+        if (it->inflated_size)
+        {
+            compressed_entries--;
+            compressed_savings -= it->inflated_size - it->result->payload.size();
+        }
+        index.erase(std::string_view(it->result->id));
+        lru.erase(it);
+    }
+
+    lookup_cache_options options;
+
+    // Entries ordered from most to least recently used
+    std::list<entry> lru;
+
+    // Index into lru keyed by views of the entries' own ids
+    std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+
+    // Bytes charged to the current entries
+    size_t bytes = 0;
+
+    size_t compressed_entries = 0;
+    size_t compressed_savings = 0;
+
+    // Protect access to lru, index, bytes and the compression counters
+    std::mutex accessor;
+
+    // Preset dictionary, appended to under training until trained is set and
+    // read without a lock afterwards
+    std::string dictionary;
+    std::mutex training;
+    std::atomic<bool> trained{false};
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> insertions{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> expirations{0};
+    std::atomic<uint64_t> stale_hits{0};
+    std::atomic<uint64_t> refresh_requests{0};
+};
+
+// Cache policy of basic_lookup_get that keeps nothing, for callers that never
+// ask for an id twice or want every lookup to reach the server.  Concurrent
+// requests for an id still share one flight.
+class lookup_no_cache
+{
+public:
+    lookup_no_cache(const lookup_cache_options & = lookup_cache_options()) {}
+
+    lookup_result_ptr find(const std::string &, bool &refresh)
+    {
+        refresh = false;
+        return nullptr;
+    }
+
+    lookup_result_ptr find(const std::string &)
+    {
+        return nullptr;
+    }
+
+    lookup_result_ptr peek(const std::string &)
+    {
+        return nullptr;
+    }
+
+    bool contains(const std::string &)
+    {
+        return false;
+    }
+
+    void insert(lookup_result_ptr, std::chrono::milliseconds = std::chrono::milliseconds::zero()) {}
+
+    void clear() {}
+
+    lookup_cache_stats stats()
+    {
+        return lookup_cache_stats();
+    }
+};
+
+#endif /* LOOKUP_CACHE_CPP_INCLUDED */
@@ -0,0 +1,120 @@
+#ifndef LOOKUP_COMPRESS_CPP_INCLUDED
+#define LOOKUP_COMPRESS_CPP_INCLUDED
+
+// lookup_compress
+// Author: Jordan Chandler
+
+// Raw deflate of payloads kept by lookup_cache, optionally against a preset
+// dictionary.
+//
+// Setting up a zlib stream allocates a few hundred kilobytes, far more than a
+// typical payload, so each thread keeps one deflate and one inflate stream
+// for its lifetime and resets them between payloads.  Streams are raw (no
+// zlib header or checksum): the caller records the inflated size and trusts
+// its own memory.  A dictionary made of typical payloads lets short JSON
+// objects, too small to repeat anything within themselves, refer to the keys
+// and values every payload shares.
+
+#include <string>
+#include <string_view>
+#include <zlib.h>
+
+class lookup_compressor
+{
+public:
+    // Deflate input into output against dictionary, which may be empty.
+    // Returns false if zlib fails.
+    static bool deflate(std::string_view input, std::string_view dictionary, std::string &output)
+    {
+        z_stream &stream = streams().deflater();
+        if (deflateReset(&stream) != Z_OK ||
+            (!dictionary.empty() &&
+             deflateSetDictionary(&stream, (const Bytef *)dictionary.data(), (uInt)dictionary.size()) != Z_OK))
+        {
+            return false;
+        }
+        output.resize(deflateBound(&stream, (uLong)input.size()));
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = (uInt)input.size();
+        stream.next_out = (Bytef *)&output[0];
+        stream.avail_out = (uInt)output.size();
+        if (::deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        {
+            return false;
+        }
+        output.resize(stream.total_out);
+        return true;
+    }
+
+    // Inflate input, which deflate() produced from size bytes against the same
+    // dictionary, into output.  Returns false if the data is damaged.
+    static bool inflate(std::string_view input, size_t size, std::string_view dictionary, std::string &output)
+    {
+        z_stream &stream = streams().inflater();
+        if (inflateReset(&stream) != Z_OK ||
+            (!dictionary.empty() &&
+             inflateSetDictionary(&stream, (const Bytef *)dictionary.data(), (uInt)dictionary.size()) != Z_OK))
+        {
+            return false;
+        }
+        output.resize(size);
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = (uInt)input.size();
+        stream.next_out = (Bytef *)&output[0];
+        stream.avail_out = (uInt)output.size();
+        return ::inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == size;
+    }
+
+private:
+    // The calling thread's streams, set up on first use
+    class thread_streams
+    {
+    public:
+        ~thread_streams()
+        {
+            if (deflating)
+            {
+                deflateEnd(&deflate_stream);
+            }
+            if (inflating)
+            {
+                inflateEnd(&inflate_stream);
+            }
+        }
+
+        z_stream &deflater()
+        {
+            if (!deflating)
+            {
+                deflate_stream = z_stream();
+                deflating = deflateInit2(&deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                                         Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+            return deflate_stream;
+        }
+
+        z_stream &inflater()
+        {
+            if (!inflating)
+            {
+                inflate_stream = z_stream();
+                inflating = inflateInit2(&inflate_stream, -MAX_WBITS) == Z_OK;
+            }
+            return inflate_stream;
+        }
+
+    private:
+        z_stream deflate_stream;
+        z_stream inflate_stream;
+        bool deflating = false;
+        bool inflating = false;
+    };
+
+    static thread_streams &streams()
+    {
+        thread_local thread_streams instance;
+        return instance;
+    }
+};
+
+#endif /* LOOKUP_COMPRESS_CPP_INCLUDED */
@@ -0,0 +1,799 @@
+#ifndef LOOKUP_DISK_CACHE_CPP_INCLUDED
+#define LOOKUP_DISK_CACHE_CPP_INCLUDED
+
+// lookup_disk_cache
+// Author: Jordan Chandler
+
+// Optional persistent cache tier so responses survive process restarts.
+//
+// Responses are appended to a log file (lookup.log) by a background writer
+// thread and located through an open-addressing hash index (lookup.idx) that
+// is memory mapped, so a cold start only maps the index instead of parsing
+// the log.  The index records how much of the log it covers; on open, any
+// records appended after that point are checked and indexed, and a torn tail
+// left by a crash is truncated at the first record whose checksum fails.
+// Superseded and expired records are dropped by compact(), which rewrites
+// the live records into a new log and index and renames them into place.
+//
+// Log layout:    log_header, then records of record_header + id + response
+// Index layout:  index_header, then capacity slots of {id hash, log offset}
+// Both headers carry the same generation number, so an index that does not
+// belong to the log beside it (for example after a crash during compaction)
+// is rebuilt from the log.  A directory is used by one process at a time.
+
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+// Location and sizing of a lookup_disk_cache
+struct lookup_disk_cache_options
+{
+    // Directory holding lookup.log and lookup.idx.  Empty disables the disk tier.
+    std::string directory;
+
+    // Initial number of index slots, rounded up to a power of two
+    uint64_t index_capacity = 64 * 1024;
+
+    // Compact automatically once the log is at least this large
+    // and more than half of it is superseded or expired records
+    uint64_t compact_min_bytes = 64 * 1024 * 1024;
+
+    // Shortest time between scans of the index for expired records, which
+    // count as dead for automatic compaction
+    std::chrono::milliseconds expiry_scan_interval = std::chrono::seconds(60);
+};
+
+// Snapshot of a lookup_disk_cache's counters
+struct lookup_disk_cache_stats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t recovered = 0;
+    uint64_t truncated_bytes = 0;
+    uint64_t compactions = 0;
+    uint64_t entries = 0;
+    uint64_t log_bytes = 0;
+    uint64_t live_bytes = 0;
+};
+
+class lookup_disk_cache
+{
+public:
+    lookup_disk_cache(const lookup_disk_cache_options &options)
+        : options(options) {}
+
+    ~lookup_disk_cache()
+    {
+        if (writer.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(pending_accessor);
+                stopping = true;
+            }
+            pending_ready.notify_one();
+            writer.join();
+        }
+        unmap_index();
+        if (log_fd >= 0)
+        {
+            ::close(log_fd);
+        }
+    }
+
+    lookup_disk_cache(const lookup_disk_cache &) = delete;
+    lookup_disk_cache &operator=(const lookup_disk_cache &) = delete;
+
+    // Map the cache in options.directory, creating it if needed, and recover
+    // records appended since the index was last updated.  Returns false if the
+    // files cannot be opened.
+    bool open()
+    {
+        ::mkdir(options.directory.c_str(), 0755);
+        log_path = options.directory + "/lookup.log";
+        index_path = options.directory + "/lookup.idx";
+
+        log_fd = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (log_fd < 0)
+        {
+            std::cerr << "lookup_disk_cache: cannot open " << log_path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (flock(log_fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            std::cerr << "lookup_disk_cache: " << log_path << " is in use by another process" << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        fstat(log_fd, &st);
+        log_size = st.st_size;
+
+        log_header header;
+        if (log_size < sizeof(log_header) ||
+            pread(log_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, log_magic, sizeof(header.magic)) != 0)
+        {
+            // New or unrecognized log: start an empty one
+            memcpy(header.magic, log_magic, sizeof(header.magic));
+            header.generation = new_generation();
+            if (ftruncate(log_fd, 0) != 0 ||
+                pwrite(log_fd, &header, sizeof(header), 0) != sizeof(header))
+            {
+                return false;
+            }
+            log_size = sizeof(header);
+        }
+        generation = header.generation;
+
+        if (!map_index(index_path, false) || !index_matches_log())
+        {
+            // Missing, damaged or stale index: rebuild it from the whole log
+            unmap_index();
+            if (!create_index(index_path, options.index_capacity, generation))
+            {
+                return false;
+            }
+        }
+
+        recover();
+
+        writer = std::thread(&lookup_disk_cache::write_loop, this);
+        return true;
+    }
+
+    // Find a live response for id.  remaining receives its remaining lifetime.
+    bool find(const std::string &id, long &status, std::string &response, std::chrono::milliseconds &remaining)
+    {
+        uint64_t hash = hash_id(id);
+        std::shared_lock<std::shared_mutex> lock(index_accessor);
+        uint64_t offset = locate(hash, id);
+        record_header header;
+        if (offset == 0 || !read_record(offset, header, nullptr, &response))
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        int64_t now = wall_clock_ms();
+        if (header.expires <= now)
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        status = header.status;
+        remaining = std::chrono::milliseconds(header.expires - now);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Queue a response to be appended by the writer thread
+    void store(const std::string &id, long status, const std::string &response, std::chrono::milliseconds ttl)
+    {
+        if (status == 0 || status == 429)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pending_accessor);
+            pending.push_back(pending_write{id, status, response, wall_clock_ms() + ttl.count()});
+        }
+        pending_ready.notify_one();
+    }
+
+    // Wait until every queued response is in the log and the index
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(pending_accessor);
+        written.wait(lock, [&]() { return pending.empty() && !writing; });
+    }
+
+    // Rewrite the live, unexpired records into a new log and index
+    void compact()
+    {
+        flush();
+        std::unique_lock<std::shared_mutex> lock(index_accessor);
+        compact_locked();
+    }
+
+    lookup_disk_cache_stats stats()
+    {
+        lookup_disk_cache_stats snapshot;
+        snapshot.hits = hits.load(std::memory_order_relaxed);
+        snapshot.misses = misses.load(std::memory_order_relaxed);
+        snapshot.writes = writes.load(std::memory_order_relaxed);
+        snapshot.recovered = recovered;
+        snapshot.truncated_bytes = truncated_bytes;
+        snapshot.compactions = compactions.load(std::memory_order_relaxed);
+        std::shared_lock<std::shared_mutex> lock(index_accessor);
+        if (index)
+        {
+            snapshot.entries = index->count;
+            snapshot.live_bytes = index->live_bytes;
+        }
+        snapshot.log_bytes = log_size;
+        return snapshot;
+    }
+
+private:
+    static constexpr char log_magic[8] = {'L', 'K', 'U', 'P', 'L', 'O', 'G', '2'};
+    static constexpr char index_magic[8] = {'L', 'K', 'U', 'P', 'I', 'D', 'X', '1'};
+    static constexpr uint32_t record_magic = 0x4C4B5052;
+
+    struct log_header
+    {
+        char magic[8];
+        uint64_t generation;
+    };
+
+    struct record_header
+    {
+        uint32_t magic;
+        // Checksum of the rest of the header, the id and the response
+        uint32_t checksum;
+        // Wall clock expiry in milliseconds since the UNIX epoch
+        int64_t expires;
+        int32_t status;
+        uint32_t id_size;
+        uint32_t response_size;
+        uint32_t reserved;
+    };
+
+    struct index_header
+    {
+        char magic[8];
+        uint64_t generation;
+        uint64_t capacity;
+        uint64_t count;
+        // Length of the log covered by the index
+        uint64_t committed;
+        // Bytes of the log held by the records the index points to
+        uint64_t live_bytes;
+        uint64_t reserved[2];
+    };
+
+    struct index_slot
+    {
+        uint64_t hash;
+        // Offset of the record in the log.  0 marks an empty slot.
+        uint64_t offset;
+    };
+
+    struct pending_write
+    {
+        std::string id;
+        long status;
+        std::string response;
+        int64_t expires;
+    };
+
+    static int64_t wall_clock_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static uint64_t new_generation()
+    {
+        std::random_device rd;
+        return ((uint64_t)rd() << 32) ^ rd() ^ (uint64_t)wall_clock_ms();
+    }
+
+    // FNV-1a, 64 bit
+    static uint64_t hash_id(const std::string &id)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : id)
+        {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // FNV-1a, 32 bit, continued from seed
+    static uint32_t checksum(const void *data, size_t size, uint32_t seed = 2166136261u)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        for (size_t i = 0; i < size; i++)
+        {
+            seed = (seed ^ bytes[i]) * 16777619u;
+        }
+        return seed;
+    }
+
+    static uint32_t record_checksum(const record_header &header, const char *id, const char *response)
+    {
+        uint32_t sum = checksum(&header.expires, sizeof(header) - offsetof(record_header, expires));
+        sum = checksum(id, header.id_size, sum);
+        return checksum(response, header.response_size, sum);
+    }
+
+    static uint64_t record_size(const record_header &header)
+    {
+        return sizeof(record_header) + header.id_size + header.response_size;
+    }
+
+    // Append a record for write to buffer
+    static void encode(std::string &buffer, const pending_write &write)
+    {
+        record_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = record_magic;
+        header.expires = write.expires;
+        header.status = (int32_t)write.status;
+        header.id_size = write.id.size();
+        header.response_size = write.response.size();
+        header.checksum = record_checksum(header, write.id.data(), write.response.data());
+        buffer.append((const char *)&header, sizeof(header));
+        buffer.append(write.id);
+        buffer.append(write.response);
+    }
+
+    // Read and verify the record at offset from fd.  id and response are optional.
+    bool read_record(uint64_t offset, record_header &header, std::string *id, std::string *response, int fd = -1)
+    {
+        fd = (fd < 0) ? log_fd : fd;
+        if (pread(fd, &header, sizeof(header), offset) != sizeof(header) || header.magic != record_magic)
+        {
+            return false;
+        }
+        std::string body(header.id_size + (size_t)header.response_size, '\0');
+        if (pread(fd, &body[0], body.size(), offset + sizeof(header)) != (ssize_t)body.size())
+        {
+            return false;
+        }
+        if (record_checksum(header, body.data(), body.data() + header.id_size) != header.checksum)
+        {
+            return false;
+        }
+        if (id)
+        {
+            id->assign(body, 0, header.id_size);
+        }
+        if (response)
+        {
+            response->assign(body, header.id_size, std::string::npos);
+        }
+        return true;
+    }
+
+    // Check the id stored at offset without reading the response
+    bool record_has_id(uint64_t offset, const std::string &id)
+    {
+        record_header header;
+        if (pread(log_fd, &header, sizeof(header), offset) != sizeof(header) ||
+            header.magic != record_magic || header.id_size != id.size())
+        {
+            return false;
+        }
+        std::string stored(id.size(), '\0');
+        return pread(log_fd, &stored[0], stored.size(), offset + sizeof(header)) == (ssize_t)stored.size() &&
+               stored == id;
+    }
+
+    // Offset of id's newest record, or 0.  Caller holds index_accessor.
+    uint64_t locate(uint64_t hash, const std::string &id)
+    {
+        if (!index)
+        {
+            return 0;
+        }
+        uint64_t mask = index->capacity - 1;
+        for (uint64_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++)
+        {
+            index_slot &slot = slots[i];
+            if (slot.offset == 0)
+            {
+                return 0;
+            }
+            if (slot.hash == hash && record_has_id(slot.offset, id))
+            {
+                return slot.offset;
+            }
+        }
+        return 0;
+    }
+
+    // Point id's slot at the record at offset.  Caller holds index_accessor exclusively.
+    void index_insert(const std::string &id, uint64_t offset, uint64_t size)
+    {
+        if ((index->count + 1) * 10 > index->capacity * 7 && !grow_index() &&
+            index->count + 1 >= index->capacity)
+        {
+            // Full and unable to grow: leave the record unindexed
+            return;
+        }
+        uint64_t hash = hash_id(id);
+        uint64_t mask = index->capacity - 1;
+        for (uint64_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            index_slot &slot = slots[i];
+            if (slot.offset == 0)
+            {
+                // Write the hash before the offset that marks the slot as used
+                slot.hash = hash;
+                slot.offset = offset;
+                index->count++;
+                index->live_bytes += size;
+                return;
+            }
+            if (slot.hash == hash && record_has_id(slot.offset, id))
+            {
+                record_header old;
+                if (pread(log_fd, &old, sizeof(old), slot.offset) == sizeof(old))
+                {
+                    index->live_bytes -= std::min<uint64_t>(index->live_bytes, record_size(old));
+                }
+                slot.offset = offset;
+                index->live_bytes += size;
+                return;
+            }
+        }
+    }
+
+    // Map an existing index file, or create one when create is set
+    bool map_index(const std::string &path, bool create)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0) | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        if (!create && (size_t)st.st_size < sizeof(index_header))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        index = (index_header *)mapping;
+        index_bytes = st.st_size;
+        slots = (index_slot *)(index + 1);
+        return true;
+    }
+
+    void unmap_index()
+    {
+        if (index)
+        {
+            msync(index, index_bytes, MS_ASYNC);
+            munmap(index, index_bytes);
+            index = nullptr;
+            slots = nullptr;
+            index_bytes = 0;
+        }
+    }
+
+    bool index_matches_log()
+    {
+        uint64_t capacity = index->capacity;
+        return memcmp(index->magic, index_magic, sizeof(index->magic)) == 0 &&
+               index->generation == generation &&
+               capacity >= 2 && (capacity & (capacity - 1)) == 0 &&
+               index_bytes == sizeof(index_header) + capacity * sizeof(index_slot) &&
+               index->committed >= sizeof(log_header) && index->committed <= log_size;
+    }
+
+    // Create and map an empty index with at least capacity slots
+    bool create_index(const std::string &path, uint64_t capacity, uint64_t index_generation)
+    {
+        uint64_t count = 2;
+        while (count < capacity)
+        {
+            count <<= 1;
+        }
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(index_header) + count * sizeof(index_slot)) != 0)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            return false;
+        }
+        ::close(fd);
+        if (!map_index(path, false))
+        {
+            return false;
+        }
+        memcpy(index->magic, index_magic, sizeof(index->magic));
+        index->generation = index_generation;
+        index->capacity = count;
+        index->count = 0;
+        index->committed = sizeof(log_header);
+        index->live_bytes = 0;
+        return true;
+    }
+
+    // Double the index, rehashing slots by their stored hashes.
+    // The new index is built beside the old one and renamed over it.
+    bool grow_index()
+    {
+        std::string grown_path = index_path + ".grow";
+        index_header *old_index = index;
+        index_slot *old_slots = slots;
+        size_t old_bytes = index_bytes;
+        index = nullptr;
+
+        if (!create_index(grown_path, old_index->capacity * 2, old_index->generation))
+        {
+            // Keep probing the full index rather than failing the write
+            index = old_index;
+            slots = old_slots;
+            index_bytes = old_bytes;
+            return false;
+        }
+        uint64_t mask = index->capacity - 1;
+        for (uint64_t i = 0; i < old_index->capacity; i++)
+        {
+            if (old_slots[i].offset == 0)
+            {
+                continue;
+            }
+            uint64_t j = old_slots[i].hash & mask;
+            while (slots[j].offset != 0)
+            {
+                j = (j + 1) & mask;
+            }
+            slots[j] = old_slots[i];
+        }
+        index->count = old_index->count;
+        index->committed = old_index->committed;
+        index->live_bytes = old_index->live_bytes;
+        msync(index, index_bytes, MS_SYNC);
+        rename(grown_path.c_str(), index_path.c_str());
+        munmap(old_index, old_bytes);
+        return true;
+    }
+
+    // Index records appended after the index's committed length and truncate a torn tail
+    void recover()
+    {
+        uint64_t offset = index->committed;
+        record_header header;
+        std::string id;
+        while (offset + sizeof(record_header) <= log_size)
+        {
+            if (!read_record(offset, header, &id, nullptr) || offset + record_size(header) > log_size)
+            {
+                break;
+            }
+            index_insert(id, offset, record_size(header));
+            offset += record_size(header);
+            recovered++;
+        }
+        if (offset < log_size)
+        {
+            truncated_bytes = log_size - offset;
+            if (ftruncate(log_fd, offset) == 0)
+            {
+                log_size = offset;
+            }
+        }
+        index->committed = log_size;
+    }
+
+    // Append queued responses in batches until the cache is destroyed
+    void write_loop()
+    {
+        std::unique_lock<std::mutex> lock(pending_accessor);
+        while (true)
+        {
+            pending_ready.wait(lock, [&]() { return stopping || !pending.empty(); });
+            if (pending.empty() && stopping)
+            {
+                break;
+            }
+            std::deque<pending_write> batch;
+            batch.swap(pending);
+            writing = true;
+            lock.unlock();
+
+            append(batch);
+
+            lock.lock();
+            writing = false;
+            written.notify_all();
+        }
+    }
+
+    void append(const std::deque<pending_write> &batch)
+    {
+        std::string buffer;
+        std::vector<uint64_t> sizes;
+        for (const auto &write : batch)
+        {
+            size_t before = buffer.size();
+            encode(buffer, write);
+            sizes.push_back(buffer.size() - before);
+        }
+
+        std::unique_lock<std::shared_mutex> lock(index_accessor);
+        if (pwrite(log_fd, buffer.data(), buffer.size(), log_size) != (ssize_t)buffer.size())
+        {
+            // Leave the tail for recovery to truncate and drop the batch
+            return;
+        }
+        uint64_t offset = log_size;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            index_insert(batch[i].id, offset, sizes[i]);
+            offset += sizes[i];
+        }
+        log_size = offset;
+        index->committed = log_size;
+        writes.fetch_add(batch.size(), std::memory_order_relaxed);
+
+        if (log_size < options.compact_min_bytes)
+        {
+            return;
+        }
+        // Superseded records alone are enough to compact; otherwise count the
+        // records that expired in place, at most once per expiry_scan_interval
+        uint64_t dead_bytes = log_size - std::min(log_size, index->live_bytes);
+        auto now = std::chrono::steady_clock::now();
+        if (dead_bytes * 2 <= log_size && now - last_expiry_scan >= options.expiry_scan_interval)
+        {
+            last_expiry_scan = now;
+            dead_bytes += expired_bytes();
+        }
+        if (dead_bytes * 2 > log_size)
+        {
+            compact_locked();
+        }
+    }
+
+    // Bytes of the indexed records that have expired.  Caller holds index_accessor.
+    uint64_t expired_bytes()
+    {
+        int64_t now = wall_clock_ms();
+        uint64_t bytes = 0;
+        record_header header;
+        for (uint64_t i = 0; i < index->capacity; i++)
+        {
+            if (slots[i].offset != 0 && pread(log_fd, &header, sizeof(header), slots[i].offset) == sizeof(header) &&
+                header.expires <= now)
+            {
+                bytes += record_size(header);
+            }
+        }
+        return bytes;
+    }
+
+    // Caller holds index_accessor exclusively
+    void compact_locked()
+    {
+        std::string compact_log_path = log_path + ".compact";
+        std::string compact_index_path = index_path + ".compact";
+        int compact_fd = ::open(compact_log_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (compact_fd < 0)
+        {
+            return;
+        }
+        flock(compact_fd, LOCK_EX | LOCK_NB);
+
+        log_header header;
+        memcpy(header.magic, log_magic, sizeof(header.magic));
+        header.generation = new_generation();
+        std::string buffer((const char *)&header, sizeof(header));
+
+        // Copy the live records, remembering where each lands
+        std::vector<std::pair<uint64_t, uint64_t>> moved;
+        int64_t now = wall_clock_ms();
+        record_header record;
+        std::string id;
+        std::string response;
+        for (uint64_t i = 0; i < index->capacity; i++)
+        {
+            if (slots[i].offset == 0 || !read_record(slots[i].offset, record, &id, &response) ||
+                record.expires <= now)
+            {
+                continue;
+            }
+            moved.emplace_back(slots[i].hash, buffer.size());
+            buffer.append((const char *)&record, sizeof(record));
+            buffer.append(id);
+            buffer.append(response);
+        }
+        bool ok = pwrite(compact_fd, buffer.data(), buffer.size(), 0) == (ssize_t)buffer.size() &&
+                  fdatasync(compact_fd) == 0;
+
+        index_header *old_index = index;
+        index_slot *old_slots = slots;
+        size_t old_bytes = index_bytes;
+        index = nullptr;
+        if (!ok || !create_index(compact_index_path, std::max<uint64_t>(options.index_capacity, moved.size() * 2), header.generation))
+        {
+            ::close(compact_fd);
+            index = old_index;
+            slots = old_slots;
+            index_bytes = old_bytes;
+            return;
+        }
+        uint64_t mask = index->capacity - 1;
+        for (const auto &entry : moved)
+        {
+            uint64_t j = entry.first & mask;
+            while (slots[j].offset != 0)
+            {
+                j = (j + 1) & mask;
+            }
+            slots[j].hash = entry.first;
+            slots[j].offset = entry.second;
+        }
+        index->count = moved.size();
+        index->committed = buffer.size();
+        index->live_bytes = buffer.size() - sizeof(header);
+        msync(index, index_bytes, MS_SYNC);
+
+        // A crash between the renames leaves a log whose generation the index
+        // does not match, and the index is rebuilt from the log on open.
+        rename(compact_log_path.c_str(), log_path.c_str());
+        rename(compact_index_path.c_str(), index_path.c_str());
+        munmap(old_index, old_bytes);
+        ::close(log_fd);
+        log_fd = compact_fd;
+        log_size = buffer.size();
+        generation = header.generation;
+        compactions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    lookup_disk_cache_options options;
+    std::string log_path;
+    std::string index_path;
+
+    int log_fd = -1;
+    uint64_t log_size = 0;
+    uint64_t generation = 0;
+
+    // When append() last counted expired records.  Only touched by the writer thread.
+    std::chrono::steady_clock::time_point last_expiry_scan;
+
+    // Memory mapped index
+    index_header *index = nullptr;
+    index_slot *slots = nullptr;
+    size_t index_bytes = 0;
+
+    // Readers share the index; the writer and compaction take it exclusively
+    std::shared_mutex index_accessor;
+
+    // Responses waiting for the writer thread
+    std::deque<pending_write> pending;
+    bool writing = false;
+    bool stopping = false;
+    std::mutex pending_accessor;
+    std::condition_variable pending_ready;
+    std::condition_variable written;
+    std::thread writer;
+
+    uint64_t recovered = 0;
+    uint64_t truncated_bytes = 0;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> compactions{0};
+};
+
+#endif /* LOOKUP_DISK_CACHE_CPP_INCLUDED */
@@ -0,0 +1,257 @@
+#ifndef LOOKUP_FLIGHT_CPP_INCLUDED
+#define LOOKUP_FLIGHT_CPP_INCLUDED
+
+// lookup_flight
+// Author: Jordan Chandler
+
+// Single-flight table of the requests a lookup_get instance has outstanding.
+//
+// The first caller to ask for an id that is not cached becomes the leader of
+// a new flight and queues it for a worker.  Every later caller asking for the
+// same id while the flight is outstanding joins it instead of issuing another
+// request: it either waits on the flight's shared future or leaves a waiter
+// callback.  When the worker completes the flight, the flight is removed from
+// the table and its result is handed to every waiter and to the future.
+// Like lookup_table, ids are spread over independently locked shards.
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <unordered_map>
+#include <functional>
+#include <curl/curl.h>
+
+#include "lookup_result.cpp"
+
+// Server a flight's request is sent to
+struct lookup_endpoint
+{
+    lookup_endpoint(const std::string &base_url, unsigned long port, const std::string &authorization_token)
+        : base_url(base_url), port(port), authorization_token(authorization_token)
+    {
+        std::string authorization_header = "Authorization: " + authorization_token;
+        headers = curl_slist_append(headers, "Accept: text/json");
+        headers = curl_slist_append(headers, authorization_header.c_str());
+    }
+
+    ~lookup_endpoint()
+    {
+        curl_slist_free_all(headers);
+    }
+
+    lookup_endpoint(const lookup_endpoint &) = delete;
+    lookup_endpoint &operator=(const lookup_endpoint &) = delete;
+
+    std::string base_url;
+    unsigned long port;
+    std::string authorization_token;
+
+    // HTTP headers sent with every request to the endpoint
+    struct curl_slist *headers = NULL;
+};
+
+// Dispatch classes, most urgent first.  prefetch only takes request slots
+// no other class is waiting for; see lookup_scheduler.
+enum class lookup_priority
+{
+    interactive,
+    batch,
+    prefetch
+};
+
+constexpr size_t lookup_priority_count = 3;
+
+// How urgently a caller needs the ids it asks for
+struct lookup_dispatch
+{
+    lookup_priority priority = lookup_priority::interactive;
+
+    // Ids not yet requested by then are dropped and delivered as expired results
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    // Dispatch with a deadline timeout from now
+    static lookup_dispatch within(std::chrono::steady_clock::duration timeout,
+                                  lookup_priority priority = lookup_priority::interactive)
+    {
+        lookup_dispatch dispatch;
+        dispatch.priority = priority;
+        dispatch.deadline = std::chrono::steady_clock::now() + timeout;
+        return dispatch;
+    }
+};
+
+// Called with the result of a flight the caller joined
+using lookup_waiter = std::function<void(const lookup_result_ptr &result)>;
+
+// Result of a submitted id, shared by every caller that asked for it
+using lookup_future = std::shared_future<lookup_result_ptr>;
+
+// One outstanding request
+struct lookup_flight
+{
+    lookup_flight(const std::string &id, std::shared_ptr<const lookup_endpoint> endpoint)
+        : id(id), endpoint(std::move(endpoint)), future(promise.get_future().share()),
+          created(std::chrono::steady_clock::now()) {}
+
+    const std::string id;
+    const std::shared_ptr<const lookup_endpoint> endpoint;
+
+    std::promise<lookup_result_ptr> promise;
+    const lookup_future future;
+
+    // When the first caller asked for the id
+    const std::chrono::steady_clock::time_point created;
+
+    // Callbacks of joined callers.  Guarded by the owning shard's lock.
+    std::vector<lookup_waiter> waiters;
+
+    // Callers still waiting for the result.  Changed under the owning shard's
+    // lock; read without it by workers deciding whether to abandon the flight.
+    std::atomic<unsigned int> interest{0};
+
+    // Number of 429 responses received so far, and when a worker last took a
+    // request slot for the flight.  Only touched by the worker holding the flight.
+    unsigned int retries = 0;
+    std::chrono::steady_clock::time_point dispatched;
+
+    // Replicas the flight was sent to again after a request failed without an
+    // answer, and the replica it last failed at, or -1.  Only touched by the
+    // worker holding the flight.
+    unsigned int failovers = 0;
+    int failed_replica = -1;
+
+    // Most urgent class and latest deadline of the callers that joined,
+    // and whether the flight is waiting for a worker.
+    // Guarded by the lookup_scheduler's lock.
+    lookup_priority priority = lookup_priority::interactive;
+    std::chrono::steady_clock::time_point deadline;
+    bool queued = false;
+};
+
+class lookup_flights
+{
+public:
+    // shard_count is rounded up to a power of two
+    lookup_flights(size_t shard_count = 64)
+    {
+        size_t count = 1;
+        while (count < shard_count)
+        {
+            count <<= 1;
+        }
+        shards.reset(new shard[count]);
+        mask = count - 1;
+    }
+
+    // Join the outstanding flight for id, or start one if there is none.
+    // waiter, if set, is called with the flight's result.
+    // leader is set when a new flight was started; the caller must then see it completed.
+    std::shared_ptr<lookup_flight> join(
+        const std::string &id,
+        const std::shared_ptr<const lookup_endpoint> &endpoint,
+        lookup_waiter waiter,
+        bool &leader)
+    {
+        shard &s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.accessor);
+        auto it = s.flights.find(id);
+        leader = (it == s.flights.end());
+        if (leader)
+        {
+            auto flight = std::make_shared<lookup_flight>(id, endpoint);
+            it = s.flights.emplace(std::string_view(flight->id), std::move(flight)).first;
+        }
+        if (waiter)
+        {
+            it->second->waiters.push_back(std::move(waiter));
+        }
+        it->second->interest.fetch_add(1, std::memory_order_relaxed);
+        return it->second;
+    }
+
+    // Withdraw one caller's interest in a flight it joined
+    void release(const std::shared_ptr<lookup_flight> &flight)
+    {
+        shard &s = shard_for(flight->id);
+        std::lock_guard<std::mutex> lock(s.accessor);
+        flight->interest.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Remove a flight nobody is waiting for from the table, so callers that
+    // arrive later start a new one.  Returns false if a caller still waits, in
+    // which case the flight must still be completed normally.  After a true
+    // return the caller completes the flight to hand the remaining waiters,
+    // which are no longer interested, their result.
+    bool abandon(const std::shared_ptr<lookup_flight> &flight)
+    {
+        shard &s = shard_for(flight->id);
+        std::lock_guard<std::mutex> lock(s.accessor);
+        if (flight->interest.load(std::memory_order_relaxed) != 0)
+        {
+            return false;
+        }
+        auto it = s.flights.find(flight->id);
+        if (it != s.flights.end() && it->second == flight)
+        {
+            s.flights.erase(it);
+        }
+        return true;
+    }
+
+    // Remove a flight from the table and hand its result to everyone who joined it.
+    // Callers that arrive afterwards start a new flight, so the result should be
+    // cached before the flight is completed.
+    void complete(const std::shared_ptr<lookup_flight> &flight, const lookup_result_ptr &result)
+    {
+        std::vector<lookup_waiter> waiters;
+        {
+            shard &s = shard_for(flight->id);
+            std::lock_guard<std::mutex> lock(s.accessor);
+            auto it = s.flights.find(flight->id);
+            if (it != s.flights.end() && it->second == flight)
+            {
+                s.flights.erase(it);
+            }
+            waiters.swap(flight->waiters);
+        }
+        flight->promise.set_value(result);
+        for (auto &waiter : waiters)
+        {
+            waiter(result);
+        }
+    }
+
+    // Check for an outstanding flight for id
+    bool contains(const std::string &id)
+    {
+        shard &s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.accessor);
+        return s.flights.find(id) != s.flights.end();
+    }
+
+private:
+    struct alignas(64) shard
+    {
+        std::mutex accessor;
+        // Keyed by views of the flights' own ids, so each id is stored once
+        std::unordered_map<std::string_view, std::shared_ptr<lookup_flight>> flights;
+    };
+
+    shard &shard_for(const std::string &id)
+    {
+        // Use the high bits so the shard choice is independent of the
+        // low bits the shard's own hash map buckets on.
+        size_t hash = std::hash<std::string>{}(id);
+        return shards[(hash >> 32 ^ hash >> 16) & mask];
+    }
+
+    std::unique_ptr<shard[]> shards;
+    size_t mask;
+};
+
+#endif /* LOOKUP_FLIGHT_CPP_INCLUDED */
@@ -32,11 +32,33 @@
 #include <limits>
 #include <cstring>
 #include <map>
-#include <queue>
 #include <random>
 #include <algorithm>
 #include <ctime>
 #include <chrono>
+#include <vector>
+#include <string_view>
+#include <unordered_set>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <future>
+#include <array>
+
+#include "lookup_result.cpp"
+#include "lookup_cache.cpp"
+#include "lookup_disk_cache.cpp"
+#include "lookup_shared.cpp"
+#include "lookup_table.cpp"
+#include "lookup_flight.cpp"
+#include "lookup_route.cpp"
+#include "lookup_scheduler.cpp"
+#include "lookup_stop.cpp"
+#include "lookup_pool.cpp"
+#include "lookup_transport.cpp"
+#include "lookup_metrics.cpp"
+#include "lookup_ids.cpp"
+#include "lookup_trace.cpp"
 
 // Classic counting semaphore class implemented using
 // std::mutexes and std::condition_variables
@@ -44,9 +66,7 @@ class semaphore
 {
 public:
     semaphore() noexcept
-    {
-        semaphore(0);
-    }
+        : semaphore(0) {}
 
     semaphore(int count) noexcept
         : m_count(count) { assert(count > -1); }
@@ -79,9 +99,7 @@ class fast_semaphore
 {
 public:
     fast_semaphore() noexcept
-    {
-        fast_semaphore(0);
-    }
+        : fast_semaphore(0) {}
 
     fast_semaphore(int count) noexcept
         : m_count(count), m_semaphore(0) {}
@@ -100,266 +118,2243 @@ public:
             m_semaphore.wait();
     }
 
+    // Take a count only if one is immediately available.  Never blocks, so it
+    // is safe to call from an event loop that must keep servicing transfers.
+    bool try_wait()
+    {
+        int count = m_count.load(std::memory_order_relaxed);
+        while (count > 0)
+        {
+            if (m_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
 private:
     std::atomic<int> m_count;
     semaphore m_semaphore;
 };
 
-class lookup_get
+// Settings for lookup_limiter
+struct lookup_limiter_options
 {
+    // Adapt the number of request slots to the server's effective concurrency
+    // instead of holding it at the caller's max_requests
+    bool adaptive = false;
+
+    // Most request slots an adaptive limiter may grow to
+    unsigned int max_limit = 64;
+
+    // Fewest request slots an adaptive limiter may shrink to
+    unsigned int min_limit = 1;
 
+    // Factor applied to the limit on a 429 response
+    double decrease = 0.7;
+
+    // Latency above this multiple of the lowest latency seen counts as congestion
+    double latency_tolerance = 3.0;
+};
+
+// Request slot gate built on fast_semaphore.
+//
+// In adaptive mode the number of slots follows additive-increase/multiplicative-decrease:
+// every successful response grows the limit by 1/limit (about one slot per round trip),
+// while a 429 response multiplies it by decrease and a response slower than
+// latency_tolerance times the fastest one shrinks it gently.  Decreases are applied at
+// most once per smoothed round trip so one burst of 429s counts as one congestion event.
+// The limit is changed by posting extra slots or by swallowing returned ones, so waiters
+// keep using fast_semaphore's atomic fast path.
+class lookup_limiter
+{
 public:
-    lookup_get(){};
+    // Hand out initial slots (or the limit learned by earlier calls in adaptive mode)
+    void reset(unsigned int initial, const lookup_limiter_options &limiter_options)
+    {
+        std::unique_lock<std::mutex> lock(accessor);
+        options = limiter_options;
+        if (!options.adaptive || current == 0)
+        {
+            current = initial;
+        }
+        if (options.adaptive)
+        {
+            current = std::min<double>(std::max<double>(current, options.min_limit), options.max_limit);
+        }
+        granted = (unsigned int)current;
+        lock.unlock();
 
-    std::map<std::string, std::string> request(
-        const std::vector<std::string> &ids,
-        const std::string base_url,
-        const unsigned long port,
-        const std::string authorization_token,
-        const unsigned int max_requests)
+        for (unsigned int i = 0; i < granted; i++)
+        {
+            slots.post();
+        }
+    }
+
+    void wait()
+    {
+        slots.wait();
+    }
+
+    bool try_wait()
+    {
+        return slots.try_wait();
+    }
+
+    // Return a slot that was taken but not used for a request
+    void post()
+    {
+        slots.post();
+    }
+
+    // Return a slot after a response with the given HTTP status and latency
+    void post(long http_code, std::chrono::microseconds latency)
     {
-        // Load up the request slots specified by caller
-        for (int i = 0; i < max_requests; i++)
+        if (!options.adaptive)
+        {
+            slots.post();
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(accessor);
+        auto now = std::chrono::steady_clock::now();
+        if (http_code != 0 && http_code != 429)
         {
-            request_slot.post();
+            smoothed = (smoothed.count() == 0) ? latency : (smoothed * 7 + latency) / 8;
+            if (fastest.count() == 0 || latency < fastest)
+            {
+                fastest = latency;
+            }
         }
+        bool cooled = (now - last_decrease) >= smoothed;
 
-        // Queue the requests
-        for (auto id : ids)
+        if (http_code == 429)
+        {
+            if (cooled)
+            {
+                current = std::max<double>(current * options.decrease, options.min_limit);
+                last_decrease = now;
+            }
+        }
+        else if (http_code != 0)
         {
-            requests.push(id);
+            if (latency > fastest * options.latency_tolerance)
+            {
+                if (cooled)
+                {
+                    current = std::max<double>(current * 0.9, options.min_limit);
+                    last_decrease = now;
+                }
+            }
+            else
+            {
+                current = std::min<double>(current + 1.0 / current, options.max_limit);
+            }
         }
 
-        std::thread threads[max_requests];
+        // Grow by posting extra slots, shrink by keeping the returned one
+        unsigned int target = std::max(1u, (unsigned int)current);
+        unsigned int to_post = 1;
+        if (target > granted)
+        {
+            to_post += target - granted;
+            granted = target;
+        }
+        else if (target < granted)
+        {
+            to_post = 0;
+            granted--;
+        }
+        lock.unlock();
 
-        // Start workers
-        for (int worker_number = 0; worker_number < max_requests; worker_number++)
+        for (unsigned int i = 0; i < to_post; i++)
         {
-            threads[worker_number] = std::thread(&lookup_get::requestor, this, worker_number, base_url, port, authorization_token);
+            slots.post();
         }
+    }
+
+    // Current number of request slots
+    unsigned int limit()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return (unsigned int)current;
+    }
 
-        // Wait for threads to finish
-        for (int worker_number = 0; worker_number < max_requests; worker_number++)
+private:
+    fast_semaphore slots;
+
+    // Protect the adaptive state below
+    std::mutex accessor;
+    lookup_limiter_options options;
+    double current = 0;
+    unsigned int granted = 0;
+    std::chrono::microseconds smoothed{0};
+    std::chrono::microseconds fastest{0};
+    std::chrono::steady_clock::time_point last_decrease;
+};
+
+// Limiter policy of basic_lookup_get holding the number of request slots at
+// the budget.  lookup_limiter_options are ignored, so nothing is weighed or
+// locked when a slot is returned.
+class lookup_fixed_limiter
+{
+public:
+    void reset(unsigned int initial, const lookup_limiter_options &)
+    {
+        current = initial;
+        for (unsigned int i = 0; i < initial; i++)
         {
-            threads[worker_number].join();
+            slots.post();
         }
-        return responses;
+    }
+
+    void wait()
+    {
+        slots.wait();
+    }
+
+    bool try_wait()
+    {
+        return slots.try_wait();
+    }
+
+    void post()
+    {
+        slots.post();
+    }
+
+    void post(long, std::chrono::microseconds)
+    {
+        slots.post();
+    }
+
+    unsigned int limit()
+    {
+        return current.load(std::memory_order_relaxed);
     }
 
 private:
-    // Store the requests in a shared vector
-    std::queue<std::string> requests;
+    fast_semaphore slots;
+    std::atomic<unsigned int> current{0};
+};
 
-    // Protect access to the shared requests
-    std::mutex requests_accessor;
+// Settings for hedged requests
+struct lookup_hedge_options
+{
+    // Send a duplicate of a request that has run longer than most requests do,
+    // when a request slot would otherwise sit idle, and take whichever answers first.
+    // Only the multi engine hedges.
+    bool enabled = false;
 
-    // Fast semaphore hold number of requests slots
-    fast_semaphore request_slot;
+    // Latency quantile a request must run past before it is hedged
+    double quantile = 0.95;
 
-    // Store the responses in an associative map for caching loolup
-    std::map<std::string, std::string> responses;
+    // Completed requests needed before the quantile is trusted
+    size_t min_samples = 20;
+};
 
-    // Use a mutex to control access to the shared responses
-    std::mutex responses_accessor;
+// Quantile of the latencies of recent successful requests.
+// Only used by the thread running the multiplexor().
+class lookup_latency
+{
+public:
+    void record(std::chrono::microseconds latency)
+    {
+        samples[count++ % samples.size()] = latency;
+        if (count % 16 == 0)
+        {
+            stale = true;
+        }
+    }
 
-    // Memory structure pointing to requestor threads memory for HTTP response data
-    struct MemoryStruct
+    // The quantile q of the recorded latencies, or zero if there are fewer than min_samples
+    std::chrono::microseconds quantile(double q, size_t min_samples)
     {
-        char *memory;
-        size_t size;
-    };
+        size_t filled = std::min(count, samples.size());
+        if (filled < std::max<size_t>(min_samples, 1))
+        {
+            return std::chrono::microseconds(0);
+        }
+        if (stale || q != cached_q)
+        {
+            sorted.assign(samples.begin(), samples.begin() + filled);
+            size_t rank = std::min(filled - 1, (size_t)(q * filled));
+            std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+            cached = sorted[rank];
+            cached_q = q;
+            stale = false;
+        }
+        return cached;
+    }
+
+private:
+    std::array<std::chrono::microseconds, 256> samples;
+    std::vector<std::chrono::microseconds> sorted;
+    size_t count = 0;
+    bool stale = true;
+    double cached_q = 0;
+    std::chrono::microseconds cached{0};
+};
+
+// Transfer engines selectable through lookup_options
+enum class lookup_engine
+{
+    // One requestor() thread per request slot, each blocking in curl_easy_perform()
+    threaded,
+    // One multiplexor() event loop driving every transfer through the curl multi interface
+    multi
+};
+
+// Options that configure a lookup_get instance
+struct lookup_options
+{
+    lookup_engine engine = lookup_engine::threaded;
+
+    // Request slots shared by every caller of the instance.
+    // 0 takes the max_requests of the first request() call, or 5 if submit() is called first.
+    unsigned int max_requests = 0;
+
+    // Server used by submit().  request() and request_results() name their own.
+    std::string base_url;
+    unsigned long port = 8080;
+    std::string authorization_token;
+
+    // Replicas serving the server above.  When set, requests for it, whether
+    // from submit() or from calls naming the same base_url, port and token, are
+    // spread over the replicas instead, each behind its own gate, and the slot
+    // budget is the sum of their max_requests.  Requests to other servers are
+    // sent as named.
+    std::vector<lookup_replica_options> replicas;
+
+    // Balancing and ejection of the replicas
+    lookup_route_options routing;
+
+    // Most submitted ids waiting for a worker before submitters wait for room
+    size_t queue_capacity = 64 * 1024;
+
+    // Aging of the dispatch classes, so less urgent ids are not starved
+    lookup_scheduler_options scheduler;
+
+    // Sizing, expiry and refreshing of the response cache kept across request() calls
+    lookup_cache_options cache;
+
+    // Most background refreshes of cached ids outstanding at a time, so
+    // refreshing never takes every request slot.  0 allows half the slot
+    // budget, and at least one.
+    unsigned int max_refreshes = 0;
+
+    // Persistent cache tier checked after the response cache.
+    // Disabled unless disk_cache.directory is set.
+    lookup_disk_cache_options disk_cache;
+
+    // Request slots and results shared with every process on the host that opens
+    // the same segment.  Disabled unless shared.name is set.
+    lookup_shared_options shared;
+
+    // Adaptive request slot limit
+    lookup_limiter_options limiter;
+
+    // Keep-alive and HTTP version of the pooled curl handles
+    lookup_pool_options pool;
+
+    // Binary trace of every lookup served, for replaying the workload.
+    // Disabled unless trace.path is set.
+    lookup_trace_options trace;
+
+    // Longest time to connect to the server, and to complete a whole request
+    // including the connection.  A request exceeding either is abandoned and
+    // its result's outcome is timed_out.  Zero waits forever.
+    std::chrono::milliseconds connect_timeout = std::chrono::seconds(10);
+    std::chrono::milliseconds request_timeout = std::chrono::seconds(30);
+
+    // Duplicate requests sent to cut tail latency
+    lookup_hedge_options hedge;
+
+    // Delay before retrying an id that received a 429 response.
+    // The delay doubles with each retry of the id up to backoff_cap and is
+    // jittered between half and all of that value.
+    std::chrono::milliseconds backoff_base = std::chrono::milliseconds(10);
+    std::chrono::milliseconds backoff_cap = std::chrono::seconds(2);
+};
 
-    // callback function to writes chunks of curl response data to the requesting thread's MemoryStruct
-    static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp)
+// Receives one response, as its JSON envelope, as soon as it is ready.
+// May be invoked concurrently from several worker threads.
+using lookup_sink = std::function<void(const std::string &id, std::string response)>;
+
+// Receives one typed result as soon as it is ready.
+// May be invoked concurrently from several worker threads.
+using lookup_result_sink = std::function<void(const lookup_result_ptr &result)>;
+
+// Supplies the next id of a stream, returning false once there are no more.
+// Only invoked from the thread that called request_stream().
+using lookup_id_source = std::function<bool(std::string &id)>;
+
+// Long-lived lookup service meant to be shared by every thread of a process.
+//
+// Workers are started by the first call and run until the instance is destroyed,
+// taking ids from one queue and holding one global set of request slots, so
+// concurrent callers together never exceed the slot budget.  Requests for an id
+// that is already in flight, from the same or another caller, join that request
+// instead of issuing another (see lookup_flight.cpp).
+//
+// The parts an embedding program may not need are chosen at compile time:
+//   CachePolicy      lookup_cache, or lookup_no_cache
+//   QueuePolicy      lookup_scheduler, or lookup_fifo_scheduler
+//   LimiterPolicy    lookup_limiter, or lookup_fixed_limiter
+//   TransportPolicy  lookup_curl_transport, or lookup_fake_transport (see lookup_transport.cpp)
+//   ResultPolicy     lookup_payload_result, or lookup_status_result (see lookup_result.cpp)
+// Each policy is a member called directly, with nothing virtual, so the
+// compiler inlines it and a policy that does nothing costs nothing.
+// lookup_get is the instance with every feature.  A transport that cannot be
+// multiplexed runs the threaded engine whatever lookup_options::engine says.
+template <typename CachePolicy = lookup_cache,
+          typename QueuePolicy = lookup_scheduler,
+          typename LimiterPolicy = lookup_limiter,
+          typename TransportPolicy = lookup_curl_transport,
+          typename ResultPolicy = lookup_payload_result>
+class basic_lookup_get
+{
+
+public:
+    basic_lookup_get()
+        : basic_lookup_get(lookup_options()){};
+
+    basic_lookup_get(const lookup_options &options)
+        : basic_lookup_get(options, options.pool){};
+
+    // Construct with the transport configured by transport_options, such as
+    // the lookup_fake_options of a lookup_fake_transport
+    template <typename TransportOptions>
+    basic_lookup_get(const lookup_options &options, const TransportOptions &transport_options)
+        : options(options), cache(options.cache), transport(transport_options), scheduler(options.queue_capacity, options.scheduler),
+          default_endpoint(std::make_shared<const lookup_endpoint>(options.base_url, options.port, options.authorization_token))
     {
-        struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+        if (!options.disk_cache.directory.empty())
+        {
+            disk_cache.reset(new lookup_disk_cache(options.disk_cache));
+            if (!disk_cache->open())
+            {
+                // Carry on without the persistent tier
+                disk_cache.reset();
+            }
+        }
+        if (!options.replicas.empty())
+        {
+            router.reset(new lookup_router(options.replicas, options.routing));
+        }
+        if (!options.shared.name.empty())
+        {
+            shared.reset(new lookup_shared(options.shared));
+            if (!shared->open())
+            {
+                // Carry on with this instance's own slots and caches
+                shared.reset();
+            }
+        }
+        if (!options.trace.path.empty())
+        {
+            tracer.reset(new lookup_trace_writer(options.trace));
+            if (!tracer->open())
+            {
+                // Carry on without a trace
+                tracer.reset();
+            }
+        }
+    };
 
-        // Expand the memory buffer as needed
-        size_t realsize = size * nmemb;
-        char *ptr = (char *)realloc(mem->memory, mem->size + realsize + 1);
-        if (ptr == NULL)
+    // Let the workers finish every queued id, then stop them
+    ~basic_lookup_get()
+    {
+        stopping.store(true);
+        if (multiplexing())
         {
-            /* out of memory! */
-            printf("not enough memory (realloc returned NULL)\n");
-            return 0;
+            wake();
         }
+        else
+        {
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                queued.post();
+            }
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
 
-        // Copy response content to memory bufer
-        mem->memory = ptr;
-        memcpy(&(mem->memory[mem->size]), contents, realsize);
-        mem->size += realsize;
-        mem->memory[mem->size] = 0;
+    basic_lookup_get(const basic_lookup_get &) = delete;
+    basic_lookup_get &operator=(const basic_lookup_get &) = delete;
 
-        return realsize;
+    // Hit, miss and eviction counters of the response cache
+    lookup_cache_stats cache_stats()
+    {
+        return cache.stats();
     }
 
-    // requestor function runs on a thread and makes HTTP requests by:
-    //  1) removing an id from the outstanding requests queue
-    //  2) looking up the id in cache and returning the cached data if found
-    //  3) waiting for a request_slot
-    //  4) requesting the data from the web service
-    //  5) caching returned data or error status codes
-    void requestor(
-        int worker_number,
-        const std::string base_url,
-        const unsigned long port,
-        const std::string authorization_token)
+    // Counters of the persistent cache tier, all zero when it is disabled
+    lookup_disk_cache_stats disk_cache_stats()
     {
+        return disk_cache ? disk_cache->stats() : lookup_disk_cache_stats();
+    }
 
-        std::string id;
+    // Wait until every response queued for the disk cache has been written
+    void flush_disk_cache()
+    {
+        if (disk_cache)
+        {
+            disk_cache->flush();
+        }
+    }
 
-        CURL *curl;
-        curl = curl_easy_init();
-        // Use libCUrl to make HTTP requests
-        if (curl)
+    // Rewrite the disk cache's log and index without its superseded and
+    // expired records, whatever share of the log they take up
+    void compact_disk_cache()
+    {
+        if (disk_cache)
         {
-            // Add the HTTP headers
-            std::string authorization_header = "Authorization: " + authorization_token;
-            struct curl_slist *list = NULL;
-            list = curl_slist_append(list, "Accept: text/json");
-            list = curl_slist_append(list, authorization_header.c_str());
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+            disk_cache->compact();
+        }
+    }
 
-            struct MemoryStruct response_data;
+    // Counters of the shared memory segment, all zero when it is disabled
+    lookup_shared_stats shared_stats()
+    {
+        return shared ? shared->stats() : lookup_shared_stats();
+    }
 
-            // Allocate memory intially with size 0.
-            // The write_callback function will memory grow as needed.
-            response_data.memory = (char *)malloc(1);
-            response_data.size = 0;
+    // Dispatch counts per class and deadline misses
+    lookup_scheduler_stats scheduler_stats()
+    {
+        return scheduler.stats();
+    }
 
-            // Register a callback function to get the response payload
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response_data);
+    // Counters, gauges and latency histograms of the instance.
+    // snapshot.write_prometheus() renders them for a Prometheus scrape.
+    lookup_metrics_snapshot metrics()
+    {
+        return instruments.snapshot(scheduler.size());
+    }
 
-            // Make requests until supply is exhausted
-            while (true)
-            {
-                // Get a new request item
-                requests_accessor.lock();
-                if (requests.size() == 0)
-                {
-                    requests_accessor.unlock();
-                    break;
-                }
-                id = requests.front();
-                requests.pop();
-                requests_accessor.unlock();
+    // Counters and state of each replica, empty unless lookup_options names replicas
+    std::vector<lookup_replica_stats> replica_stats()
+    {
+        return router ? router->stats() : std::vector<lookup_replica_stats>();
+    }
 
-                // Check for cached responses
-                responses_accessor.lock();
-                if (responses.find(id) == responses.end())
-                {
-                    // Response is not cached.
-                    // The request queue can contain multiple requests for the same item_id.
-                    // Reserve a spot in the response map so these duplicate requests will be ignored
-                    // as soon as we commit to making the request.
-                    responses[id] = "";
-                    responses_accessor.unlock();
-                }
-                else
-                {
-                    // Response is cached, don't re-request
-                    responses_accessor.unlock();
-                    continue;
-                }
+    // Current number of request slots, as adapted by the limiter
+    unsigned int request_limit()
+    {
+        return request_slot.limit();
+    }
 
-                // Wait on a request slot to avoid server overrun responses
-                request_slot.wait();
+    // Request id from the server named in lookup_options.
+    // The future is ready at once for a cached id, and is shared with every
+    // other caller waiting on the same id.
+    lookup_future submit(const std::string &id, const lookup_dispatch &dispatch = lookup_dispatch())
+    {
+        start(default_max_requests);
+        lookup_future future = submit(id, default_endpoint, dispatch, trace_call());
+        wake();
+        return future;
+    }
 
-                // Construct the URL for the next id
-                std::string current_url = base_url + id;
-                curl_easy_setopt(curl, CURLOPT_URL, current_url.c_str());
-                curl_easy_setopt(curl, CURLOPT_PORT, port);
+    // Request ids from the server named in lookup_options.
+    // Returns one future per id, in the order of ids.
+    std::vector<lookup_future> submit(const std::vector<std::string> &ids, const lookup_dispatch &dispatch = lookup_dispatch())
+    {
+        start(default_max_requests);
+        std::vector<lookup_future> futures;
+        futures.reserve(ids.size());
+        uint32_t call = trace_call();
+        for (const auto &id : ids)
+        {
+            futures.push_back(submit(id, default_endpoint, dispatch, call));
+        }
+        wake();
+        return futures;
+    }
 
-                // Reallocate memory for each request
-                response_data.memory = (char *)realloc(response_data.memory, 1);
-                response_data.size = 0;
+    // Fetch ids from the server named in lookup_options into the cache in the
+    // background, for callers that know which ids they will need next.
+    // Returns at once.  Prefetches are dispatched in the prefetch class, which
+    // only takes request slots no other class is waiting for, so they delay a
+    // foreground lookup by at most the one request it waits to finish.  A
+    // foreground caller asking for an id being prefetched joins that flight,
+    // moving it up to the caller's class if it is still queued.
+    void prefetch(const std::vector<std::string> &ids)
+    {
+        start(default_max_requests);
+        prefetch(ids, default_endpoint);
+        wake();
+    }
 
-                // Setup an error buffer
-                std::string curl_error(CURL_ERROR_SIZE, '\0');
-                curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error.c_str());
+    // Fetch ids from the given server into the cache in the background, as the
+    // overload using the server named in lookup_options does
+    void prefetch(
+        const std::vector<std::string> &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token)
+    {
+        start(default_max_requests);
+        prefetch(ids, named_endpoint(base_url, port, authorization_token));
+        wake();
+    }
 
-                // Make the HTTP request
-                CURLcode curl_code = curl_easy_perform(curl);
-
-                std::chrono::high_resolution_clock::time_point timestamp = std::chrono::high_resolution_clock::now();
-
-                // Cache data if available
-                long http_code = 0;
-                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-                if (http_code == 200 && curl_code != CURLE_ABORTED_BY_CALLBACK)
-                {
-                    // The update the response reservation with the response payload
-                    std::string response(response_data.memory, response_data.size);
-                    std::string response_string;
-                    response_string.reserve(id.size() + 100);
-                    response_string += "{\"id\":\"";
-                    response_string += id;
-                    response_string += "\"";
-                    response_string += ",\"timestamp\":";
-                    response_string += std::to_string(timestamp.time_since_epoch().count());
-                    response_string += ",\"status\":";
-                    response_string += std::to_string(http_code);
-                    response_string += ",\"response\":";
-                    response_string += response;
-                    response_string += "}";
-
-                    responses_accessor.lock();
-                    responses[id] = response_string;
-                    responses_accessor.unlock();
-                }
-                else if (http_code == 429)
-                {
-                    // The server is too busy and wants us to back off.
-                    // Although we are not the cause because we control our request rate,
-                    // rollback the request so it can be retried.
-
-                    // Remove response reservation.
-                    // Other workers can now fulfill request.
-                    responses_accessor.lock();
-                    responses.erase(id);
-                    responses_accessor.unlock();
-
-                    // Other workers may have already fulfilled a duplicate request.
-                    // Even so, rollback the request removal so there is at least
-                    // one request for this id in the queue.
-                    requests_accessor.lock();
-                    requests.push(id);
-                    requests_accessor.unlock();
-                }
-                else
-                {
-                    // For any HTTP status code not handled above including 403 NOT AUITHORIZED,
-                    // and 404 (NOT FOUND), update the response reservation with the status code 
-                    // and null reponse payload.
-                    std::string response_string;
-                    response_string.reserve(id.size() + 100);
-                    response_string += "{\"id\":\"";
-                    response_string += id;
-                    response_string += "\"";
-                    response_string += ",\"timestamp\":";
-                    response_string += std::to_string(timestamp.time_since_epoch().count());
-                    response_string += ",\"status\":";
-                    response_string += std::to_string(http_code);
-                    response_string += ",\"response\":null}";
-                    responses_accessor.lock();
-                    responses[id] = response_string;
-                    responses_accessor.unlock();
-                }
+    // Request ids and return every response once all of them are done,
+    // or the responses delivered so far once stop is requested
+    std::map<std::string, std::string> request(
+        const std::vector<std::string> &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        // Collect the streamed responses
+        lookup_table collected;
+        request_results(ids, base_url, port, authorization_token, max_requests,
+                        [&collected](const lookup_result_ptr &result) {
+                            collected.publish(result->id, result->json());
+                        },
+                        dispatch, stop);
+        return collected.take();
+    }
 
-                // Free the request slot so another thread can send
-                request_slot.post();
-            }
-            // Cleanup curl objects
-            free(response_data.memory);
-            curl_slist_free_all(list);
-            curl_easy_cleanup(curl);
-        }
+    // Request ids and hand each response's JSON envelope to on_response as soon as it is ready
+    void request(
+        const std::vector<std::string> &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_sink &on_response,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        request_results(ids, base_url, port, authorization_token, max_requests,
+                        [&on_response](const lookup_result_ptr &result) {
+                            on_response(result->id, result->json());
+                        },
+                        dispatch, stop);
     }
-};
+
+    // Request ids and return every typed result, ordered by id, once all of them are done,
+    // or the results delivered so far once stop is requested.
+    // No JSON is produced unless the caller asks a result for it.
+    std::vector<lookup_result_ptr> request_results(
+        const std::vector<std::string> &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        return collect_results(ids, base_url, port, authorization_token, max_requests, dispatch, stop);
+    }
+
+    // Request the distinct ids interned in ids and return every typed result, ordered by id,
+    // as the overload taking a vector does
+    std::vector<lookup_result_ptr> request_results(
+        const lookup_id_arena &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        return collect_results(ids, base_url, port, authorization_token, max_requests, dispatch, stop);
+    }
+
+    // Request ids and hand each typed result to on_result as soon as it is ready,
+    // returning once every id has been delivered.  Cached ids are delivered on the
+    // calling thread, the rest from the worker that completed them.  Results are not
+    // retained by the call, and a slow on_result slows down only the worker that
+    // invoked it, which holds no request slot at the time.
+    // max_requests sets the instance's slot budget if this is its first call and
+    // lookup_options::max_requests is 0; otherwise the budget is already fixed.
+    // dispatch sets the class the ids are requested in and the deadline after
+    // which ids not yet requested are delivered as expired results.
+    // Requesting stop returns at once, with no further results delivered, and
+    // drops or aborts the requests no other caller is waiting for.
+    void request_results(
+        const std::vector<std::string> &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_result_sink &on_result,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        // Submit the first occurrence of each id.
+        // Duplicates are removed up front so they never reach the flight table.
+        std::vector<uint32_t> unique = unique_indices(ids);
+        instruments.add(lookup_counter::duplicates, ids.size() - unique.size());
+        request_unique(
+            unique.size(), [&](size_t i) { return std::string_view(ids[unique[i]]); },
+            base_url, port, authorization_token, max_requests, on_result, dispatch, stop);
+    }
+
+    // Request the distinct ids interned in ids and hand each typed result to on_result
+    // as soon as it is ready, as the overload taking a vector does.  The ids are already
+    // distinct, so no set of them is built, and the repeats the arena absorbed while
+    // interning are counted as duplicates.  Each id is copied into a string of its own
+    // only when its flight is started.
+    void request_results(
+        const lookup_id_arena &ids,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        const lookup_result_sink &on_result,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        instruments.add(lookup_counter::duplicates, ids.offered() - ids.size());
+        request_unique(
+            ids.size(), [&ids](size_t i) { return ids[(lookup_id_handle)i]; },
+            base_url, port, authorization_token, max_requests, on_result, dispatch, stop);
+    }
+
+    // Request every id next_id supplies and hand each typed result to on_result
+    // as soon as it is ready, returning the number of ids read once all of them
+    // have been delivered.  At most window ids are outstanding at a time: once
+    // that many await their results, next_id is not called again until one is
+    // delivered, so memory stays flat however many ids the source holds and a
+    // slow on_result holds back the reading.  Unlike request_results(), ids
+    // are not made unique first, since the stream is never held whole; each
+    // id read gets its own result, and repeats within the window share one
+    // request.  Results are delivered as request_results() delivers them, and
+    // dispatch and stop apply the same way.
+    size_t request_stream(
+        const lookup_id_source &next_id,
+        const std::string base_url,
+        const unsigned long port,
+        const std::string authorization_token,
+        const unsigned int max_requests,
+        size_t window,
+        const lookup_result_sink &on_result,
+        const lookup_dispatch &dispatch = lookup_dispatch(),
+        const lookup_stop_token &stop = lookup_stop_token())
+    {
+        start(max_requests);
+        auto endpoint = named_endpoint(base_url, port, authorization_token);
+
+        // The stream outlives the call if it is stopped, for the flights still holding its waiters
+        auto work = std::make_shared<stream>(on_result, std::max<size_t>(window, 1), stop.stop_possible());
+        lookup_stop_callback on_stop(stop, [&work]() { work->stop(); });
+        uint32_t call = trace_call();
+        size_t count = 0;
+        std::string id;
+        while (work->admit([this]() { wake(); }))
+        {
+            if (!next_id(id))
+            {
+                work->abandon();
+                break;
+            }
+            uint64_t sequence = count++;
+            lookup_result_ptr cached = find_cached(id, endpoint);
+            if (cached)
+            {
+                trace_cached(cached, call, dispatch);
+                work->deliver(sequence, cached);
+            }
+            else if (!stop.stop_possible())
+            {
+                // The call waits for every delivery, so the stream outlives the waiters
+                stream *pending = work.get();
+                fly(id, endpoint, dispatch, traced([pending, sequence](const lookup_result_ptr &result) {
+                    pending->deliver(sequence, result);
+                }, call, dispatch));
+            }
+            else
+            {
+                // Remembered until delivered so interest in it can be withdrawn on stop
+                work->track(sequence, fly(id, endpoint, dispatch, traced([work, sequence](const lookup_result_ptr &result) {
+                    work->deliver(sequence, result);
+                }, call, dispatch)));
+            }
+            if (count % wake_interval == 0)
+            {
+                wake();
+            }
+        }
+        wake();
+
+        work->wait();
+        for (const auto &flight : work->untrack())
+        {
+            in_flight.release(flight);
+        }
+        return count;
+    }
+
+private:
+    // Slot budget used when submit() is the first call and lookup_options sets none
+    static constexpr unsigned int default_max_requests = 5;
+
+    // Options supplied by the caller at construction
+    lookup_options options;
+
+    // Submit count distinct ids, the i-th being id_at(i), and hand each typed result to
+    // on_result.  The body of the request_results() overloads.
+    template <typename IdAt>
+    void request_unique(
+        size_t count,
+        IdAt id_at,
+        const std::string &base_url,
+        const unsigned long port,
+        const std::string &authorization_token,
+        const unsigned int max_requests,
+        const lookup_result_sink &on_result,
+        const lookup_dispatch &dispatch,
+        const lookup_stop_token &stop)
+    {
+        start(max_requests);
+        auto endpoint = named_endpoint(base_url, port, authorization_token);
+
+        // The batch outlives the call if it is stopped, for the flights still holding its waiters
+        auto work = std::make_shared<batch>(on_result, count);
+        std::vector<std::shared_ptr<lookup_flight>> joined;
+        uint32_t call = trace_call();
+        // One buffer reused for every id, so looking one up allocates nothing
+        std::string id;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (stop.stop_requested())
+            {
+                break;
+            }
+            id.assign(id_at(i));
+            lookup_result_ptr cached = find_cached(id, endpoint);
+            if (cached)
+            {
+                trace_cached(cached, call, dispatch);
+                work->deliver(cached);
+                continue;
+            }
+            if (!stop.stop_possible())
+            {
+                // The call waits for every delivery, so the batch outlives the waiters
+                batch *pending = work.get();
+                fly(id, endpoint, dispatch, traced([pending](const lookup_result_ptr &result) { pending->deliver(result); }, call, dispatch));
+                continue;
+            }
+            // Remembered so interest in them can be withdrawn on stop
+            joined.push_back(fly(id, endpoint, dispatch, traced([work](const lookup_result_ptr &result) { work->deliver(result); }, call, dispatch)));
+        }
+        wake();
+
+        {
+            lookup_stop_callback on_stop(stop, [&work]() { work->stop(); });
+            work->wait();
+        }
+        if (stop.stop_requested())
+        {
+            for (const auto &flight : joined)
+            {
+                in_flight.release(flight);
+            }
+        }
+    }
+
+    // Request ids through the request_results() overload taking a sink and return
+    // every result, ordered by id
+    template <typename Ids>
+    std::vector<lookup_result_ptr> collect_results(
+        const Ids &ids,
+        const std::string &base_url,
+        const unsigned long port,
+        const std::string &authorization_token,
+        const unsigned int max_requests,
+        const lookup_dispatch &dispatch,
+        const lookup_stop_token &stop)
+    {
+        std::vector<lookup_result_ptr> results;
+        std::mutex results_accessor;
+        request_results(ids, base_url, port, authorization_token, max_requests,
+                        [&](const lookup_result_ptr &result) {
+                            std::lock_guard<std::mutex> lock(results_accessor);
+                            results.push_back(result);
+                        },
+                        dispatch, stop);
+        std::sort(results.begin(), results.end(),
+                  [](const lookup_result_ptr &a, const lookup_result_ptr &b) { return a->id < b->id; });
+        return results;
+    }
+
+    // Results owed to one request_results() call
+    class batch
+    {
+    public:
+        batch(const lookup_result_sink &sink, size_t outstanding)
+            : sink(sink), outstanding(outstanding) {}
+
+        // Called once per unique id, from the caller's thread or a worker.
+        // Does nothing once the batch is stopped, when sink may be gone.
+        void deliver(const lookup_result_ptr &result)
+        {
+            {
+                std::lock_guard<std::mutex> lock(accessor);
+                if (stopped)
+                {
+                    return;
+                }
+                delivering++;
+            }
+
+            sink(result);
+
+            // Count down under the lock so the waiting caller cannot return
+            // while this call is still notifying
+            std::lock_guard<std::mutex> lock(accessor);
+            delivering--;
+            if (--outstanding == 0 || (stopped && delivering == 0))
+            {
+                done.notify_all();
+            }
+        }
+
+        // Stop delivering results
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            stopped = true;
+            done.notify_all();
+        }
+
+        // Wait until every id has been delivered, or the batch is stopped and
+        // no delivery is still running
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(accessor);
+            done.wait(lock, [&]() { return outstanding == 0 || (stopped && delivering == 0); });
+        }
+
+    private:
+        const lookup_result_sink &sink;
+        size_t outstanding;
+        size_t delivering = 0;
+        bool stopped = false;
+        std::mutex accessor;
+        std::condition_variable done;
+    };
+
+    // Results owed to one request_stream() call, at most window of them at a time
+    class stream
+    {
+    public:
+        stream(const lookup_result_sink &sink, size_t window, bool tracking)
+            : sink(sink), window(window), tracking(tracking) {}
+
+        // Wait for room for one more id, calling before_waiting first if there
+        // is none.  Returns false once the stream is stopped.
+        template <typename Callback>
+        bool admit(Callback before_waiting)
+        {
+            std::unique_lock<std::mutex> lock(accessor);
+            if (outstanding >= window && !stopped)
+            {
+                lock.unlock();
+                before_waiting();
+                lock.lock();
+                changed.wait(lock, [&]() { return outstanding < window || stopped; });
+            }
+            if (stopped)
+            {
+                return false;
+            }
+            outstanding++;
+            return true;
+        }
+
+        // Give back the room taken by the last admit() when no id followed it
+        void abandon()
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            outstanding--;
+            changed.notify_all();
+        }
+
+        // Remember the flight carrying id number sequence until it is delivered
+        void track(uint64_t sequence, const std::shared_ptr<lookup_flight> &flight)
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            if (delivered_early.erase(sequence) == 0)
+            {
+                joined.emplace(sequence, flight);
+            }
+        }
+
+        // Called once per id read, from the caller's thread or a worker.
+        // Does nothing once the stream is stopped, when sink may be gone.
+        void deliver(uint64_t sequence, const lookup_result_ptr &result)
+        {
+            {
+                std::lock_guard<std::mutex> lock(accessor);
+                if (stopped)
+                {
+                    return;
+                }
+                if (tracking && joined.erase(sequence) == 0)
+                {
+                    // Completed before track() saw its flight
+                    delivered_early.insert(sequence);
+                }
+                delivering++;
+            }
+
+            sink(result);
+
+            std::lock_guard<std::mutex> lock(accessor);
+            delivering--;
+            outstanding--;
+            changed.notify_all();
+        }
+
+        // Stop delivering results
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            stopped = true;
+            changed.notify_all();
+        }
+
+        // Wait until every id admitted has been delivered, or the stream is
+        // stopped and no delivery is still running
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(accessor);
+            changed.wait(lock, [&]() { return outstanding == 0 || (stopped && delivering == 0); });
+        }
+
+        // Flights not delivered before the stream stopped, which nobody here waits for any longer
+        std::vector<std::shared_ptr<lookup_flight>> untrack()
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            std::vector<std::shared_ptr<lookup_flight>> flights;
+            for (auto &entry : joined)
+            {
+                flights.push_back(std::move(entry.second));
+            }
+            joined.clear();
+            return flights;
+        }
+
+    private:
+        const lookup_result_sink &sink;
+        const size_t window;
+        const bool tracking;
+        size_t outstanding = 0;
+        size_t delivering = 0;
+        bool stopped = false;
+        std::unordered_map<uint64_t, std::shared_ptr<lookup_flight>> joined;
+        std::unordered_set<uint64_t> delivered_early;
+        std::mutex accessor;
+        std::condition_variable changed;
+    };
+
+    // Ids request_stream() submits between wakes of the multiplexor()
+    static constexpr size_t wake_interval = 64;
+
+    // Take a slot of the host-wide gate, if there is one.  Returns the slot, or -1.
+    int acquire_shared_slot()
+    {
+        return shared ? shared->acquire() : -1;
+    }
+
+    // Return request slots taken for a flight that needed no request
+    void return_unused_slots(int shared_slot)
+    {
+        if (shared_slot >= 0)
+        {
+            shared->release(shared_slot);
+        }
+        request_slot.post();
+    }
+
+    // Return the request slots held for a completed transfer,
+    // letting the limiter adapt to the transfer's status and latency
+    void release_slot(const lookup_transfer &transfer, int shared_slot)
+    {
+        if (shared_slot >= 0)
+        {
+            shared->release(shared_slot);
+        }
+        request_slot.post(transfer.http_code, transfer.timings.total);
+    }
+
+    // Exponential backoff with jitter for the next retry of a flight
+    std::chrono::milliseconds backoff(lookup_flight &flight)
+    {
+        unsigned int attempt = flight.retries++;
+        auto ceiling = options.backoff_base * (1LL << std::min(attempt, 20u));
+        ceiling = std::min<std::chrono::milliseconds>(ceiling, options.backoff_cap);
+
+        thread_local std::mt19937 generator(std::random_device{}());
+        std::uniform_int_distribution<long long> jitter(ceiling.count() / 2, ceiling.count());
+        return std::chrono::milliseconds(jitter(generator));
+    }
+
+    // Gate holding the number of request slots, shared by every caller
+    LimiterPolicy request_slot;
+
+    // Outstanding requests, joined by every caller asking for the same id
+    lookup_flights in_flight;
+
+    // Responses retained across request() calls
+    CachePolicy cache;
+
+    // Responses retained across processes, or null when disabled
+    std::unique_ptr<lookup_disk_cache> disk_cache;
+
+    // Request slots and responses shared with other processes, or null when disabled
+    std::unique_ptr<lookup_shared> shared;
+
+    // Counters and histograms reported by metrics()
+    lookup_metrics instruments;
+
+    // Sends the requests: curl handles and their shared DNS, connection and TLS
+    // session caches, retained across request() calls, unless a fake transport
+    // answers in process
+    TransportPolicy transport;
+
+    // Flights waiting for a worker, in dispatch order, and a count the workers wait on.
+    // The count never falls below the number of queued flights but may exceed it.
+    QueuePolicy scheduler;
+    fast_semaphore queued;
+
+    // Callers waiting for the scheduler, full at queue_capacity, to make room
+    std::mutex room_accessor;
+    std::condition_variable room;
+    std::atomic<unsigned int> waiting_for_room{0};
+
+    // Server used by submit()
+    std::shared_ptr<const lookup_endpoint> default_endpoint;
+
+    // Replicas requests to default_endpoint are spread over, or null when none are set
+    std::unique_ptr<lookup_router> router;
+
+    // Trace of the lookups served, or null when disabled
+    std::unique_ptr<lookup_trace_writer> tracer;
+
+    // Background refreshes outstanding, and the most allowed, set by start()
+    std::atomic<unsigned int> refreshing{0};
+    unsigned int refresh_limit = 1;
+
+    // Workers, started by the first call
+    std::once_flag started;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping{false};
+
+    // The multiplexor()'s multi handle, woken when flights are queued
+    std::atomic<CURLM *> multi_handle{nullptr};
+
+    // Start the workers and hand out the slot budget, once
+    void start(unsigned int max_requests)
+    {
+        std::call_once(started, [&]() {
+            unsigned int budget = router ? router->capacity() : options.max_requests ? options.max_requests : max_requests;
+            request_slot.reset(budget, options.limiter);
+            refresh_limit = options.max_refreshes ? options.max_refreshes : std::max(1u, budget / 2);
+
+            // An adaptive limiter may grow past the budget
+            unsigned int worker_count = options.limiter.adaptive ? options.limiter.max_limit : budget;
+            if constexpr (TransportPolicy::multiplexed)
+            {
+                if (multiplexing())
+                {
+                    // A single event loop replaces the worker threads
+                    workers.emplace_back(&basic_lookup_get::multiplexor, this, worker_count);
+                    return;
+                }
+            }
+            for (unsigned int worker = 0; worker < worker_count; worker++)
+            {
+                workers.emplace_back(&basic_lookup_get::requestor, this);
+            }
+        });
+    }
+
+    // The endpoint for a server named by a call: default_endpoint if it is the
+    // server of lookup_options, so its flights are routed to the replicas
+    std::shared_ptr<const lookup_endpoint> named_endpoint(
+        const std::string &base_url, unsigned long port, const std::string &authorization_token)
+    {
+        if (base_url == default_endpoint->base_url && port == default_endpoint->port &&
+            authorization_token == default_endpoint->authorization_token)
+        {
+            return default_endpoint;
+        }
+        return std::make_shared<const lookup_endpoint>(base_url, port, authorization_token);
+    }
+
+    // Whether a flight's requests are spread over the replicas
+    bool routed(const lookup_flight &flight) const
+    {
+        return router && flight.endpoint == default_endpoint;
+    }
+
+    // How a request to a replica ended, for the replica's health
+    static lookup_replica_outcome replica_outcome(const lookup_transfer &transfer)
+    {
+        if (transfer.code == CURLE_ABORTED_BY_CALLBACK)
+        {
+            return lookup_replica_outcome::abandoned;
+        }
+        if (transfer.code != CURLE_OK || transfer.http_code >= 500)
+        {
+            return lookup_replica_outcome::failed;
+        }
+        return (transfer.http_code == 429) ? lookup_replica_outcome::rate_limited : lookup_replica_outcome::succeeded;
+    }
+
+    // Whether a routed flight whose request failed without an answer at replica
+    // is to be queued again for another replica instead of failing, which is
+    // the case while it has failovers left and another replica is healthy
+    bool fail_over(const std::shared_ptr<lookup_flight> &flight, int replica, const lookup_transfer &transfer)
+    {
+        if (replica < 0 || transfer.code == CURLE_OK || transfer.code == CURLE_ABORTED_BY_CALLBACK ||
+            flight->failovers >= options.routing.max_failovers || !router->alternative(replica))
+        {
+            return false;
+        }
+        flight->failovers++;
+        flight->failed_replica = replica;
+        instruments.add(transfer.code == CURLE_OPERATION_TIMEDOUT ? lookup_counter::timeouts : lookup_counter::errors);
+        instruments.add(lookup_counter::retries);
+        return true;
+    }
+
+    // Whether the multiplexor() runs instead of the requestor() threads
+    bool multiplexing() const
+    {
+        return TransportPolicy::multiplexed && options.engine == lookup_engine::multi;
+    }
+
+    // Tell the multiplexor() new flights are queued
+    void wake()
+    {
+        CURLM *multi = multi_handle.load();
+        if (multi)
+        {
+            curl_multi_wakeup(multi);
+        }
+    }
+
+    // Submit one id for call without waking the multiplexor()
+    lookup_future submit(const std::string &id, const std::shared_ptr<const lookup_endpoint> &endpoint, const lookup_dispatch &dispatch,
+                         uint32_t call)
+    {
+        lookup_result_ptr cached = find_cached(id, endpoint);
+        if (cached)
+        {
+            trace_cached(cached, call, dispatch);
+            std::promise<lookup_result_ptr> ready;
+            ready.set_value(cached);
+            return ready.get_future().share();
+        }
+        return fly(id, endpoint, dispatch, traced(nullptr, call, dispatch))->future;
+    }
+
+    // Request a cached id again in the prefetch class, unless refresh_limit
+    // refreshes are already outstanding, in which case the cache asks again
+    // after its refresh_retry.  The new result replaces the cached one.
+    void refresh(const std::string &id, const std::shared_ptr<const lookup_endpoint> &endpoint)
+    {
+        if (refreshing.fetch_add(1, std::memory_order_relaxed) >= refresh_limit)
+        {
+            refreshing.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        instruments.add(lookup_counter::refreshes);
+        lookup_dispatch dispatch;
+        dispatch.priority = lookup_priority::prefetch;
+        fly(id, endpoint, dispatch, [this](const lookup_result_ptr &) {
+            refreshing.fetch_sub(1, std::memory_order_relaxed);
+        }, true);
+        wake();
+    }
+
+    // Queue a flight in the prefetch class for each id not already cached,
+    // without waking the multiplexor().  Each flight holds one unit of
+    // interest of its own, as a submit() caller does, so it is not cancelled
+    // for want of callers and completes into the cache.
+    void prefetch(const std::vector<std::string> &ids, const std::shared_ptr<const lookup_endpoint> &endpoint)
+    {
+        lookup_dispatch dispatch;
+        dispatch.priority = lookup_priority::prefetch;
+        uint32_t call = trace_call();
+        for (const auto &id : ids)
+        {
+            if (!cache.contains(id))
+            {
+                instruments.add(lookup_counter::prefetches);
+                fly(id, endpoint, dispatch, traced(nullptr, call, dispatch));
+            }
+        }
+    }
+
+    // Number a new call for the trace, if one is recorded
+    uint32_t trace_call()
+    {
+        return tracer ? tracer->next_call() : 0;
+    }
+
+    // Trace a result call found in the caches, delivered at once
+    void trace_cached(const lookup_result_ptr &result, uint32_t call, const lookup_dispatch &dispatch)
+    {
+        if (tracer)
+        {
+            tracer->record(*result, std::chrono::steady_clock::now(), call, (unsigned int)dispatch.priority);
+        }
+    }
+
+    // A waiter tracing the result of an id call asks for now, then passing it
+    // on to waiter, if set.  Without a trace, waiter itself.
+    lookup_waiter traced(lookup_waiter waiter, uint32_t call, const lookup_dispatch &dispatch)
+    {
+        if (!tracer)
+        {
+            return waiter;
+        }
+        lookup_trace_writer *writer = tracer.get();
+        auto submitted = std::chrono::steady_clock::now();
+        unsigned int priority = (unsigned int)dispatch.priority;
+        return [writer, submitted, call, priority, waiter = std::move(waiter)](const lookup_result_ptr &result) {
+            writer->record(*result, submitted, call, priority);
+            if (waiter)
+            {
+                waiter(result);
+            }
+        };
+    }
+
+    // Join the flight for an uncached id, or start and queue one.
+    // waiter, if set, is called with the result.  refresh requests the id
+    // even though the cache holds a result for it.
+    std::shared_ptr<lookup_flight> fly(
+        const std::string &id,
+        const std::shared_ptr<const lookup_endpoint> &endpoint,
+        const lookup_dispatch &dispatch,
+        lookup_waiter waiter,
+        bool refresh = false)
+    {
+        // Prefetches are counted by prefetch() alone, so they leave the
+        // cache's hit ratio and the duplicate count to foreground lookups
+        bool counted = (dispatch.priority != lookup_priority::prefetch);
+        bool leader;
+        std::shared_ptr<lookup_flight> flight = in_flight.join(id, endpoint, std::move(waiter), leader);
+        if (leader)
+        {
+            // A flight for id may have completed since the caller missed the cache
+            lookup_result_ptr cached = refresh ? nullptr : cache.peek(id);
+            if (cached)
+            {
+                if (counted)
+                {
+                    instruments.add(lookup_counter::cache_hits);
+                }
+                complete(flight, cached);
+            }
+            else
+            {
+                if (counted)
+                {
+                    instruments.add(lookup_counter::cache_misses);
+                }
+                if (!scheduler.push(flight, dispatch))
+                {
+                    // Full: sleep until a worker takes a flight off the scheduler
+                    std::unique_lock<std::mutex> lock(room_accessor);
+                    waiting_for_room.fetch_add(1);
+                    room.wait(lock, [&]() { return scheduler.push(flight, dispatch); });
+                    waiting_for_room.fetch_sub(1);
+                }
+                queued.post();
+            }
+        }
+        else
+        {
+            if (counted)
+            {
+                instruments.add(lookup_counter::duplicates);
+            }
+            if (scheduler.promote(flight, dispatch))
+            {
+                queued.post();
+            }
+        }
+        return flight;
+    }
+
+    // Take the next flight to request from the scheduler, completing any
+    // expired or abandoned ones it hands back on the way
+    bool pop_request(std::shared_ptr<lookup_flight> &flight)
+    {
+        bool expired;
+        while (scheduler.pop(flight, expired))
+        {
+            made_room();
+            if (expired)
+            {
+                finish_unrequested(flight, lookup_outcome::expired);
+            }
+            else if (!cancel_abandoned(flight))
+            {
+                instruments.record(lookup_timer::queue_wait, std::chrono::steady_clock::now() - flight->created);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Wake a caller waiting for room in the scheduler, if there is one
+    void made_room()
+    {
+        if (waiting_for_room.load() != 0)
+        {
+            // Taking the lock orders the pop before the waiter's next attempt
+            std::lock_guard<std::mutex> lock(room_accessor);
+            room.notify_one();
+        }
+    }
+
+    // Queue a flight taken by pop_request() again, in its own class and with
+    // its own deadline, for a worker that could not send it yet
+    void requeue(std::shared_ptr<lookup_flight> &flight)
+    {
+        scheduler.requeue(flight);
+        flight.reset();
+        queued.post();
+    }
+
+    // Take the next queued flight if one is ready, without waiting
+    bool try_next_request(std::shared_ptr<lookup_flight> &flight)
+    {
+        return queued.try_wait() && pop_request(flight);
+    }
+
+    // Complete a flight with no answer from the server, because its callers'
+    // deadlines all passed or they all stopped waiting.  The result is not cached.
+    void finish_unrequested(const std::shared_ptr<lookup_flight> &flight, lookup_outcome outcome)
+    {
+        auto result = std::make_shared<lookup_result>();
+        result->id = flight->id;
+        result->timestamp = std::chrono::steady_clock::now();
+        result->created = flight->created;
+        result->outcome = outcome;
+        instruments.add(outcome == lookup_outcome::expired ? lookup_counter::expired : lookup_counter::cancelled);
+        complete(flight, result);
+    }
+
+    // Hand a flight's result to its callers, timing it from the first caller's request
+    void complete(const std::shared_ptr<lookup_flight> &flight, const lookup_result_ptr &result)
+    {
+        instruments.record(lookup_timer::end_to_end, std::chrono::steady_clock::now() - flight->created);
+        in_flight.complete(flight, result);
+    }
+
+    // Complete a flight that expired while its worker waited for a request slot
+    bool expire_overdue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        if (!scheduler.overdue(flight))
+        {
+            return false;
+        }
+        scheduler.record_expired();
+        finish_unrequested(flight, lookup_outcome::expired);
+        return true;
+    }
+
+    // Complete a flight every caller has stopped waiting for
+    bool cancel_abandoned(const std::shared_ptr<lookup_flight> &flight)
+    {
+        if (flight->interest.load(std::memory_order_relaxed) != 0 || !in_flight.abandon(flight))
+        {
+            return false;
+        }
+        finish_unrequested(flight, lookup_outcome::cancelled);
+        return true;
+    }
+
+    // Settings shared by the handles of both engines: the timeouts, the
+    // cancellation of abandoned flights and, if results keep payloads, the
+    // body buffer.  flight is the variable holding the flight the handle is requesting.
+    void configure_handle(typename TransportPolicy::handle handle, std::shared_ptr<lookup_flight> *flight, std::string *body)
+    {
+        transport.configure(handle, options.connect_timeout, options.request_timeout, flight,
+                            ResultPolicy::payload ? body : nullptr);
+    }
+
+    // Look for a usable result in the response cache, then in the shared memory
+    // cache, then in the disk cache.  Hits in either of the other tiers are
+    // promoted into the response cache for the rest of their lifetime.  A
+    // response cache hit that is due for a refresh is also requested again
+    // from endpoint in the background.
+    lookup_result_ptr find_cached(const std::string &id, const std::shared_ptr<const lookup_endpoint> &endpoint)
+    {
+        bool due;
+        lookup_result_ptr cached = cache.find(id, due);
+        if (due)
+        {
+            refresh(id, endpoint);
+        }
+        std::chrono::milliseconds remaining;
+        if (!cached && shared && (cached = load_shared(id, remaining)))
+        {
+            cache.insert(cached, remaining);
+        }
+        if (!cached && disk_cache && (cached = load(id, remaining)))
+        {
+            cache.insert(cached, remaining);
+        }
+        if (cached)
+        {
+            instruments.add(lookup_counter::cache_hits);
+        }
+        return cached;
+    }
+
+    // Names an id of a caller's batch by its index, for lookup_handle_set
+    struct batch_index
+    {
+        const std::vector<std::string> *ids;
+
+        std::string_view operator()(lookup_id_handle index) const
+        {
+            return (*ids)[index];
+        }
+    };
+
+    // Return the indices of the first occurrence of each id in ids, in order.
+    // Large batches are hashed into partitions by several threads, and each
+    // partition is then deduplicated by its own thread.  The sets hold indices
+    // rather than ids, 8 bytes a slot with no node per id.
+    static std::vector<uint32_t> unique_indices(const std::vector<std::string> &ids)
+    {
+        assert(ids.size() <= std::numeric_limits<uint32_t>::max());
+        const size_t per_thread = 64 * 1024;
+        size_t thread_count = std::min<size_t>(
+            std::max(1u, std::thread::hardware_concurrency()),
+            ids.size() / per_thread + 1);
+
+        std::vector<uint32_t> unique;
+        if (thread_count == 1)
+        {
+            lookup_handle_set<batch_index> seen(batch_index{&ids});
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                if (seen.insert(i) == i)
+                {
+                    unique.push_back(i);
+                }
+            }
+            return unique;
+        }
+
+        // Phase 1: each thread buckets its contiguous chunk of ids by hash partition
+        std::vector<std::vector<std::vector<uint32_t>>> buckets(
+            thread_count, std::vector<std::vector<uint32_t>>(thread_count));
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < thread_count; t++)
+        {
+            threads.emplace_back([&, t]() {
+                size_t begin = ids.size() * t / thread_count;
+                size_t end = ids.size() * (t + 1) / thread_count;
+                for (size_t i = begin; i < end; i++)
+                {
+                    size_t hash = std::hash<std::string_view>{}(ids[i]);
+                    buckets[t][hash % thread_count].push_back(i);
+                }
+            });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        threads.clear();
+
+        // Phase 2: each thread keeps the first occurrence of each id in its partition.
+        // Chunks are visited in order, so the first index seen is the lowest.
+        std::vector<std::vector<uint32_t>> partitions(thread_count);
+        for (size_t p = 0; p < thread_count; p++)
+        {
+            threads.emplace_back([&, p]() {
+                lookup_handle_set<batch_index> seen(batch_index{&ids});
+                for (size_t t = 0; t < thread_count; t++)
+                {
+                    for (uint32_t i : buckets[t][p])
+                    {
+                        if (seen.insert(i) == i)
+                        {
+                            partitions[p].push_back(i);
+                        }
+                    }
+                    buckets[t][p] = std::vector<uint32_t>();
+                }
+            });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        // Phase 3: restore the caller's order
+        for (auto &partition : partitions)
+        {
+            unique.insert(unique.end(), partition.begin(), partition.end());
+        }
+        std::sort(unique.begin(), unique.end());
+        return unique;
+    }
+
+    // Disk cache records hold the result's wall clock timestamp in nanoseconds followed by its payload
+    lookup_result_ptr load(const std::string &id, std::chrono::milliseconds &remaining)
+    {
+        long status;
+        std::string value;
+        int64_t wall_clock_ns;
+        if (!disk_cache->find(id, status, value, remaining) || value.size() < sizeof(wall_clock_ns))
+        {
+            return nullptr;
+        }
+        memcpy(&wall_clock_ns, value.data(), sizeof(wall_clock_ns));
+
+        auto result = std::make_shared<lookup_result>();
+        result->id = id;
+        result->timestamp = lookup_steady_clock(std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(wall_clock_ns))));
+        result->status = status;
+        result->payload.assign(value, sizeof(wall_clock_ns), std::string::npos);
+        return result;
+    }
+
+    // Complete a flight with a result another process shared since the flight was queued.
+    // Checked once a worker holds request slots, after what may have been a long wait.
+    bool complete_shared(const std::shared_ptr<lookup_flight> &flight)
+    {
+        std::chrono::milliseconds remaining;
+        lookup_result_ptr cached = shared ? load_shared(flight->id, remaining) : nullptr;
+        if (!cached)
+        {
+            return false;
+        }
+        cache.insert(cached, remaining);
+        instruments.add(lookup_counter::cache_hits);
+        complete(flight, cached);
+        return true;
+    }
+
+    lookup_result_ptr load_shared(const std::string &id, std::chrono::milliseconds &remaining)
+    {
+        auto result = std::make_shared<lookup_result>();
+        int64_t wall_clock_ns;
+        if (!shared->find(id, result->status, result->payload, wall_clock_ns, remaining))
+        {
+            return nullptr;
+        }
+        result->id = id;
+        result->timestamp = lookup_steady_clock(std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(wall_clock_ns))));
+        return result;
+    }
+
+    // Cache a result in memory, share it with other processes and queue it for the persistent tier
+    void store(const lookup_result_ptr &result)
+    {
+        cache.insert(result);
+        if (!shared && !disk_cache)
+        {
+            return;
+        }
+        int64_t wall_clock_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    lookup_wall_clock(result->timestamp).time_since_epoch())
+                                    .count();
+        auto ttl = (result->status == 200) ? options.cache.ttl : options.cache.negative_ttl;
+        if (shared)
+        {
+            shared->insert(result->id, result->status, result->payload, wall_clock_ns, ttl);
+        }
+        if (disk_cache)
+        {
+            std::string value;
+            value.reserve(sizeof(wall_clock_ns) + result->payload.size());
+            value.append((const char *)&wall_clock_ns, sizeof(wall_clock_ns));
+            value.append(result->payload);
+            disk_cache->store(result->id, result->status, value, ttl);
+        }
+    }
+
+    // Cache the completed transfer's response data or error status code and complete its flight.
+    // Shared by the requestor() and multiplexor() engines so both produce identical results.
+    // Returns true when the server asked us to back off and the flight must be
+    // retried after retry_delay, or when an aborted flight gained a caller and
+    // must be retried at once.  hedged and hedge_won describe a multiplexor()
+    // flight that was hedged.
+    bool record_response(
+        const std::shared_ptr<lookup_flight> &flight,
+        const lookup_transfer &transfer,
+        const std::string &body,
+        std::chrono::milliseconds &retry_delay,
+        bool hedged = false,
+        bool hedge_won = false)
+    {
+        std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::now();
+
+        CURLcode curl_code = transfer.code;
+        if (curl_code == CURLE_ABORTED_BY_CALLBACK)
+        {
+            // Aborted because nobody wanted the result, unless a caller joined since
+            if (in_flight.abandon(flight))
+            {
+                finish_unrequested(flight, lookup_outcome::cancelled);
+                return false;
+            }
+            instruments.add(lookup_counter::retries);
+            retry_delay = std::chrono::milliseconds(0);
+            return true;
+        }
+
+        const lookup_timings &timings = transfer.timings;
+        instruments.record(lookup_timer::name_lookup, timings.name_lookup);
+        instruments.record(lookup_timer::connect, timings.connect);
+        instruments.record(lookup_timer::first_byte, timings.first_byte);
+        instruments.record(lookup_timer::total, timings.total);
+
+        // Body bytes as they crossed the wire, before libcurl decoded any
+        // content encoding, against the bytes the caller receives
+        instruments.add(lookup_counter::received_bytes, transfer.received_bytes);
+        instruments.add(lookup_counter::payload_bytes, body.size());
+
+        long http_code = transfer.http_code;
+        if (curl_code == CURLE_OK && http_code == 429)
+        {
+            // The server is too busy and wants us to back off.
+            // Although we are not the cause because we control our request rate,
+            // keep the flight outstanding, so callers asking for the id keep
+            // joining it, and retry it once the caller has backed off.
+            instruments.add(lookup_counter::rate_limited);
+            instruments.add(lookup_counter::retries);
+            retry_delay = backoff(*flight);
+            return true;
+        }
+
+        auto result = std::make_shared<lookup_result>();
+        result->id = flight->id;
+        result->timestamp = timestamp;
+        result->created = flight->created;
+        result->dispatched = flight->dispatched;
+        result->hedged = hedged;
+        result->hedge_won = hedge_won;
+        if (curl_code != CURLE_OK)
+        {
+            // No complete answer; any status or partial body received is discarded
+            result->outcome = (curl_code == CURLE_OPERATION_TIMEDOUT) ? lookup_outcome::timed_out : lookup_outcome::failed;
+            instruments.add(curl_code == CURLE_OPERATION_TIMEDOUT ? lookup_counter::timeouts : lookup_counter::errors);
+        }
+        else
+        {
+            result->status = http_code;
+            if (http_code == 200)
+            {
+                // Record the response payload
+                result->payload.assign(body);
+            }
+        }
+        // For any HTTP status code not handled above including 403 NOT AUITHORIZED,
+        // and 404 (NOT FOUND), record the status code without a payload.
+        result->timings = timings;
+
+        if (scheduler.overdue(flight))
+        {
+            scheduler.record_late();
+        }
+
+        // Cache before completing so callers arriving after the flight is gone find the result
+        store(result);
+        complete(flight, result);
+        return false;
+    }
+
+    // requestor function runs on a thread for the life of the instance and makes HTTP requests by:
+    //  1) waiting for a flight to be queued
+    //  2) waiting for a request_slot
+    //  3) requesting the data from the web service
+    //  4) releasing the request_slot
+    //  5) caching returned data or error status codes and completing the flight,
+    //     which delivers the result to every caller that asked for the id
+    // Ids are looked up in the memory and disk caches before they are queued.
+    void requestor()
+    {
+        // Make the requests through the transport, libcurl unless a fake one is chosen
+        typename TransportPolicy::handle handle = transport.acquire();
+        if (handle)
+        {
+            // Response body and URL buffers reused by every request this worker makes
+            std::string body;
+            std::string current_url;
+            lookup_transfer transfer;
+
+            // Register the buffer for the response payload,
+            // and apply the timeouts and cancellation
+            std::shared_ptr<lookup_flight> flight;
+            configure_handle(handle, &flight, &body);
+
+            // Make requests until the instance is destroyed
+            while (true)
+            {
+                // Wait for a queued flight, so an idle worker holds no slot, then on a request
+                // slot to avoid server overrun responses.  The flight is only taken once the
+                // slots are held, so the scheduler picks it from everything queued by then.
+                queued.wait();
+                auto waiting = std::chrono::steady_clock::now();
+                request_slot.wait();
+                int shared_slot = acquire_shared_slot();
+                instruments.record(lookup_timer::slot_wait, std::chrono::steady_clock::now() - waiting);
+                if (!pop_request(flight))
+                {
+                    // Another worker took the flight, or the instance is stopping
+                    return_unused_slots(shared_slot);
+                    if (stopping.load())
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                flight->dispatched = std::chrono::steady_clock::now();
+                if (complete_shared(flight) || expire_overdue(flight) || cancel_abandoned(flight))
+                {
+                    return_unused_slots(shared_slot);
+                    flight.reset();
+                    continue;
+                }
+
+                // Take room at a replica, or give the flight and the slots back until a replica has some
+                int replica = -1;
+                if (routed(*flight))
+                {
+                    replica = router->acquire(flight->id, flight->failed_replica);
+                    if (replica < 0)
+                    {
+                        return_unused_slots(shared_slot);
+                        requeue(flight);
+                        router->wait();
+                        continue;
+                    }
+                    transport.aim(handle, router->endpoint(replica), flight->id, current_url);
+                }
+                else
+                {
+                    transport.aim(handle, *flight->endpoint, flight->id, current_url);
+                }
+
+                // Empty the body buffer, keeping its capacity
+                body.clear();
+
+                // Make the HTTP request
+                instruments.sent();
+                CURLcode curl_code = transport.perform(handle);
+                instruments.answered();
+                transport.read(handle, curl_code, transfer);
+
+                // Free the request slot so another thread can send
+                release_slot(transfer, shared_slot);
+                if (replica >= 0)
+                {
+                    router->release(replica, replica_outcome(transfer));
+                }
+
+                // Send the flight to another replica if this one gave no answer
+                if (fail_over(flight, replica, transfer))
+                {
+                    requeue(flight);
+                    continue;
+                }
+
+                // Cache and deliver the response, or back off without holding a request slot
+                // and queue the flight again, to be retried when the scheduler next picks it
+                std::chrono::milliseconds retry_delay;
+                if (record_response(flight, transfer, body, retry_delay))
+                {
+                    std::this_thread::sleep_for(retry_delay);
+                    requeue(flight);
+                }
+                flight.reset();
+            }
+            // Cleanup curl objects, keeping the handle and its connections for reuse
+            transport.release(handle);
+        }
+    }
+
+    // State owned by one multiplexor() transfer
+    struct transfer
+    {
+        CURL *curl;
+        std::shared_ptr<lookup_flight> flight;
+        std::string url;
+        std::string body;
+        char error[CURL_ERROR_SIZE];
+        // Slot of the host-wide gate held while the transfer runs, or -1
+        int shared_slot = -1;
+        // Replica the transfer was routed to, or -1
+        int replica = -1;
+        // Whether the transfer is added to the multi handle, and since when
+        bool active = false;
+        std::chrono::steady_clock::time_point started;
+        // The other transfer of a hedged pair still running for the same flight,
+        // whether the flight was hedged, and whether this transfer is the duplicate
+        transfer *partner = nullptr;
+        bool hedged = false;
+        bool duplicate = false;
+    };
+
+    // Point a multiplexor() transfer at its flight's URL, on its replica if it
+    // was routed to one, and add it to the multi handle
+    void start_transfer(CURLM *multi, transfer *t)
+    {
+        transport.aim(t->curl, (t->replica >= 0) ? router->endpoint(t->replica) : *t->flight->endpoint, t->flight->id, t->url);
+        t->body.clear();
+        t->active = true;
+        t->started = std::chrono::steady_clock::now();
+        if (!t->duplicate)
+        {
+            t->flight->dispatched = t->started;
+        }
+        instruments.sent();
+        curl_multi_add_handle(multi, t->curl);
+    }
+
+    // Return the room a multiplexor() transfer held at its replica, if any
+    void release_replica(transfer *t, lookup_replica_outcome outcome)
+    {
+        if (t->replica >= 0)
+        {
+            router->release(t->replica, outcome);
+            t->replica = -1;
+        }
+    }
+
+    // Return a multiplexor() transfer to the idle list
+    static void retire_transfer(transfer *t, std::vector<transfer *> &idle)
+    {
+        t->flight.reset();
+        t->active = false;
+        t->partner = nullptr;
+        t->hedged = false;
+        t->duplicate = false;
+        idle.push_back(t);
+    }
+
+    // multiplexor function is the event-driven alternative to the requestor threads.
+    // A single thread drives every transfer through the curl multi interface for the
+    // life of the instance and sleeps in curl_multi_poll() until one of the sockets
+    // is ready or a flight is queued by:
+    //  1) taking a free request_slot without blocking
+    //  2) taking a queued flight without blocking
+    //  3) adding a transfer for the flight to the multi handle
+    //  4) releasing the request_slot of each completed transfer
+    //  5) caching returned data or error status codes and completing flights as transfers complete
+    // Transfers that received a 429 response wait out their backoff in a timer heap
+    // before they are retried, as a requestor() thread sleeps before retrying.
+    // With hedging enabled, once nothing is waiting for a slot, a transfer that has
+    // run past the hedge quantile of recent latencies is duplicated on a free slot;
+    // the first of the pair to answer completes the flight and the other is dropped.
+    // No more than max_requests transfers are ever outstanding.
+    void multiplexor(const unsigned int max_requests)
+    {
+        CURLM *multi = curl_multi_init();
+        if (!multi)
+        {
+            return;
+        }
+        transport.pool.configure(multi, max_requests);
+
+        // One reusable transfer per request slot
+        std::vector<transfer> transfers(max_requests);
+        std::vector<transfer *> idle;
+        for (auto &t : transfers)
+        {
+            t.curl = transport.acquire();
+            if (!t.curl)
+            {
+                continue;
+            }
+            configure_handle(t.curl, &t.flight, &t.body);
+            curl_easy_setopt(t.curl, CURLOPT_ERRORBUFFER, t.error);
+            curl_easy_setopt(t.curl, CURLOPT_PRIVATE, (void *)&t);
+            transport.pool.multiplex(t.curl);
+            idle.push_back(&t);
+        }
+
+        // Transfers backing off after a 429 response, earliest retry first,
+        // and transfers whose backoff has elapsed waiting for a request slot
+        typedef std::pair<std::chrono::steady_clock::time_point, transfer *> delayed_retry;
+        std::vector<delayed_retry> delayed;
+        std::vector<transfer *> retries;
+
+        // Latencies of recent successful transfers, for hedging
+        lookup_latency latency;
+
+        // What the completed transfer, and a dropped hedge partner, reported
+        lookup_transfer info;
+        lookup_transfer dropped;
+
+        // Let submitters wake the loop
+        multi_handle.store(multi);
+
+        int running = 0;
+        while (true)
+        {
+            // Collect transfers whose backoff has elapsed
+            auto now = std::chrono::steady_clock::now();
+            while (!delayed.empty() && delayed.front().first <= now)
+            {
+                std::pop_heap(delayed.begin(), delayed.end(), std::greater<delayed_retry>());
+                retries.push_back(delayed.back().second);
+                delayed.pop_back();
+            }
+
+            // Start as many transfers as there are free request slots, retries first
+            bool shared_blocked = false;
+            while (request_slot.try_wait())
+            {
+                transfer *t;
+                if (!retries.empty())
+                {
+                    t = retries.back();
+                    retries.pop_back();
+                }
+                else if (!idle.empty() && try_next_request(idle.back()->flight))
+                {
+                    t = idle.back();
+                    idle.pop_back();
+                }
+                else
+                {
+                    request_slot.post();
+                    break;
+                }
+
+                // Other processes may hold every host-wide slot.  They cannot wake
+                // this loop when one is freed, so poll for it briefly.
+                if (shared && !shared->try_acquire(t->shared_slot))
+                {
+                    retries.push_back(t);
+                    request_slot.post();
+                    shared_blocked = true;
+                    break;
+                }
+                if (complete_shared(t->flight) || expire_overdue(t->flight) || cancel_abandoned(t->flight))
+                {
+                    return_unused_slots(t->shared_slot);
+                    t->shared_slot = -1;
+                    retire_transfer(t, idle);
+                    continue;
+                }
+
+                // Every eligible replica may be full while the ejected ones
+                // hold idle slots; wait for a routed transfer to complete
+                if (routed(*t->flight) && (t->replica = router->acquire(t->flight->id, t->flight->failed_replica)) < 0)
+                {
+                    return_unused_slots(t->shared_slot);
+                    t->shared_slot = -1;
+                    retries.push_back(t);
+                    break;
+                }
+                start_transfer(multi, t);
+                running++;
+            }
+
+            // Hedge slow transfers on slots nothing else is waiting for
+            auto next_hedge = std::chrono::steady_clock::time_point::max();
+            if (options.hedge.enabled && !shared_blocked && retries.empty() && !idle.empty())
+            {
+                auto threshold = latency.quantile(options.hedge.quantile, options.hedge.min_samples);
+                now = std::chrono::steady_clock::now();
+                for (auto &t : transfers)
+                {
+                    if (threshold.count() == 0 || idle.empty())
+                    {
+                        break;
+                    }
+                    if (!t.active || t.hedged)
+                    {
+                        continue;
+                    }
+                    if (now - t.started < threshold)
+                    {
+                        next_hedge = std::min(next_hedge, t.started + threshold);
+                        continue;
+                    }
+                    int shared_slot = -1;
+                    if (!request_slot.try_wait())
+                    {
+                        break;
+                    }
+                    if (shared && !shared->try_acquire(shared_slot))
+                    {
+                        request_slot.post();
+                        break;
+                    }
+                    // A routed duplicate goes to another replica than the original
+                    int replica = routed(*t.flight) ? router->acquire(t.flight->id, t.replica) : -1;
+                    if (routed(*t.flight) && replica < 0)
+                    {
+                        return_unused_slots(shared_slot);
+                        break;
+                    }
+                    transfer *h = idle.back();
+                    idle.pop_back();
+                    h->flight = t.flight;
+                    h->replica = replica;
+                    h->shared_slot = shared_slot;
+                    h->partner = &t;
+                    h->hedged = true;
+                    h->duplicate = true;
+                    t.partner = h;
+                    t.hedged = true;
+                    instruments.add(lookup_counter::hedges);
+                    start_transfer(multi, h);
+                    running++;
+                }
+            }
+
+            // Nothing in flight, backing off or queued, and nothing more will be submitted
+            if (running == 0 && delayed.empty() && retries.empty() && stopping.load() && scheduler.size() == 0)
+            {
+                break;
+            }
+
+            int still_running = 0;
+            curl_multi_perform(multi, &still_running);
+
+            // Harvest completed transfers
+            bool completed = false;
+            int messages = 0;
+            CURLMsg *message;
+            while ((message = curl_multi_info_read(multi, &messages)))
+            {
+                if (message->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+                transfer *t = NULL;
+                curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+                if (!t->active)
+                {
+                    // The losing half of a hedged pair, already dropped
+                    continue;
+                }
+                curl_multi_remove_handle(multi, t->curl);
+                instruments.answered();
+                t->active = false;
+                transport.read(t->curl, message->data.result, info);
+
+                // Free the request slot so another transfer can start
+                running--;
+                completed = true;
+                release_slot(info, t->shared_slot);
+                t->shared_slot = -1;
+                int replica = t->replica;
+                release_replica(t, replica_outcome(info));
+
+                bool answered = (info.code == CURLE_OK && info.http_code != 429);
+                if (answered)
+                {
+                    latency.record(info.timings.total);
+                }
+
+                if (t->partner)
+                {
+                    transfer *partner = t->partner;
+                    if (!answered)
+                    {
+                        // Leave the flight to the other transfer of the pair
+                        partner->partner = nullptr;
+                        retire_transfer(t, idle);
+                        continue;
+                    }
+
+                    // First answer of the pair; drop the other transfer
+                    curl_multi_remove_handle(multi, partner->curl);
+                    instruments.answered();
+                    running--;
+                    transport.read(partner->curl, CURLE_ABORTED_BY_CALLBACK, dropped);
+                    release_slot(dropped, partner->shared_slot);
+                    partner->shared_slot = -1;
+                    release_replica(partner, lookup_replica_outcome::abandoned);
+                    retire_transfer(partner, idle);
+                    t->partner = nullptr;
+                }
+
+                // Send the flight to another replica if this one gave no answer
+                if (fail_over(t->flight, replica, info))
+                {
+                    requeue(t->flight);
+                    retire_transfer(t, idle);
+                    continue;
+                }
+
+                // Cache and deliver the response or back off
+                std::chrono::milliseconds retry_delay;
+                if (record_response(t->flight, info, t->body, retry_delay, t->hedged, t->duplicate))
+                {
+                    // Park the transfer until its backoff elapses
+                    t->hedged = false;
+                    t->duplicate = false;
+                    delayed.emplace_back(std::chrono::steady_clock::now() + retry_delay, t);
+                    std::push_heap(delayed.begin(), delayed.end(), std::greater<delayed_retry>());
+                }
+                else
+                {
+                    retire_transfer(t, idle);
+                }
+            }
+
+            // Sleep until a socket is ready, a flight is queued or a backoff elapses,
+            // unless a slot was just freed
+            if (!completed)
+            {
+                int timeout = shared_blocked ? 5 : 1000;
+                auto wake_at = next_hedge;
+                if (!delayed.empty())
+                {
+                    wake_at = std::min(wake_at, delayed.front().first);
+                }
+                if (wake_at != std::chrono::steady_clock::time_point::max())
+                {
+                    auto until = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        wake_at - std::chrono::steady_clock::now());
+                    timeout = (int)std::max<long long>(0, std::min<long long>(timeout, until.count() + 1));
+                }
+                curl_multi_poll(multi, NULL, 0, timeout, NULL);
+            }
+        }
+
+        // Cleanup curl objects, keeping the handles and their connections for reuse
+        multi_handle.store(nullptr);
+        for (auto &t : transfers)
+        {
+            if (t.curl)
+            {
+                transport.release(t.curl);
+            }
+        }
+        curl_multi_cleanup(multi);
+    }
+};
+
+// The lookup service with every feature, sending requests with libcurl
+using lookup_get = basic_lookup_get<>;
 
 // #ifdef __cplusplus
 // }
 // #endif
 
-#endif /* LOOKUP_GET_CPP_INCLUDED */
\ No newline at end of file
+#endif /* LOOKUP_GET_CPP_INCLUDED */
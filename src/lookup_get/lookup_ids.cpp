@@ -0,0 +1,292 @@
+#ifndef LOOKUP_IDS_CPP_INCLUDED
+#define LOOKUP_IDS_CPP_INCLUDED
+
+// lookup_ids
+// Author: Jordan Chandler
+
+// Compact storage and deduplication of the ids of very large batches.
+//
+// A std::string id longer than the small string buffer costs its object plus
+// a heap block, and a node based hash set over millions of them costs another
+// node per id and a pointer chase per probe.  Here ids are named by 32-bit
+// handles instead.  lookup_handle_set is an open addressing table of handles
+// and their ids' hashes, 8 bytes a slot, that resolves a handle to its id only
+// to confirm a match.  lookup_id_arena stores each distinct id once, back to
+// back in one byte array, in the order interned, so an id's handle is its
+// position.  While every id has the same length, as lookup_client's tokens
+// do, that position alone locates it and no offsets are kept; the first id of
+// another length starts an offset table.
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <limits>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+
+using lookup_id_handle = uint32_t;
+
+constexpr lookup_id_handle lookup_no_id = std::numeric_limits<lookup_id_handle>::max();
+
+// Set of handles naming distinct ids.  The ids live elsewhere;
+// resolve(handle) returns the id a handle names.
+template <typename Resolve>
+class lookup_handle_set
+{
+public:
+    lookup_handle_set(Resolve resolve, size_t expected = 0)
+        : resolve(resolve)
+    {
+        reserve(expected);
+    }
+
+    // Add handle unless an equal id is present.
+    // Returns the handle already naming the id, or handle itself if it was added.
+    lookup_id_handle insert(lookup_id_handle handle)
+    {
+        if ((count + 1) * 2 > slots.size())
+        {
+            rehash(std::max<size_t>(slots.size() * 2, 16));
+        }
+        std::string_view id = resolve(handle);
+        uint32_t hash = hash_of(id);
+        size_t i = hash & mask;
+        while (slots[i].handle != lookup_no_id)
+        {
+            if (slots[i].hash == hash && resolve(slots[i].handle) == id)
+            {
+                return slots[i].handle;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = slot{hash, handle};
+        count++;
+        return handle;
+    }
+
+    // The handle naming id, or lookup_no_id
+    lookup_id_handle find(std::string_view id) const
+    {
+        if (count == 0)
+        {
+            return lookup_no_id;
+        }
+        uint32_t hash = hash_of(id);
+        for (size_t i = hash & mask; slots[i].handle != lookup_no_id; i = (i + 1) & mask)
+        {
+            if (slots[i].hash == hash && resolve(slots[i].handle) == id)
+            {
+                return slots[i].handle;
+            }
+        }
+        return lookup_no_id;
+    }
+
+    // Make room for expected handles without rehashing
+    void reserve(size_t expected)
+    {
+        size_t wanted = 16;
+        while (wanted < expected * 2)
+        {
+            wanted <<= 1;
+        }
+        if (wanted > slots.size())
+        {
+            rehash(wanted);
+        }
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    // Bytes held by the table
+    size_t memory() const
+    {
+        return slots.capacity() * sizeof(slot);
+    }
+
+    void clear()
+    {
+        slots = std::vector<slot>();
+        count = 0;
+        mask = 0;
+    }
+
+private:
+    struct slot
+    {
+        uint32_t hash;
+        lookup_id_handle handle;
+    };
+
+    static uint32_t hash_of(std::string_view id)
+    {
+        size_t hash = std::hash<std::string_view>{}(id);
+        return (uint32_t)(hash ^ (hash >> 32));
+    }
+
+    // Move every handle to a table of capacity slots, a power of two,
+    // reusing the stored hashes rather than resolving any id
+    void rehash(size_t capacity)
+    {
+        std::vector<slot> old(capacity, slot{0, lookup_no_id});
+        old.swap(slots);
+        mask = capacity - 1;
+        for (const slot &entry : old)
+        {
+            if (entry.handle != lookup_no_id)
+            {
+                size_t i = entry.hash & mask;
+                while (slots[i].handle != lookup_no_id)
+                {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = entry;
+            }
+        }
+    }
+
+    Resolve resolve;
+    std::vector<slot> slots;
+    size_t count = 0;
+    size_t mask = 0;
+};
+
+// Distinct ids in one flat array, named by handles in the order they were interned
+class lookup_id_arena
+{
+public:
+    lookup_id_arena()
+        : table(resolver{this}) {}
+
+    lookup_id_arena(const lookup_id_arena &) = delete;
+    lookup_id_arena &operator=(const lookup_id_arena &) = delete;
+
+    // The handle of id, interning it if it is new.  inserted is set when it was.
+    lookup_id_handle intern(std::string_view id, bool &inserted)
+    {
+        offered_count++;
+        lookup_id_handle found = table.find(id);
+        inserted = (found == lookup_no_id);
+        if (!inserted)
+        {
+            return found;
+        }
+        assert(count < lookup_no_id);
+        if (count == 0)
+        {
+            fixed_length = id.size();
+        }
+        else if (offsets.empty() && id.size() != fixed_length)
+        {
+            // The lengths differ from here on: locate every id by offset
+            offsets.reserve(count + 2);
+            for (size_t i = 0; i <= count; i++)
+            {
+                offsets.push_back(i * fixed_length);
+            }
+        }
+        if (!bytes.empty() && id.data() >= bytes.data() && id.data() < bytes.data() + bytes.size())
+        {
+            // A view into bytes itself would dangle if appending reallocates them
+            std::string copy(id);
+            bytes.insert(bytes.end(), copy.begin(), copy.end());
+        }
+        else
+        {
+            bytes.insert(bytes.end(), id.begin(), id.end());
+        }
+        if (!offsets.empty())
+        {
+            offsets.push_back(bytes.size());
+        }
+        lookup_id_handle handle = count++;
+        table.insert(handle);
+        return handle;
+    }
+
+    lookup_id_handle intern(std::string_view id)
+    {
+        bool inserted;
+        return intern(id, inserted);
+    }
+
+    // The handle of id, or lookup_no_id if it was never interned
+    lookup_id_handle find(std::string_view id) const
+    {
+        return table.find(id);
+    }
+
+    // The id a handle names.  Valid until the next id is interned.
+    std::string_view operator[](lookup_id_handle handle) const
+    {
+        if (offsets.empty())
+        {
+            return std::string_view(bytes.data() + (size_t)handle * fixed_length, fixed_length);
+        }
+        return std::string_view(bytes.data() + offsets[handle], offsets[handle + 1] - offsets[handle]);
+    }
+
+    // Distinct ids interned
+    size_t size() const
+    {
+        return count;
+    }
+
+    // Ids offered to intern(), repeats included
+    uint64_t offered() const
+    {
+        return offered_count;
+    }
+
+    // Make room for count ids averaging id_length bytes without reallocating
+    void reserve(size_t count, size_t id_length)
+    {
+        bytes.reserve(count * id_length);
+        table.reserve(count);
+    }
+
+    // Bytes held by the arena
+    size_t memory() const
+    {
+        return bytes.capacity() + offsets.capacity() * sizeof(uint64_t) + table.memory();
+    }
+
+    void clear()
+    {
+        bytes = std::vector<char>();
+        offsets = std::vector<uint64_t>();
+        table.clear();
+        count = 0;
+        fixed_length = 0;
+        offered_count = 0;
+    }
+
+private:
+    struct resolver
+    {
+        const lookup_id_arena *arena;
+
+        std::string_view operator()(lookup_id_handle handle) const
+        {
+            return (*arena)[handle];
+        }
+    };
+
+    // Ids back to back, in handle order
+    std::vector<char> bytes;
+
+    // Start of each id in bytes and the end of the last, kept only once ids of
+    // different lengths have been interned; until then every id is fixed_length long
+    std::vector<uint64_t> offsets;
+    size_t fixed_length = 0;
+
+    lookup_handle_set<resolver> table;
+    size_t count = 0;
+    uint64_t offered_count = 0;
+};
+
+#endif /* LOOKUP_IDS_CPP_INCLUDED */
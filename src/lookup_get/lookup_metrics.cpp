@@ -0,0 +1,322 @@
+#ifndef LOOKUP_METRICS_CPP_INCLUDED
+#define LOOKUP_METRICS_CPP_INCLUDED
+
+// lookup_metrics
+// Author: Jordan Chandler
+
+// Counters, gauges and latency histograms describing where a lookup_get
+// instance spends its time, cheap enough to leave enabled.
+//
+// Every update is a single relaxed atomic add, so workers never block on
+// instrumentation.  Histograms use fixed power-of-two microsecond buckets:
+// bucket 0 counts durations under 1 us, bucket i durations from 2^(i-1) up to
+// 2^i us, and the last bucket everything longer.  snapshot() copies all of it
+// for a caller, which can print a summary or Prometheus text exposition.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Events counted by lookup_metrics
+enum class lookup_counter
+{
+    // HTTP requests sent, including retries and hedges
+    requests,
+    // Ids answered by the memory, shared memory or disk caches
+    cache_hits,
+    // Ids that had to be requested
+    cache_misses,
+    // Ids that needed no request of their own: repeated within a call or joined to an outstanding flight
+    duplicates,
+    // 429 responses received
+    rate_limited,
+    // Requests sent again after a 429 response, an abort or a failure at one of several replicas
+    retries,
+    // Transfers that failed before an answer was received
+    errors,
+    timeouts,
+    cancelled,
+    expired,
+    // Duplicate requests sent to hedge a slow one
+    hedges,
+    // Uncached ids handed to prefetch()
+    prefetches,
+    // Cached ids requested again in the background because they were about to expire or had
+    refreshes,
+    // Response body bytes as sent by the server, compressed or not
+    received_bytes,
+    // Response body bytes after libcurl decoded any content encoding
+    payload_bytes,
+    count
+};
+
+// Durations measured by lookup_metrics
+enum class lookup_timer
+{
+    // From the id being queued to a worker taking it
+    queue_wait,
+    // Spent by a worker waiting for request slots
+    slot_wait,
+    // Phases of a transfer as reported by libcurl, from the start of the transfer
+    name_lookup,
+    connect,
+    first_byte,
+    total,
+    // From the id being queued to its result being delivered
+    end_to_end,
+    count
+};
+
+constexpr size_t lookup_histogram_buckets = 28;
+
+// Copy of a lookup_histogram
+struct lookup_histogram_snapshot
+{
+    std::array<uint64_t, lookup_histogram_buckets> buckets{};
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+
+    // Upper bound of bucket i in microseconds; the last bucket has none
+    static uint64_t bound_us(size_t i)
+    {
+        return (uint64_t)1 << i;
+    }
+
+    // Estimate of quantile q, interpolated within the bucket holding it
+    std::chrono::microseconds quantile(double q) const
+    {
+        if (count == 0)
+        {
+            return std::chrono::microseconds(0);
+        }
+        double rank = q * count;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (buckets[i] == 0 || seen + buckets[i] < rank)
+            {
+                seen += buckets[i];
+                continue;
+            }
+            double lower = (i == 0) ? 0 : bound_us(i - 1);
+            double upper = (i + 1 == buckets.size()) ? lower * 2 : bound_us(i);
+            double fraction = (rank - seen) / buckets[i];
+            return std::chrono::microseconds((long long)(lower + (upper - lower) * fraction));
+        }
+        return std::chrono::microseconds((long long)bound_us(buckets.size() - 1));
+    }
+
+    std::chrono::microseconds mean() const
+    {
+        return std::chrono::microseconds(count ? (long long)(sum_us / count) : 0);
+    }
+};
+
+// Lock-free histogram of durations
+class lookup_histogram
+{
+public:
+    void record(std::chrono::microseconds duration)
+    {
+        uint64_t us = (duration.count() > 0) ? (uint64_t)duration.count() : 0;
+        size_t bucket = us ? (size_t)(64 - __builtin_clzll(us)) : 0;
+        buckets[std::min(bucket, lookup_histogram_buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    lookup_histogram_snapshot snapshot() const
+    {
+        lookup_histogram_snapshot copy;
+        for (size_t i = 0; i < lookup_histogram_buckets; i++)
+        {
+            copy.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            copy.count += copy.buckets[i];
+        }
+        copy.sum_us = sum_us.load(std::memory_order_relaxed);
+        return copy;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, lookup_histogram_buckets> buckets{};
+    std::atomic<uint64_t> sum_us{0};
+};
+
+// Copy of a lookup_metrics, with the gauges read at the same time
+struct lookup_metrics_snapshot
+{
+    std::array<uint64_t, (size_t)lookup_counter::count> counters{};
+    std::array<lookup_histogram_snapshot, (size_t)lookup_timer::count> timers;
+
+    // Flights waiting for a worker
+    uint64_t queued = 0;
+    // Requests currently sent and unanswered
+    uint64_t in_flight = 0;
+
+    uint64_t counter(lookup_counter c) const
+    {
+        return counters[(size_t)c];
+    }
+
+    const lookup_histogram_snapshot &timer(lookup_timer t) const
+    {
+        return timers[(size_t)t];
+    }
+
+    // Prometheus text exposition format, version 0.0.4
+    void write_prometheus(std::ostream &out) const
+    {
+        for (size_t c = 0; c < counters.size(); c++)
+        {
+            out << "# HELP lookup_" << counter_names[c] << "_total " << counter_help[c] << "\n"
+                << "# TYPE lookup_" << counter_names[c] << "_total counter\n"
+                << "lookup_" << counter_names[c] << "_total " << counters[c] << "\n";
+        }
+        out << "# HELP lookup_queued Ids waiting for a worker\n"
+            << "# TYPE lookup_queued gauge\n"
+            << "lookup_queued " << queued << "\n"
+            << "# HELP lookup_in_flight Requests sent and not yet answered\n"
+            << "# TYPE lookup_in_flight gauge\n"
+            << "lookup_in_flight " << in_flight << "\n";
+        for (size_t t = 0; t < timers.size(); t++)
+        {
+            const lookup_histogram_snapshot &h = timers[t];
+            std::string name = std::string("lookup_") + timer_names[t] + "_seconds";
+            out << "# HELP " << name << " " << timer_help[t] << "\n"
+                << "# TYPE " << name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i + 1 < h.buckets.size(); i++)
+            {
+                cumulative += h.buckets[i];
+                out << name << "_bucket{le=\"" << seconds(h.bound_us(i)) << "\"} " << cumulative << "\n";
+            }
+            out << name << "_bucket{le=\"+Inf\"} " << h.count << "\n"
+                << name << "_sum " << seconds(h.sum_us) << "\n"
+                << name << "_count " << h.count << "\n";
+        }
+    }
+
+    // One line per counter and timer, for people
+    void write_summary(std::ostream &out) const
+    {
+        out << "counters:";
+        for (size_t c = 0; c < counters.size(); c++)
+        {
+            out << " " << counter_names[c] << "=" << counters[c];
+        }
+        out << "\ngauges: queued=" << queued << " in_flight=" << in_flight << "\n";
+        out << std::left << std::setw(12) << "timer" << std::right
+            << std::setw(9) << "count" << std::setw(12) << "mean ms" << std::setw(12) << "p50 ms"
+            << std::setw(12) << "p90 ms" << std::setw(12) << "p99 ms" << "\n";
+        for (size_t t = 0; t < timers.size(); t++)
+        {
+            const lookup_histogram_snapshot &h = timers[t];
+            out << std::left << std::setw(12) << timer_names[t] << std::right << std::setw(9) << h.count
+                << std::fixed << std::setprecision(3)
+                << std::setw(12) << h.mean().count() / 1000.0
+                << std::setw(12) << h.quantile(0.5).count() / 1000.0
+                << std::setw(12) << h.quantile(0.9).count() / 1000.0
+                << std::setw(12) << h.quantile(0.99).count() / 1000.0 << "\n";
+        }
+        out << std::defaultfloat;
+    }
+
+private:
+    static std::string seconds(uint64_t us)
+    {
+        std::ostringstream text;
+        text << us / 1e6;
+        return text.str();
+    }
+
+    static constexpr const char *counter_names[] = {
+        "requests", "cache_hits", "cache_misses", "duplicates", "rate_limited", "retries",
+        "errors", "timeouts", "cancelled", "expired", "hedges", "prefetches", "refreshes", "received_bytes", "payload_bytes"};
+    static constexpr const char *counter_help[] = {
+        "HTTP requests sent, including retries and hedges",
+        "Ids answered from a cache",
+        "Ids that had to be requested",
+        "Ids repeated within a call or joined to an outstanding request",
+        "Responses with status 429",
+        "Requests sent again after a 429 response or an abort",
+        "Transfers that failed before an answer was received",
+        "Requests abandoned after the connect or request timeout",
+        "Requests dropped or aborted because every caller stopped waiting",
+        "Ids dropped because their deadline passed before they were requested",
+        "Duplicate requests sent to hedge slow ones",
+        "Uncached ids queued for background fetching",
+        "Cached ids refreshed in the background near or after expiry",
+        "Response body bytes as sent by the server",
+        "Response body bytes after content decoding"};
+    static constexpr const char *timer_names[] = {
+        "queue_wait", "slot_wait", "name_lookup", "connect", "first_byte", "total", "end_to_end"};
+    static constexpr const char *timer_help[] = {
+        "Time from an id being queued to a worker taking it",
+        "Time a worker waited for request slots",
+        "Time to resolve the server's name",
+        "Time to connect to the server",
+        "Time to the first byte of the response",
+        "Time of the whole transfer",
+        "Time from an id being queued to its result being delivered"};
+};
+
+// Instruments of one lookup_get instance
+class lookup_metrics
+{
+public:
+    void add(lookup_counter c, uint64_t n = 1)
+    {
+        counters[(size_t)c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(lookup_timer t, std::chrono::microseconds duration)
+    {
+        timers[(size_t)t].record(duration);
+    }
+
+    template <typename Duration>
+    void record(lookup_timer t, Duration duration)
+    {
+        record(t, std::chrono::duration_cast<std::chrono::microseconds>(duration));
+    }
+
+    // Requests currently sent and unanswered
+    void sent()
+    {
+        in_flight.fetch_add(1, std::memory_order_relaxed);
+        add(lookup_counter::requests);
+    }
+
+    void answered()
+    {
+        in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    lookup_metrics_snapshot snapshot(uint64_t queued) const
+    {
+        lookup_metrics_snapshot copy;
+        for (size_t c = 0; c < copy.counters.size(); c++)
+        {
+            copy.counters[c] = counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t t = 0; t < copy.timers.size(); t++)
+        {
+            copy.timers[t] = timers[t].snapshot();
+        }
+        copy.queued = queued;
+        copy.in_flight = in_flight.load(std::memory_order_relaxed);
+        return copy;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, (size_t)lookup_counter::count> counters{};
+    std::array<lookup_histogram, (size_t)lookup_timer::count> timers;
+    std::atomic<uint64_t> in_flight{0};
+};
+
+#endif /* LOOKUP_METRICS_CPP_INCLUDED */
@@ -0,0 +1,205 @@
+#ifndef LOOKUP_POOL_CPP_INCLUDED
+#define LOOKUP_POOL_CPP_INCLUDED
+
+// lookup_pool
+// Author: Jordan Chandler
+
+// Long-lived pool of libcurl easy handles owned by a lookup_get instance.
+//
+// Handles are returned to the pool when a worker finishes rather than being
+// cleaned up, and every handle is attached to one CURLSH share object that
+// holds the DNS cache, the connection cache and the TLS session cache.  Any
+// worker, in this or a later request() call, can therefore reuse a kept-alive
+// connection (and resume a TLS session) opened by any other worker instead of
+// paying for a new handshake.
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <curl/curl.h>
+
+// HTTP versions lookup_pool's handles may negotiate
+enum class lookup_http_version
+{
+    // HTTP/1.1 with one request per connection at a time
+    http1,
+    // HTTP/2 over TLS (ALPN) or upgraded from HTTP/1.1, falling back to HTTP/1.1.
+    // With the multi engine, concurrent requests are multiplexed over one connection.
+    // The threaded engine cannot multiplex because each worker's transfer runs alone
+    // in curl_easy_perform(), so its workers use one HTTP/2 connection each.
+    http2,
+    // HTTP/2 without negotiation, for servers known to speak cleartext HTTP/2 (h2c)
+    http2_prior_knowledge
+};
+
+// Settings for lookup_pool's handles
+struct lookup_pool_options
+{
+    lookup_http_version http_version = lookup_http_version::http1;
+
+    // Idle seconds before TCP keep-alive probes are sent on a pooled connection
+    long keepalive_idle = 30;
+
+    // Seconds between TCP keep-alive probes
+    long keepalive_interval = 15;
+
+    // Most idle connections kept open for reuse
+    long max_connections = 64;
+
+    // Offer every content encoding libcurl can decode (gzip and deflate, and
+    // br or zstd where libcurl was built with them) and decode the body
+    // before it reaches lookup_get.  Servers that do not compress are unaffected.
+    bool accept_compressed = true;
+};
+
+class lookup_pool
+{
+public:
+    lookup_pool(const lookup_pool_options &options = lookup_pool_options())
+        : options(options)
+    {
+        share = curl_share_init();
+        if (share)
+        {
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_callback);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, (void *)this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        }
+    }
+
+    ~lookup_pool()
+    {
+        for (CURL *curl : idle)
+        {
+            curl_easy_cleanup(curl);
+        }
+        if (share)
+        {
+            curl_share_cleanup(share);
+        }
+    }
+
+    lookup_pool(const lookup_pool &) = delete;
+    lookup_pool &operator=(const lookup_pool &) = delete;
+
+    // Take an idle handle, or create one if none is idle.  Returns NULL if libcurl fails.
+    CURL *acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            if (!idle.empty())
+            {
+                CURL *curl = idle.back();
+                idle.pop_back();
+                return curl;
+            }
+        }
+
+        CURL *curl = curl_easy_init();
+        if (curl)
+        {
+            configure(curl);
+        }
+        return curl;
+    }
+
+    // Return a handle for reuse.  Per-transfer pointers are cleared because
+    // the buffers they point to do not outlive the transfer.
+    void release(CURL *curl)
+    {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, NULL);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+
+        std::lock_guard<std::mutex> lock(accessor);
+        idle.push_back(curl);
+    }
+
+    // Let a handle driven by a multi handle wait for a connection it can multiplex on
+    // rather than opening another.  Only safe under a multi handle: easy handles
+    // performed on different threads could wait on each other's connections forever.
+    void multiplex(CURL *curl)
+    {
+        if (options.http_version != lookup_http_version::http1)
+        {
+            curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        }
+    }
+
+    // Tune a multi handle for this pool's handles and the given number of request slots
+    void configure(CURLM *multi, long max_requests)
+    {
+        if (options.http_version != lookup_http_version::http1)
+        {
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_requests);
+        }
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, std::max(max_requests, options.max_connections));
+    }
+
+private:
+    // Settings shared by every transfer made with a pooled handle
+    void configure(CURL *curl)
+    {
+        if (share)
+        {
+            curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        }
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, options.keepalive_idle);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, options.keepalive_interval);
+        curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, options.max_connections);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+        if (options.accept_compressed)
+        {
+            // An empty string offers all the built in encodings
+            curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        }
+
+        switch (options.http_version)
+        {
+        case lookup_http_version::http1:
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+            break;
+        case lookup_http_version::http2:
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+            break;
+        case lookup_http_version::http2_prior_knowledge:
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+            break;
+        }
+    }
+
+    static void lock_callback(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
+    {
+        ((lookup_pool *)userptr)->share_accessors[data].lock();
+    }
+
+    static void unlock_callback(CURL *, curl_lock_data data, void *userptr)
+    {
+        ((lookup_pool *)userptr)->share_accessors[data].unlock();
+    }
+
+    lookup_pool_options options;
+
+    // DNS, connection and TLS session caches shared by every handle
+    CURLSH *share;
+
+    // One mutex per kind of shared data, as requested by the share's lock callbacks
+    std::mutex share_accessors[CURL_LOCK_DATA_LAST];
+
+    // Handles not in use by a worker
+    std::vector<CURL *> idle;
+
+    // Protect access to idle
+    std::mutex accessor;
+};
+
+#endif /* LOOKUP_POOL_CPP_INCLUDED */
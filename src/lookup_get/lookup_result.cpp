@@ -0,0 +1,264 @@
+#ifndef LOOKUP_RESULT_CPP_INCLUDED
+#define LOOKUP_RESULT_CPP_INCLUDED
+
+// lookup_result
+// Author: Jordan Chandler
+
+// Typed record of one lookup, produced by lookup_get's workers and shared
+// with the response cache.
+//
+// Workers only fill in the fields; nothing is formatted on the request path.
+// The JSON envelope lookup_get has always returned,
+//      {"id":"<id>","timestamp":<ns since epoch>,"status":<status>,"response":<payload or null>}
+// is produced on demand by json() or append_json(), or streamed by
+// write_json() and write_ndjson() without building an intermediate string.
+// The id is escaped as a JSON string must be, since ids read from a file may
+// hold any character.
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <ostream>
+#include <string_view>
+#include <charconv>
+#include <algorithm>
+
+// Phases of a transfer as reported by libcurl, measured from the start of the transfer
+struct lookup_timings
+{
+    std::chrono::microseconds name_lookup{0};
+    std::chrono::microseconds connect{0};
+    std::chrono::microseconds tls_connect{0};
+    std::chrono::microseconds pre_transfer{0};
+    std::chrono::microseconds first_byte{0};
+    std::chrono::microseconds total{0};
+};
+
+// Convert between the steady clock results are stamped with and the wall clock they are reported in
+inline std::chrono::system_clock::time_point lookup_wall_clock(std::chrono::steady_clock::time_point timestamp)
+{
+    return std::chrono::system_clock::now() -
+           std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - timestamp);
+}
+
+inline std::chrono::steady_clock::time_point lookup_steady_clock(std::chrono::system_clock::time_point timestamp)
+{
+    return std::chrono::steady_clock::now() -
+           std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::system_clock::now() - timestamp);
+}
+
+// How a lookup ended
+enum class lookup_outcome
+{
+    // The server answered; status holds its HTTP status
+    completed,
+    // The transfer failed before an answer was received
+    failed,
+    // The connect or request timeout elapsed
+    timed_out,
+    // Every caller waiting for the id stopped waiting
+    cancelled,
+    // The id's deadline passed before it was requested
+    expired
+};
+
+struct lookup_result
+{
+    std::string id;
+
+    // When the response was received
+    std::chrono::steady_clock::time_point timestamp;
+
+    // When the first caller asked for the id, and when a worker took the
+    // request slot it was answered on.  Unset for results loaded from the
+    // disk or shared memory caches, and dispatched for ids never requested.
+    std::chrono::steady_clock::time_point created;
+    std::chrono::steady_clock::time_point dispatched;
+
+    // HTTP status code, or 0 if no answer was received
+    long status = 0;
+
+    lookup_outcome outcome = lookup_outcome::completed;
+
+    // A duplicate request was sent because the first was slower than usual,
+    // and whether the duplicate answered first
+    bool hedged = false;
+    bool hedge_won = false;
+
+    // Response body of a 200 (OK) response, empty otherwise
+    std::string payload;
+
+    // Transfer timings; zero for results loaded from the disk cache
+    lookup_timings timings;
+
+    // The JSON envelope for this result
+    std::string json() const
+    {
+        std::string out;
+        append_json(out);
+        return out;
+    }
+
+    // Append the JSON envelope for this result to out
+    void append_json(std::string &out) const
+    {
+        digits timestamp_digits(wall_clock_ns());
+        digits status_digits(status);
+
+        size_t needed = out.size() + sizeof(id_field) + sizeof(timestamp_field) + sizeof(status_field) + sizeof(response_field) +
+                        id.size() + timestamp_digits.size + status_digits.size + (has_response() ? payload.size() : 4) + 1;
+        if (needed > out.capacity())
+        {
+            // Geometric growth keeps appending many results to one buffer linear
+            out.reserve(std::max(needed, out.capacity() * 2));
+        }
+        out.append(id_field, sizeof(id_field) - 1);
+        escape(id, [&out](const char *text, size_t size) { out.append(text, size); });
+        out.append(timestamp_field, sizeof(timestamp_field) - 1);
+        out.append(timestamp_digits.text, timestamp_digits.size);
+        out.append(status_field, sizeof(status_field) - 1);
+        out.append(status_digits.text, status_digits.size);
+        out.append(response_field, sizeof(response_field) - 1);
+        if (has_response())
+        {
+            out.append(payload);
+        }
+        else
+        {
+            out.append("null", 4);
+        }
+        out.push_back('}');
+    }
+
+    // Write the JSON envelope for this result to out
+    void write_json(std::ostream &out) const
+    {
+        digits timestamp_digits(wall_clock_ns());
+        digits status_digits(status);
+
+        out.write(id_field, sizeof(id_field) - 1);
+        escape(id, [&out](const char *text, size_t size) { out.write(text, size); });
+        out.write(timestamp_field, sizeof(timestamp_field) - 1);
+        out.write(timestamp_digits.text, timestamp_digits.size);
+        out.write(status_field, sizeof(status_field) - 1);
+        out.write(status_digits.text, status_digits.size);
+        out.write(response_field, sizeof(response_field) - 1);
+        if (has_response())
+        {
+            out.write(payload.data(), payload.size());
+        }
+        else
+        {
+            out.write("null", 4);
+        }
+        out.put('}');
+    }
+
+private:
+    // Whether the envelope's response is the payload rather than null.
+    // A 200 result kept without its body, or with an empty one, has none.
+    bool has_response() const
+    {
+        return status == 200 && !payload.empty();
+    }
+
+    // Pass text to emit as the contents of a JSON string: runs of characters
+    // that stand for themselves, and an escape sequence for each quote,
+    // backslash and control character
+    template <typename Emit>
+    static void escape(std::string_view text, Emit emit)
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        size_t run = 0;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            unsigned char c = (unsigned char)text[i];
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                continue;
+            }
+            emit(text.data() + run, i - run);
+            char sequence[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            size_t length = 2;
+            switch (c)
+            {
+            case '"':
+            case '\\':
+                sequence[1] = (char)c;
+                break;
+            case '\b':
+                sequence[1] = 'b';
+                break;
+            case '\f':
+                sequence[1] = 'f';
+                break;
+            case '\n':
+                sequence[1] = 'n';
+                break;
+            case '\r':
+                sequence[1] = 'r';
+                break;
+            case '\t':
+                sequence[1] = 't';
+                break;
+            default:
+                length = sizeof(sequence);
+            }
+            emit(sequence, length);
+            run = i + 1;
+        }
+        emit(text.data() + run, text.size() - run);
+    }
+
+    static constexpr char id_field[] = "{\"id\":\"";
+    static constexpr char timestamp_field[] = "\",\"timestamp\":";
+    static constexpr char status_field[] = ",\"status\":";
+    static constexpr char response_field[] = ",\"response\":";
+
+    // Decimal text of a number, formatted without allocating
+    struct digits
+    {
+        digits(long long value)
+            : size(std::to_chars(text, text + sizeof(text), value).ptr - text) {}
+
+        char text[24];
+        size_t size;
+    };
+
+    long long wall_clock_ns() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   lookup_wall_clock(timestamp).time_since_epoch())
+            .count();
+    }
+};
+
+// Results are immutable once produced and shared rather than copied
+using lookup_result_ptr = std::shared_ptr<const lookup_result>;
+
+// Result policies of basic_lookup_get, deciding what of a response its result keeps.
+// lookup_payload_result keeps the body of every 200 response.
+struct lookup_payload_result
+{
+    static constexpr bool payload = true;
+};
+
+// Keeps only the status, for callers that only ask whether ids exist.
+// Bodies are discarded as they arrive, so none is buffered, copied or cached.
+struct lookup_status_result
+{
+    static constexpr bool payload = false;
+};
+
+// Write results to out as newline delimited JSON, one envelope per line
+inline void write_ndjson(std::ostream &out, const std::vector<lookup_result_ptr> &results)
+{
+    for (const auto &result : results)
+    {
+        result->write_json(out);
+        out.put('\n');
+    }
+}
+
+#endif /* LOOKUP_RESULT_CPP_INCLUDED */
@@ -0,0 +1,392 @@
+#ifndef LOOKUP_ROUTE_CPP_INCLUDED
+#define LOOKUP_ROUTE_CPP_INCLUDED
+
+// lookup_route
+// Author: Jordan Chandler
+
+// Spreads the requests for one service over several replicas of its server,
+// each behind its own concurrency gate.
+//
+// Every replica admits at most its own max_requests requests at a time, so a
+// replica with a lower server limit is never sent more than it accepts while
+// the others take the rest.  A request is sent to a replica with a free unit
+// of its gate, chosen by the balance policy:
+//   two_choices        - the less loaded of two healthy replicas picked at
+//                        random, which avoids the herd a strict least-loaded
+//                        choice sends to one replica from stale counts
+//   least_outstanding  - the healthy replica with the smallest share of its
+//                        gate in use
+//   consistent_hash    - the first healthy replica with room at or after the
+//                        id's point on a ring of virtual nodes, so an id keeps
+//                        going to the replica that cached it server-side and
+//                        only a departed replica's ids move
+// Load is weighed as requests outstanding over the replica's gate.
+//
+// A replica whose requests fail, time out, return 5xx or return 429
+// eject_after times in a row is ejected: no request is routed to it for
+// eject_for.  It is then readmitted on probation, and the first failure while
+// on probation ejects it again for twice as long, up to eight times eject_for;
+// a success ends the probation and the doubling.  When every replica is
+// ejected they are all treated as healthy, since some answers beat none.
+//
+// A request that fails without an answer is sent again to another healthy
+// replica, up to max_failovers times, rather than delivered as a failure
+// while other replicas could answer it.
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <string_view>
+#include <condition_variable>
+
+#include "lookup_flight.cpp"
+
+// One replica of the server
+struct lookup_replica_options
+{
+    std::string base_url;
+    unsigned long port = 8080;
+    std::string authorization_token;
+
+    // Requests the replica admits at a time
+    unsigned int max_requests = 5;
+};
+
+enum class lookup_balance
+{
+    two_choices,
+    least_outstanding,
+    consistent_hash
+};
+
+struct lookup_route_options
+{
+    lookup_balance balance = lookup_balance::two_choices;
+
+    // Consecutive failures or 429 responses that eject a replica; 0 never ejects
+    unsigned int eject_after = 5;
+
+    // Time an ejected replica receives no requests, doubled for each ejection
+    // on probation
+    std::chrono::milliseconds eject_for = std::chrono::seconds(5);
+
+    // Points each replica has on the consistent hash ring
+    unsigned int virtual_nodes = 100;
+
+    // Other replicas a request that failed without an answer is sent to
+    // before its failure is delivered
+    unsigned int max_failovers = 2;
+};
+
+// How a request routed to a replica ended, for the replica's health
+enum class lookup_replica_outcome
+{
+    // Answered, with any status but 429 or 5xx
+    succeeded,
+    // No answer, or a 5xx status
+    failed,
+    // Answered with status 429
+    rate_limited,
+    // Aborted or dropped by the client; says nothing about the replica
+    abandoned
+};
+
+// Snapshot of one replica's counters
+struct lookup_replica_stats
+{
+    std::string base_url;
+    unsigned long port = 0;
+    unsigned int max_requests = 0;
+
+    // Requests routed to the replica, and how many of them failed or returned 429
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t rate_limited = 0;
+
+    // Times the replica was ejected
+    uint64_t ejections = 0;
+
+    // Requests outstanding now, and whether the replica is ejected now
+    unsigned int outstanding = 0;
+    bool ejected = false;
+};
+
+class lookup_router
+{
+public:
+    lookup_router(const std::vector<lookup_replica_options> &replica_options, const lookup_route_options &options)
+        : options(options)
+    {
+        for (const auto &replica_option : replica_options)
+        {
+            replica r;
+            r.endpoint = std::make_shared<const lookup_endpoint>(
+                replica_option.base_url, replica_option.port, replica_option.authorization_token);
+            r.limit = std::max(1u, replica_option.max_requests);
+            replicas.push_back(std::move(r));
+        }
+        if (options.balance == lookup_balance::consistent_hash)
+        {
+            for (size_t i = 0; i < replicas.size(); i++)
+            {
+                const lookup_endpoint &endpoint = *replicas[i].endpoint;
+                for (unsigned int node = 0; node < std::max(1u, options.virtual_nodes); node++)
+                {
+                    std::string point = endpoint.base_url + ":" + std::to_string(endpoint.port) + "#" + std::to_string(node);
+                    ring.emplace_back(std::hash<std::string>{}(point), i);
+                }
+            }
+            std::sort(ring.begin(), ring.end());
+        }
+    }
+
+    lookup_router(const lookup_router &) = delete;
+    lookup_router &operator=(const lookup_router &) = delete;
+
+    // Sum of every replica's gate
+    unsigned int capacity() const
+    {
+        unsigned int total = 0;
+        for (const auto &r : replicas)
+        {
+            total += r.limit;
+        }
+        return total;
+    }
+
+    // Take a unit of the gate of the replica id should be sent to, other than
+    // exclude.  Returns the replica, or -1 if every eligible replica is full.
+    int acquire(std::string_view id, int exclude = -1)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        auto now = std::chrono::steady_clock::now();
+        bool any_healthy = false;
+        for (auto &r : replicas)
+        {
+            if (r.ejected && now >= r.ejected_until)
+            {
+                r.ejected = false;
+                r.probation = true;
+            }
+            any_healthy = any_healthy || !r.ejected;
+        }
+
+        int chosen = -1;
+        if (options.balance == lookup_balance::consistent_hash)
+        {
+            size_t point = std::hash<std::string_view>{}(id);
+            auto start = std::lower_bound(ring.begin(), ring.end(), std::make_pair(point, (size_t)0));
+            size_t first = (size_t)(start - ring.begin());
+            for (size_t step = 0; step < ring.size() && chosen < 0; step++)
+            {
+                size_t i = ring[(first + step) % ring.size()].second;
+                if (eligible(i, exclude, any_healthy))
+                {
+                    chosen = (int)i;
+                }
+            }
+        }
+        else
+        {
+            candidates.clear();
+            for (size_t i = 0; i < replicas.size(); i++)
+            {
+                if (eligible(i, exclude, any_healthy))
+                {
+                    candidates.push_back(i);
+                }
+            }
+            if (candidates.size() == 1)
+            {
+                chosen = (int)candidates[0];
+            }
+            else if (options.balance == lookup_balance::two_choices && !candidates.empty())
+            {
+                std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+                size_t a = pick(generator);
+                size_t b = pick(generator);
+                while (b == a)
+                {
+                    b = pick(generator);
+                }
+                chosen = (int)(lighter(candidates[a], candidates[b]) ? candidates[a] : candidates[b]);
+            }
+            else if (!candidates.empty())
+            {
+                size_t best = candidates[0];
+                for (size_t i : candidates)
+                {
+                    if (lighter(i, best))
+                    {
+                        best = i;
+                    }
+                }
+                chosen = (int)best;
+            }
+        }
+
+        if (chosen >= 0)
+        {
+            replicas[chosen].outstanding++;
+            replicas[chosen].requests++;
+        }
+        return chosen;
+    }
+
+    // Whether a replica other than exclude is healthy, so a request that
+    // failed at exclude can be sent there instead
+    bool alternative(int exclude)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        auto now = std::chrono::steady_clock::now();
+        bool any_healthy = false;
+        bool any_other = false;
+        for (size_t i = 0; i < replicas.size(); i++)
+        {
+            bool healthy = !replicas[i].ejected || now >= replicas[i].ejected_until;
+            if ((int)i != exclude)
+            {
+                if (healthy)
+                {
+                    return true;
+                }
+                any_other = true;
+            }
+            any_healthy = any_healthy || healthy;
+        }
+        return any_other && !any_healthy;
+    }
+
+    // Server of a replica
+    const lookup_endpoint &endpoint(int index) const
+    {
+        return *replicas[index].endpoint;
+    }
+
+    // Return the unit of a replica's gate taken by acquire() once its request
+    // has ended, updating the replica's health with how it ended
+    void release(int index, lookup_replica_outcome outcome)
+    {
+        {
+            std::lock_guard<std::mutex> lock(accessor);
+            replica &r = replicas[index];
+            r.outstanding--;
+            if (outcome == lookup_replica_outcome::succeeded)
+            {
+                r.consecutive_failures = 0;
+                if (r.probation)
+                {
+                    r.probation = false;
+                    r.penalty = 0;
+                }
+            }
+            else if (outcome != lookup_replica_outcome::abandoned)
+            {
+                (outcome == lookup_replica_outcome::rate_limited) ? r.rate_limited++ : r.failures++;
+                // Requests sent before an ejection say nothing new once it has begun
+                if (!r.ejected && options.eject_after &&
+                    (r.probation || ++r.consecutive_failures >= options.eject_after))
+                {
+                    r.ejected = true;
+                    r.ejected_until = std::chrono::steady_clock::now() + options.eject_for * (1 << r.penalty);
+                    r.penalty = std::min(r.penalty + 1, 3u);
+                    r.probation = false;
+                    r.consecutive_failures = 0;
+                    r.ejections++;
+                }
+            }
+        }
+        released.notify_all();
+    }
+
+    // Wait until a request routed by acquire() ends or an ejection may have
+    // ended, for callers whose acquire() found every eligible replica full
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(accessor);
+        auto until = std::chrono::steady_clock::now() + options.eject_for;
+        for (const auto &r : replicas)
+        {
+            if (r.ejected)
+            {
+                until = std::min(until, r.ejected_until);
+            }
+        }
+        released.wait_until(lock, until);
+    }
+
+    std::vector<lookup_replica_stats> stats()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        std::vector<lookup_replica_stats> snapshot;
+        auto now = std::chrono::steady_clock::now();
+        for (const auto &r : replicas)
+        {
+            lookup_replica_stats s;
+            s.base_url = r.endpoint->base_url;
+            s.port = r.endpoint->port;
+            s.max_requests = r.limit;
+            s.requests = r.requests;
+            s.failures = r.failures;
+            s.rate_limited = r.rate_limited;
+            s.ejections = r.ejections;
+            s.outstanding = r.outstanding;
+            s.ejected = r.ejected && now < r.ejected_until;
+            snapshot.push_back(s);
+        }
+        return snapshot;
+    }
+
+private:
+    struct replica
+    {
+        std::shared_ptr<const lookup_endpoint> endpoint;
+        unsigned int limit = 0;
+        unsigned int outstanding = 0;
+
+        // Health: failures in a row, and the current ejection
+        unsigned int consecutive_failures = 0;
+        bool ejected = false;
+        bool probation = false;
+        unsigned int penalty = 0;
+        std::chrono::steady_clock::time_point ejected_until;
+
+        uint64_t requests = 0;
+        uint64_t failures = 0;
+        uint64_t rate_limited = 0;
+        uint64_t ejections = 0;
+    };
+
+    // Whether replica i can take a request now.  Caller holds accessor.
+    bool eligible(size_t i, int exclude, bool any_healthy) const
+    {
+        const replica &r = replicas[i];
+        return (int)i != exclude && r.outstanding < r.limit && (!r.ejected || !any_healthy);
+    }
+
+    // Whether replica a has a smaller share of its gate in use than b.  Caller holds accessor.
+    bool lighter(size_t a, size_t b) const
+    {
+        return (uint64_t)replicas[a].outstanding * replicas[b].limit <
+               (uint64_t)replicas[b].outstanding * replicas[a].limit;
+    }
+
+    const lookup_route_options options;
+    std::vector<replica> replicas;
+
+    // Consistent hash ring of (point, replica), sorted by point
+    std::vector<std::pair<size_t, size_t>> ring;
+
+    // Protect the replicas' state, and the scratch space and generator of acquire()
+    std::mutex accessor;
+    std::condition_variable released;
+    std::vector<size_t> candidates;
+    std::mt19937 generator{std::random_device{}()};
+};
+
+#endif /* LOOKUP_ROUTE_CPP_INCLUDED */
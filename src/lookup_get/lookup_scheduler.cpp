@@ -0,0 +1,393 @@
+#ifndef LOOKUP_SCHEDULER_CPP_INCLUDED
+#define LOOKUP_SCHEDULER_CPP_INCLUDED
+
+// lookup_scheduler
+// Author: Jordan Chandler
+
+// Dispatch queue deciding which flight a worker requests next when a request
+// slot is free.
+//
+// Flights are kept in one heap per lookup_priority class, earliest deadline
+// first and in arrival order among equal deadlines, so ids without a deadline
+// are served first come first served within their class.  The most urgent
+// class with queued flights is normally served, but every class ages: a class
+// is treated as if it had started waiting one aging interval later for each
+// step it is below interactive, so a class that has not been served for longer
+// than that lead overtakes the more urgent ones and a steady stream of
+// interactive lookups cannot starve a batch job forever.
+//
+// The prefetch class is the exception.  It never ages and is served only when
+// no other class has a flight queued, so prefetches take nothing but request
+// slots that foreground work leaves idle.  A foreground id arriving while
+// every slot is busy with prefetches waits for the first of them to finish,
+// never for the prefetch queue.
+//
+// A flight whose latest deadline has passed is handed back as expired instead
+// of being dispatched, before it spends a request slot.  When a caller joins a
+// queued flight with a more urgent class, the flight is queued again in that
+// class and the stale entry is skipped when it surfaces.
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+
+#include "lookup_flight.cpp"
+
+struct lookup_scheduler_options
+{
+    // Head start a class has over the next less urgent one
+    std::chrono::milliseconds aging = std::chrono::milliseconds(500);
+};
+
+// Snapshot of a lookup_scheduler's counters
+struct lookup_scheduler_stats
+{
+    // Flights dispatched from each lookup_priority class
+    uint64_t dispatched[lookup_priority_count] = {};
+
+    // Dispatches of a class served ahead of a more urgent one because it had aged
+    uint64_t aged = 0;
+
+    // Flights dropped unrequested because their deadline had passed
+    uint64_t expired = 0;
+
+    // Flights completed after their deadline
+    uint64_t late = 0;
+
+    // Flights waiting for a worker
+    size_t queued = 0;
+};
+
+class lookup_scheduler
+{
+public:
+    lookup_scheduler(size_t capacity, const lookup_scheduler_options &options)
+        : capacity(capacity), options(options) {}
+
+    // Queue a new flight.  Returns false if the scheduler is full.
+    bool push(const std::shared_ptr<lookup_flight> &flight, const lookup_dispatch &dispatch)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        if (live >= capacity)
+        {
+            return false;
+        }
+        flight->priority = dispatch.priority;
+        flight->deadline = dispatch.deadline;
+        flight->queued = true;
+        live++;
+        enqueue(flight);
+        return true;
+    }
+
+    // Queue again a flight taken by pop() that could not be requested yet.  It
+    // keeps its class and deadline and goes ahead of flights with the same
+    // deadline, as it was taken before them.  Never refused for want of room.
+    void requeue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        dispatched[(size_t)flight->priority].fetch_sub(1, std::memory_order_relaxed);
+        flight->queued = true;
+        live++;
+        enqueue(flight, 0);
+    }
+
+    // Merge the needs of a caller joining an existing flight.  The flight keeps
+    // the latest deadline of its callers and moves up to the most urgent class.
+    // Returns true if the flight was queued again, adding an entry for a worker.
+    bool promote(const std::shared_ptr<lookup_flight> &flight, const lookup_dispatch &dispatch)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        flight->deadline = std::max(flight->deadline, dispatch.deadline);
+        if (!flight->queued || dispatch.priority >= flight->priority)
+        {
+            return false;
+        }
+        flight->priority = dispatch.priority;
+        enqueue(flight);
+        return true;
+    }
+
+    // Take the next flight to request.  expired is set if its deadline has passed
+    // and it must be completed without a request.  Returns false when nothing is queued.
+    bool pop(std::shared_ptr<lookup_flight> &flight, bool &expired)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        auto now = std::chrono::steady_clock::now();
+        while (true)
+        {
+            // The class with the earliest aged start, which is the most urgent
+            // non-empty class unless a less urgent one has waited long enough.
+            // Prefetches are only considered when nothing else is queued.
+            size_t chosen = lookup_priority_count;
+            size_t most_urgent = lookup_priority_count;
+            for (size_t c = 0; c < lookup_priority_count; c++)
+            {
+                if (heaps[c].empty())
+                {
+                    continue;
+                }
+                if (most_urgent == lookup_priority_count)
+                {
+                    most_urgent = c;
+                }
+                else if (c == (size_t)lookup_priority::prefetch)
+                {
+                    continue;
+                }
+                if (chosen == lookup_priority_count || aged_start(c) < aged_start(chosen))
+                {
+                    chosen = c;
+                }
+            }
+            if (chosen == lookup_priority_count)
+            {
+                return false;
+            }
+
+            std::vector<entry> &heap = heaps[chosen];
+            std::pop_heap(heap.begin(), heap.end(), later());
+            flight = std::move(heap.back().flight);
+            heap.pop_back();
+
+            // Skip entries of flights already taken or moved to a more urgent class
+            if (!flight->queued || (size_t)flight->priority != chosen)
+            {
+                flight.reset();
+                continue;
+            }
+            flight->queued = false;
+            live--;
+            waiting_since[chosen] = now;
+
+            expired = (flight->deadline <= now);
+            if (expired)
+            {
+                expired_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                dispatched[chosen].fetch_add(1, std::memory_order_relaxed);
+                if (chosen != most_urgent)
+                {
+                    aged.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            return true;
+        }
+    }
+
+    // Check whether every caller of a flight has passed its deadline
+    bool overdue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return flight->deadline <= std::chrono::steady_clock::now();
+    }
+
+    // Count a flight that was dropped after it was dispatched because its deadline passed
+    void record_expired()
+    {
+        expired_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Count a flight completed after its deadline
+    void record_late()
+    {
+        late.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Flights waiting for a worker
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return live;
+    }
+
+    lookup_scheduler_stats stats()
+    {
+        lookup_scheduler_stats snapshot;
+        for (size_t c = 0; c < lookup_priority_count; c++)
+        {
+            snapshot.dispatched[c] = dispatched[c].load(std::memory_order_relaxed);
+        }
+        snapshot.aged = aged.load(std::memory_order_relaxed);
+        snapshot.expired = expired_count.load(std::memory_order_relaxed);
+        snapshot.late = late.load(std::memory_order_relaxed);
+        snapshot.queued = size();
+        return snapshot;
+    }
+
+private:
+    struct entry
+    {
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t sequence;
+        std::shared_ptr<lookup_flight> flight;
+    };
+
+    // Orders each heap earliest deadline first, then first queued first
+    struct later
+    {
+        bool operator()(const entry &a, const entry &b) const
+        {
+            return (a.deadline != b.deadline) ? (a.deadline > b.deadline) : (a.sequence > b.sequence);
+        }
+    };
+
+    // Add an entry for the flight in its current class.  Caller holds accessor.
+    void enqueue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        enqueue(flight, sequence++);
+    }
+
+    // Add an entry ordered by order among the entries with the same deadline
+    void enqueue(const std::shared_ptr<lookup_flight> &flight, uint64_t order)
+    {
+        size_t c = (size_t)flight->priority;
+        if (heaps[c].empty())
+        {
+            waiting_since[c] = std::chrono::steady_clock::now();
+        }
+        heaps[c].push_back(entry{flight->deadline, order, flight});
+        std::push_heap(heaps[c].begin(), heaps[c].end(), later());
+    }
+
+    // When class c started waiting, handicapped by one aging interval per step below interactive
+    std::chrono::steady_clock::time_point aged_start(size_t c)
+    {
+        return waiting_since[c] + options.aging * (long long)c;
+    }
+
+    const size_t capacity;
+    const lookup_scheduler_options options;
+
+    // Protect the heaps and the scheduling state of queued flights
+    std::mutex accessor;
+    std::vector<entry> heaps[lookup_priority_count];
+    std::chrono::steady_clock::time_point waiting_since[lookup_priority_count];
+    uint64_t sequence = 0;
+    size_t live = 0;
+
+    std::atomic<uint64_t> dispatched[lookup_priority_count] = {};
+    std::atomic<uint64_t> aged{0};
+    std::atomic<uint64_t> expired_count{0};
+    std::atomic<uint64_t> late{0};
+};
+
+// Queue policy of basic_lookup_get serving flights strictly in arrival order,
+// for callers that use a single class and need no aging.  There is one queue
+// for every class, so prefetches are not held back for foreground work.
+// Deadlines still apply: a flight whose deadline has passed is handed back as
+// expired, and a caller joining a queued flight extends its deadline.
+class lookup_fifo_scheduler
+{
+public:
+    lookup_fifo_scheduler(size_t capacity, const lookup_scheduler_options &)
+        : capacity(capacity) {}
+
+    bool push(const std::shared_ptr<lookup_flight> &flight, const lookup_dispatch &dispatch)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        if (queue.size() >= capacity)
+        {
+            return false;
+        }
+        flight->priority = dispatch.priority;
+        flight->deadline = dispatch.deadline;
+        flight->queued = true;
+        queue.push_back(flight);
+        return true;
+    }
+
+    // Put a flight taken by pop() back at the front.  Never refused for want of room.
+    void requeue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        dispatched[(size_t)flight->priority].fetch_sub(1, std::memory_order_relaxed);
+        flight->queued = true;
+        queue.push_front(flight);
+    }
+
+    // Keep the latest deadline of the flight's callers.  Never queues the flight again.
+    bool promote(const std::shared_ptr<lookup_flight> &flight, const lookup_dispatch &dispatch)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        flight->deadline = std::max(flight->deadline, dispatch.deadline);
+        return false;
+    }
+
+    bool pop(std::shared_ptr<lookup_flight> &flight, bool &expired)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        if (queue.empty())
+        {
+            return false;
+        }
+        flight = std::move(queue.front());
+        queue.pop_front();
+        flight->queued = false;
+
+        expired = (flight->deadline <= std::chrono::steady_clock::now());
+        if (expired)
+        {
+            expired_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            dispatched[(size_t)flight->priority].fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool overdue(const std::shared_ptr<lookup_flight> &flight)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return flight->deadline <= std::chrono::steady_clock::now();
+    }
+
+    void record_expired()
+    {
+        expired_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record_late()
+    {
+        late.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return queue.size();
+    }
+
+    lookup_scheduler_stats stats()
+    {
+        lookup_scheduler_stats snapshot;
+        for (size_t c = 0; c < lookup_priority_count; c++)
+        {
+            snapshot.dispatched[c] = dispatched[c].load(std::memory_order_relaxed);
+        }
+        snapshot.expired = expired_count.load(std::memory_order_relaxed);
+        snapshot.late = late.load(std::memory_order_relaxed);
+        snapshot.queued = size();
+        return snapshot;
+    }
+
+private:
+    const size_t capacity;
+
+    // Protect the queue and the scheduling state of queued flights
+    std::mutex accessor;
+    std::deque<std::shared_ptr<lookup_flight>> queue;
+
+    std::atomic<uint64_t> dispatched[lookup_priority_count] = {};
+    std::atomic<uint64_t> expired_count{0};
+    std::atomic<uint64_t> late{0};
+};
+
+#endif /* LOOKUP_SCHEDULER_CPP_INCLUDED */
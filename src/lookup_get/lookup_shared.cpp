@@ -0,0 +1,562 @@
+#ifndef LOOKUP_SHARED_CPP_INCLUDED
+#define LOOKUP_SHARED_CPP_INCLUDED
+
+// lookup_shared
+// Author: Jordan Chandler
+
+// Optional host-wide request gate and result cache shared by every process
+// that opens the same named POSIX shared memory segment.
+//
+// The gate is a counting semaphore built from a robust, process-shared mutex
+// guarding a table of slot holders, and a futex word counting releases that
+// waiters sleep on.  A futex rather than a process-shared condition variable,
+// whose internal state is left inconsistent by a waiter that is killed.  Each holder
+// records the pid and start time of the process holding the slot, so slots
+// held by a process that died without releasing them are reclaimed by a
+// process that finds the gate full, and a mutex left locked by a dead process
+// is recovered through EOWNERDEAD.  A dead holder's request may still be
+// running on the server, so its slot is only reclaimed reclaim_after the death
+// was first noticed.
+//
+// The cache is a fixed-size open-addressing hash table of fixed-size entries.
+// Writers are serialized by a second robust mutex; readers take no lock and
+// use a per-entry sequence number to detect, and retry, entries being
+// rewritten.  An entry left half written by a crashed writer reads as a miss
+// until it is overwritten.  Results whose id or payload do not fit an entry
+// are not shared.
+//
+// The first process to create the segment sizes and initializes it; later
+// processes use the geometry stored in the segment, whatever their options.
+
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Name and geometry of a lookup_shared segment
+struct lookup_shared_options
+{
+    // POSIX shared memory name, such as "/lookup_get".  Empty disables sharing.
+    std::string name;
+
+    // Requests allowed at once across every process using the segment (at most 256)
+    unsigned int slots = 5;
+
+    // Cache entries, rounded up to a power of two
+    size_t cache_entries = 16 * 1024;
+
+    // Longest id and payload a cache entry holds
+    size_t max_id = 64;
+    size_t max_payload = 1024;
+
+    // Time a request may still occupy the server after the process that sent it died
+    std::chrono::milliseconds reclaim_after = std::chrono::seconds(2);
+};
+
+// Snapshot of a lookup_shared segment's counters, summed over every process
+struct lookup_shared_stats
+{
+    uint64_t acquisitions = 0;
+    uint64_t reclaimed = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    unsigned int slots = 0;
+    unsigned int held = 0;
+};
+
+class lookup_shared
+{
+public:
+    lookup_shared(const lookup_shared_options &options)
+        : options(options) {}
+
+    ~lookup_shared()
+    {
+        if (header)
+        {
+            munmap(header, mapped_bytes);
+        }
+    }
+
+    lookup_shared(const lookup_shared &) = delete;
+    lookup_shared &operator=(const lookup_shared &) = delete;
+
+    // Create or attach to the segment.  Returns false if it cannot be mapped.
+    bool open()
+    {
+        int fd = shm_open(options.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        bool creator = (fd >= 0);
+        if (!creator && errno == EEXIST)
+        {
+            fd = shm_open(options.name.c_str(), O_RDWR, 0666);
+        }
+        if (fd < 0)
+        {
+            std::cerr << "lookup_shared: cannot open " << options.name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        bool ok = creator ? create(fd) : attach(fd);
+        ::close(fd);
+        return ok;
+    }
+
+    // Take a slot, waiting for one to be released or reclaimed.  Returns the slot's number.
+    int acquire()
+    {
+        while (true)
+        {
+            lock(&header->gate_lock);
+            uint32_t released = header->released.load(std::memory_order_acquire);
+            int slot = take_slot();
+            pthread_mutex_unlock(&header->gate_lock);
+            if (slot >= 0)
+            {
+                return slot;
+            }
+
+            // Sleep until a slot is released after the one just seen, waking
+            // periodically to look for slots held by processes that have died
+            timespec timeout = {0, 50 * 1000 * 1000};
+            syscall(SYS_futex, (uint32_t *)&header->released, FUTEX_WAIT, released, &timeout, nullptr, 0);
+        }
+    }
+
+    // Take a slot only if one is free now
+    bool try_acquire(int &slot)
+    {
+        lock(&header->gate_lock);
+        slot = take_slot();
+        pthread_mutex_unlock(&header->gate_lock);
+        return slot >= 0;
+    }
+
+    void release(int slot)
+    {
+        lock(&header->gate_lock);
+        holders()[slot].pid = 0;
+        header->released.fetch_add(1, std::memory_order_release);
+        pthread_mutex_unlock(&header->gate_lock);
+        syscall(SYS_futex, (uint32_t *)&header->released, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    // Find a live result for id shared by any process.
+    // timestamp_ns is the result's wall clock timestamp; remaining is its remaining lifetime.
+    bool find(const std::string &id, long &status, std::string &payload, int64_t &timestamp_ns, std::chrono::milliseconds &remaining)
+    {
+        if (id.size() > header->max_id)
+        {
+            return false;
+        }
+        uint64_t hash = hash_id(id);
+        int64_t now = wall_clock_ms();
+        for (uint64_t probe = 0; probe < probe_limit; probe++)
+        {
+            entry &e = entry_at((hash + probe) & header->mask);
+            for (int attempt = 0; attempt < 4; attempt++)
+            {
+                uint32_t before = e.version.load(std::memory_order_acquire);
+                if (before & 1)
+                {
+                    // Being written
+                    continue;
+                }
+                if (e.hash != hash || e.id_size != id.size() || memcmp(e.text, id.data(), id.size()) != 0)
+                {
+                    break;
+                }
+                int64_t expires = e.expires_ms;
+                long entry_status = e.status;
+                int64_t entry_timestamp = e.timestamp_ns;
+                uint32_t payload_size = std::min<uint32_t>(e.payload_size, header->max_payload);
+                payload.assign(e.text + header->max_id, payload_size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (e.version.load(std::memory_order_relaxed) != before)
+                {
+                    continue;
+                }
+                if (expires <= now)
+                {
+                    break;
+                }
+                status = entry_status;
+                timestamp_ns = entry_timestamp;
+                remaining = std::chrono::milliseconds(expires - now);
+                header->hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        header->misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Share a result with every process.  Results too large for an entry are skipped.
+    void insert(const std::string &id, long status, const std::string &payload, int64_t timestamp_ns, std::chrono::milliseconds ttl)
+    {
+        if (status == 0 || status == 429 || id.size() > header->max_id || payload.size() > header->max_payload)
+        {
+            return;
+        }
+        uint64_t hash = hash_id(id);
+        int64_t now = wall_clock_ms();
+
+        lock(&header->cache_lock);
+
+        // Reuse the id's entry, or an empty or expired one, or else the one expiring first
+        entry *target = nullptr;
+        for (uint64_t probe = 0; probe < probe_limit; probe++)
+        {
+            entry &e = entry_at((hash + probe) & header->mask);
+            if (e.hash == hash && e.id_size == id.size() && memcmp(e.text, id.data(), id.size()) == 0)
+            {
+                target = &e;
+                break;
+            }
+            if (e.id_size == 0 || e.expires_ms <= now)
+            {
+                target = target ? target : &e;
+            }
+            else if (!target || (target->id_size != 0 && target->expires_ms > now && e.expires_ms < target->expires_ms))
+            {
+                target = &e;
+            }
+        }
+
+        // An odd version was left by a writer that died mid-write
+        uint32_t version = target->version.load(std::memory_order_relaxed);
+        version += (version & 1) ? 1 : 0;
+        target->version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        target->hash = hash;
+        target->expires_ms = now + ttl.count();
+        target->timestamp_ns = timestamp_ns;
+        target->status = status;
+        target->id_size = id.size();
+        target->payload_size = payload.size();
+        memcpy(target->text, id.data(), id.size());
+        memcpy(target->text + header->max_id, payload.data(), payload.size());
+        target->version.store(version + 2, std::memory_order_release);
+
+        pthread_mutex_unlock(&header->cache_lock);
+        header->insertions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    lookup_shared_stats stats()
+    {
+        lookup_shared_stats snapshot;
+        snapshot.acquisitions = header->acquisitions.load(std::memory_order_relaxed);
+        snapshot.reclaimed = header->reclaimed.load(std::memory_order_relaxed);
+        snapshot.hits = header->hits.load(std::memory_order_relaxed);
+        snapshot.misses = header->misses.load(std::memory_order_relaxed);
+        snapshot.insertions = header->insertions.load(std::memory_order_relaxed);
+        snapshot.slots = header->slots;
+        lock(&header->gate_lock);
+        for (unsigned int i = 0; i < header->slots; i++)
+        {
+            snapshot.held += (holders()[i].pid != 0);
+        }
+        pthread_mutex_unlock(&header->gate_lock);
+        return snapshot;
+    }
+
+    // Remove the named segment.  Processes already attached keep using it.
+    static void unlink(const std::string &name)
+    {
+        shm_unlink(name.c_str());
+    }
+
+private:
+    static constexpr uint32_t segment_magic = 0x4C4B5348;
+    static constexpr unsigned int max_slots = 256;
+    static constexpr uint64_t probe_limit = 8;
+
+    struct holder
+    {
+        // 0 when the slot is free
+        pid_t pid;
+        // Start time of the holding process, telling it apart from a later process reusing its pid
+        uint64_t start_time;
+        // Monotonic time the holder was first found dead, or 0
+        int64_t dead_since_ms;
+    };
+
+    struct segment_header
+    {
+        // Set to segment_magic once the creator has initialized the segment
+        std::atomic<uint32_t> ready;
+        uint32_t slots;
+        int64_t reclaim_after_ms;
+        uint64_t mask;
+        uint64_t max_id;
+        uint64_t max_payload;
+        uint64_t entry_bytes;
+        pthread_mutex_t gate_lock;
+        // Incremented by every release; the futex waiters for a slot sleep on
+        std::atomic<uint32_t> released;
+        pthread_mutex_t cache_lock;
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> reclaimed;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> insertions;
+        holder holders[max_slots];
+    };
+
+    struct entry
+    {
+        // Even when stable, odd while being written
+        std::atomic<uint32_t> version;
+        uint32_t id_size;
+        uint64_t hash;
+        int64_t expires_ms;
+        int64_t timestamp_ns;
+        int32_t status;
+        uint32_t payload_size;
+        // max_id bytes of id followed by max_payload bytes of payload
+        char text[1];
+    };
+
+    static uint64_t hash_id(const std::string &id)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : id)
+        {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static int64_t wall_clock_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Start time of a process in clock ticks since boot, and its state letter.
+    // Returns 0 if they cannot be read.
+    static uint64_t start_time(pid_t pid, char *state = nullptr)
+    {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string text((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+        // Fields after the parenthesized command name; state is field 3, starttime field 22
+        size_t position = text.rfind(')');
+        if (position == std::string::npos || position + 2 >= text.size())
+        {
+            return 0;
+        }
+        const char *field = text.c_str() + position + 2;
+        if (state)
+        {
+            *state = *field;
+        }
+        for (int i = 3; i < 22 && field; i++)
+        {
+            field = strchr(field, ' ');
+            field = field ? field + 1 : nullptr;
+        }
+        return field ? strtoull(field, nullptr, 10) : 0;
+    }
+
+    // A holder is dead once its process is gone, has exited but not been
+    // reaped by its parent, or its pid belongs to a newer process
+    static bool alive(const holder &h)
+    {
+        if (kill(h.pid, 0) != 0 && errno == ESRCH)
+        {
+            return false;
+        }
+        char state = 0;
+        uint64_t started = start_time(h.pid, &state);
+        if (state == 'Z' || state == 'X')
+        {
+            return false;
+        }
+        return started == 0 || started == h.start_time;
+    }
+
+    static void lock(pthread_mutex_t *mutex)
+    {
+        if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+        {
+            // The holder died; the state it guards is updated one field at a time and stays usable
+            pthread_mutex_consistent(mutex);
+        }
+    }
+
+    holder *holders()
+    {
+        return header->holders;
+    }
+
+    entry &entry_at(uint64_t index)
+    {
+        return *(entry *)((char *)(header + 1) + index * header->entry_bytes);
+    }
+
+    // Claim a free slot, reclaiming those of dead processes if none is free.
+    // Caller holds gate_lock.  Returns -1 if every slot is held by a live process.
+    int take_slot()
+    {
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (unsigned int i = 0; i < header->slots; i++)
+            {
+                holder &h = holders()[i];
+                if (h.pid == 0)
+                {
+                    h.pid = getpid();
+                    h.start_time = self_start_time();
+                    h.dead_since_ms = 0;
+                    header->acquisitions.fetch_add(1, std::memory_order_relaxed);
+                    return i;
+                }
+            }
+            if (pass == 0 && reclaim() == 0)
+            {
+                break;
+            }
+        }
+        return -1;
+    }
+
+    // Free slots whose holders died at least reclaim_after ago.  Caller holds gate_lock.
+    unsigned int reclaim()
+    {
+        timespec now_time;
+        clock_gettime(CLOCK_MONOTONIC, &now_time);
+        int64_t now = (int64_t)now_time.tv_sec * 1000 + now_time.tv_nsec / (1000 * 1000);
+
+        unsigned int freed = 0;
+        for (unsigned int i = 0; i < header->slots; i++)
+        {
+            holder &h = holders()[i];
+            if (h.pid == 0 || (h.dead_since_ms == 0 && alive(h)))
+            {
+                continue;
+            }
+            if (h.dead_since_ms == 0)
+            {
+                h.dead_since_ms = std::max<int64_t>(now, 1);
+            }
+            if (now - h.dead_since_ms >= header->reclaim_after_ms)
+            {
+                h.pid = 0;
+                freed++;
+            }
+        }
+        header->reclaimed.fetch_add(freed, std::memory_order_relaxed);
+        return freed;
+    }
+
+    // This process's start time, read again after a fork
+    uint64_t self_start_time()
+    {
+        pid_t pid = getpid();
+        if (pid != self_pid)
+        {
+            self_pid = pid;
+            self_started = start_time(pid);
+        }
+        return self_started;
+    }
+
+    static size_t entry_bytes(size_t max_id, size_t max_payload)
+    {
+        return (offsetof(entry, text) + max_id + max_payload + 7) & ~(size_t)7;
+    }
+
+    bool map(int fd, size_t bytes)
+    {
+        void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        header = (segment_header *)mapping;
+        mapped_bytes = bytes;
+        return true;
+    }
+
+    bool create(int fd)
+    {
+        uint64_t entries = 2;
+        while (entries < options.cache_entries)
+        {
+            entries <<= 1;
+        }
+        size_t bytes_per_entry = entry_bytes(options.max_id, options.max_payload);
+        size_t bytes = sizeof(segment_header) + entries * bytes_per_entry;
+        if (ftruncate(fd, bytes) != 0 || !map(fd, bytes))
+        {
+            shm_unlink(options.name.c_str());
+            return false;
+        }
+
+        header->slots = std::min(std::max(options.slots, 1u), max_slots);
+        header->reclaim_after_ms = options.reclaim_after.count();
+        header->mask = entries - 1;
+        header->max_id = options.max_id;
+        header->max_payload = options.max_payload;
+        header->entry_bytes = bytes_per_entry;
+
+        pthread_mutexattr_t mutex_attributes;
+        pthread_mutexattr_init(&mutex_attributes);
+        pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->gate_lock, &mutex_attributes);
+        pthread_mutex_init(&header->cache_lock, &mutex_attributes);
+        pthread_mutexattr_destroy(&mutex_attributes);
+
+        // The rest of the segment is zero filled by ftruncate
+        header->ready.store(segment_magic, std::memory_order_release);
+        return true;
+    }
+
+    bool attach(int fd)
+    {
+        // Wait for the creator to size and initialize the segment
+        for (int attempt = 0; attempt < 200; attempt++)
+        {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(segment_header))
+            {
+                if (!header && !map(fd, st.st_size))
+                {
+                    return false;
+                }
+                if (header->ready.load(std::memory_order_acquire) == segment_magic)
+                {
+                    return true;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        std::cerr << "lookup_shared: " << options.name << " was never initialized; remove it with shm_unlink" << std::endl;
+        return false;
+    }
+
+    lookup_shared_options options;
+    segment_header *header = nullptr;
+    size_t mapped_bytes = 0;
+
+    pid_t self_pid = 0;
+    uint64_t self_started = 0;
+};
+
+#endif /* LOOKUP_SHARED_CPP_INCLUDED */
@@ -0,0 +1,134 @@
+#ifndef LOOKUP_STOP_CPP_INCLUDED
+#define LOOKUP_STOP_CPP_INCLUDED
+
+// lookup_stop
+// Author: Jordan Chandler
+
+// Cooperative cancellation for lookup_get calls, modelled on C++20's
+// std::stop_source, std::stop_token and std::stop_callback, which are not
+// available to the C++17 code base.
+//
+// A caller hands a lookup_stop_token from its lookup_stop_source to
+// request_results() and may call request_stop() from any thread.  The call
+// then returns with the results delivered so far, and requests nobody else
+// is waiting for are dropped, or aborted if they are already running.
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <functional>
+
+class lookup_stop_token
+{
+public:
+    // A token that can never be stopped
+    lookup_stop_token() = default;
+
+    bool stop_requested() const
+    {
+        return state && state->stopped.load(std::memory_order_acquire);
+    }
+
+    // False for a default constructed token
+    bool stop_possible() const
+    {
+        return state != nullptr;
+    }
+
+private:
+    friend class lookup_stop_source;
+    friend class lookup_stop_callback;
+
+    struct shared_state
+    {
+        std::atomic<bool> stopped{false};
+
+        // Guards callbacks, and is held while they run
+        std::mutex accessor;
+        std::list<std::function<void()>> callbacks;
+    };
+
+    lookup_stop_token(std::shared_ptr<shared_state> state)
+        : state(std::move(state)) {}
+
+    std::shared_ptr<shared_state> state;
+};
+
+class lookup_stop_source
+{
+public:
+    lookup_stop_source()
+        : state(std::make_shared<lookup_stop_token::shared_state>()) {}
+
+    lookup_stop_token get_token() const
+    {
+        return lookup_stop_token(state);
+    }
+
+    // Ask every call holding a token of this source to stop.
+    // Returns false if a stop was already requested.
+    bool request_stop()
+    {
+        std::lock_guard<std::mutex> lock(state->accessor);
+        if (state->stopped.exchange(true, std::memory_order_acq_rel))
+        {
+            return false;
+        }
+        for (auto &callback : state->callbacks)
+        {
+            callback();
+        }
+        return true;
+    }
+
+    bool stop_requested() const
+    {
+        return state->stopped.load(std::memory_order_acquire);
+    }
+
+private:
+    std::shared_ptr<lookup_stop_token::shared_state> state;
+};
+
+// Runs callback once when a stop is requested, or at once if one already was.
+// Once the destructor returns the callback is not running and will not run.
+class lookup_stop_callback
+{
+public:
+    lookup_stop_callback(const lookup_stop_token &token, std::function<void()> callback)
+        : state(token.state)
+    {
+        if (!state)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(state->accessor);
+        if (state->stopped.load(std::memory_order_acquire))
+        {
+            lock.unlock();
+            callback();
+            state.reset();
+            return;
+        }
+        registration = state->callbacks.insert(state->callbacks.end(), std::move(callback));
+    }
+
+    ~lookup_stop_callback()
+    {
+        if (state)
+        {
+            std::lock_guard<std::mutex> lock(state->accessor);
+            state->callbacks.erase(registration);
+        }
+    }
+
+    lookup_stop_callback(const lookup_stop_callback &) = delete;
+    lookup_stop_callback &operator=(const lookup_stop_callback &) = delete;
+
+private:
+    std::shared_ptr<lookup_stop_token::shared_state> state;
+    std::list<std::function<void()>>::iterator registration;
+};
+
+#endif /* LOOKUP_STOP_CPP_INCLUDED */
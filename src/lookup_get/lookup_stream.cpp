@@ -0,0 +1,228 @@
+#ifndef LOOKUP_STREAM_CPP_INCLUDED
+#define LOOKUP_STREAM_CPP_INCLUDED
+
+// lookup_stream
+// Author: Jordan Chandler
+
+// Input and output ends of a streaming job that looks up more ids than fit in
+// memory, for use with lookup_get::request_stream().
+//
+// lookup_id_reader pulls newline separated ids from a file descriptor in large
+// blocks, so a file or a pipe on stdin is read with a few system calls and no
+// per-line allocation beyond the id itself.  lookup_ndjson_writer collects
+// results from any number of worker threads as newline delimited JSON in a
+// block that is written out whenever it fills, while the other workers keep
+// appending to a fresh block.  Both hold one block at a time, however long the
+// input is.
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+
+#include "lookup_result.cpp"
+
+// Reads newline separated ids from a file descriptor.
+// Blank lines are skipped and a trailing carriage return is dropped.
+class lookup_id_reader
+{
+public:
+    lookup_id_reader(int fd, size_t block_size = 1024 * 1024)
+        : fd(fd), buffer(block_size) {}
+
+    // The next id, or false at the end of the input or on a read error
+    bool next(std::string &id)
+    {
+        while (true)
+        {
+            char *start = buffer.data() + begin;
+            char *newline = (char *)memchr(start, '\n', end - begin);
+            if (newline || (at_end && begin < end))
+            {
+                size_t length = newline ? newline - start : end - begin;
+                begin += newline ? length + 1 : length;
+                if (length && start[length - 1] == '\r')
+                {
+                    length--;
+                }
+                if (length == 0)
+                {
+                    continue;
+                }
+                id.assign(start, length);
+                ids++;
+                return true;
+            }
+            if (at_end)
+            {
+                return false;
+            }
+            fill();
+        }
+    }
+
+    // Bytes and ids read so far
+    uint64_t bytes_read() const
+    {
+        return bytes;
+    }
+
+    uint64_t ids_read() const
+    {
+        return ids;
+    }
+
+    // The input ended with a read error rather than at its end
+    bool failed() const
+    {
+        return error != 0;
+    }
+
+private:
+    // Move the unread partial line to the front and read behind it.
+    // The block only grows for a line longer than itself.
+    void fill()
+    {
+        if (begin > 0)
+        {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size())
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t count;
+        do
+        {
+            count = read(fd, buffer.data() + end, buffer.size() - end);
+        } while (count < 0 && errno == EINTR);
+        if (count <= 0)
+        {
+            error = (count < 0) ? errno : 0;
+            at_end = true;
+            return;
+        }
+        end += count;
+        bytes += count;
+    }
+
+    int fd;
+    std::vector<char> buffer;
+    // Unread bytes are buffer[begin, end)
+    size_t begin = 0;
+    size_t end = 0;
+    bool at_end = false;
+    int error = 0;
+    uint64_t bytes = 0;
+    uint64_t ids = 0;
+};
+
+// Writes results to a file descriptor as newline delimited JSON, one
+// envelope per line.  write() may be called from several threads at once.
+class lookup_ndjson_writer
+{
+public:
+    lookup_ndjson_writer(int fd, size_t block_size = 1024 * 1024)
+        : fd(fd), block_size(block_size)
+    {
+        block.reserve(block_size + block_size / 4);
+        flushing.reserve(block.capacity());
+    }
+
+    ~lookup_ndjson_writer()
+    {
+        flush();
+    }
+
+    lookup_ndjson_writer(const lookup_ndjson_writer &) = delete;
+    lookup_ndjson_writer &operator=(const lookup_ndjson_writer &) = delete;
+
+    void write(const lookup_result &result)
+    {
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(block_accessor);
+            result.append_json(block);
+            block.push_back('\n');
+            lines++;
+            full = block.size() >= block_size;
+        }
+        if (full)
+        {
+            flush();
+        }
+    }
+
+    // Write out everything collected so far.  Writers that find the block
+    // full wait here for the previous block to be written, which holds the
+    // workers, and so the requests, back to the speed of the output.
+    void flush()
+    {
+        std::lock_guard<std::mutex> output(output_accessor);
+        {
+            std::lock_guard<std::mutex> lock(block_accessor);
+            block.swap(flushing);
+        }
+        const char *data = flushing.data();
+        size_t remaining = flushing.size();
+        while (remaining && !error)
+        {
+            ssize_t count = ::write(fd, data, remaining);
+            if (count < 0)
+            {
+                if (errno != EINTR)
+                {
+                    error = errno;
+                }
+                continue;
+            }
+            data += count;
+            remaining -= count;
+            bytes += count;
+        }
+        flushing.clear();
+    }
+
+    // Lines collected and bytes written so far
+    uint64_t lines_written()
+    {
+        std::lock_guard<std::mutex> lock(block_accessor);
+        return lines;
+    }
+
+    uint64_t bytes_written()
+    {
+        std::lock_guard<std::mutex> output(output_accessor);
+        return bytes;
+    }
+
+    // A write failed, for example because the reader of a pipe exited.
+    // Later lines are discarded.
+    bool failed()
+    {
+        std::lock_guard<std::mutex> output(output_accessor);
+        return error != 0;
+    }
+
+private:
+    int fd;
+    size_t block_size;
+
+    // Lines being collected, guarded by block_accessor
+    std::mutex block_accessor;
+    std::string block;
+    uint64_t lines = 0;
+
+    // The block being written, guarded by output_accessor
+    std::mutex output_accessor;
+    std::string flushing;
+    uint64_t bytes = 0;
+    int error = 0;
+};
+
+#endif /* LOOKUP_STREAM_CPP_INCLUDED */
@@ -0,0 +1,82 @@
+#ifndef LOOKUP_TABLE_CPP_INCLUDED
+#define LOOKUP_TABLE_CPP_INCLUDED
+
+// lookup_table
+// Author: Jordan Chandler
+
+// Concurrent result table the map-returning request() collects responses into.
+//
+// Workers publish each delivered result under its id from any thread, and
+// the caller takes the whole table as an ordered map once the call is done.
+// Ids are spread over independently locked hash shards so workers publishing
+// different ids rarely contend, and each shard is padded to its own cache
+// line so neighbouring shard locks do not false share.
+
+#include <mutex>
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+
+class lookup_table
+{
+public:
+    // shard_count is rounded up to a power of two
+    lookup_table(size_t shard_count = 64)
+    {
+        size_t count = 1;
+        while (count < shard_count)
+        {
+            count <<= 1;
+        }
+        shards.reset(new shard[count]);
+        mask = count - 1;
+    }
+
+    // Publish the response for id, replacing any published before
+    void publish(const std::string &id, std::string response)
+    {
+        shard &s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.accessor);
+        s.entries[id] = std::move(response);
+    }
+
+    // Move every entry out of the table into an ordered map, leaving the table empty
+    std::map<std::string, std::string> take()
+    {
+        std::map<std::string, std::string> taken;
+        for (size_t i = 0; i <= mask; i++)
+        {
+            std::lock_guard<std::mutex> lock(shards[i].accessor);
+            auto &entries = shards[i].entries;
+            while (!entries.empty())
+            {
+                // Extract the node so the id is moved, not copied, into the map
+                auto node = entries.extract(entries.begin());
+                taken.emplace(std::move(node.key()), std::move(node.mapped()));
+            }
+        }
+        return taken;
+    }
+
+private:
+    struct alignas(64) shard
+    {
+        std::mutex accessor;
+        std::unordered_map<std::string, std::string> entries;
+    };
+
+    shard &shard_for(const std::string &id)
+    {
+        // Use the high bits so the shard choice is independent of the
+        // low bits the shard's own hash map buckets on.
+        size_t hash = std::hash<std::string>{}(id);
+        return shards[(hash >> 32 ^ hash >> 16) & mask];
+    }
+
+    std::unique_ptr<shard[]> shards;
+    size_t mask;
+};
+
+#endif /* LOOKUP_TABLE_CPP_INCLUDED */
@@ -0,0 +1,323 @@
+#ifndef LOOKUP_TRACE_CPP_INCLUDED
+#define LOOKUP_TRACE_CPP_INCLUDED
+
+// lookup_trace
+// Author: Jordan Chandler
+
+// Compact binary trace of the lookups a lookup_get instance serves, for
+// replaying a production workload against another build
+// (test/lookup_replay/lookup_replay.cpp).
+//
+// Every id a caller asks for, through request(), request_results(),
+// request_stream(), submit() or prefetch(), is recorded once its result is
+// delivered.  A record holds the id's hash rather than the id, when the
+// caller asked relative to the start of the trace, how long the id then waited
+// for a request slot and for its result, how long the server took, and the
+// status and payload size of the result.  Ids repeated within one call are
+// folded before they are traced, as they are before anything is requested.
+// Records are collected in blocks written out whenever one fills, as
+// lookup_ndjson_writer does, so a worker recording a lookup takes one lock and
+// copies 40 bytes.
+//
+// A trace file is a lookup_trace_header followed by lookup_trace_records in
+// the byte order of the host that wrote them, in order of delivery.
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lookup_result.cpp"
+
+// Where a lookup_get instance records its trace
+struct lookup_trace_options
+{
+    // File the trace is written to, replacing any earlier one.  Empty disables tracing.
+    std::string path;
+
+    // Records collected before they are written out
+    size_t block_records = 4096;
+};
+
+// How a traced lookup was answered
+enum class lookup_trace_source : uint8_t
+{
+    // The caller's request was sent to the server
+    requested,
+    // The caller joined a request another caller had outstanding
+    joined,
+    // The response cache, or a tier behind it, held the result
+    cached
+};
+
+struct lookup_trace_record
+{
+    // FNV-1a hash of the id
+    uint64_t id_hash;
+
+    // Nanoseconds from the start of the trace to the caller asking for the id
+    uint64_t submitted;
+
+    // Microseconds from the caller asking to a worker taking the request slot
+    // the id was answered on, or 0 if it was not requested after the caller asked
+    uint32_t slot_wait;
+
+    // Microseconds from the caller asking to the result being delivered
+    uint32_t completed;
+
+    // Microseconds the answered transfer took, 0 for cached results
+    uint32_t latency;
+
+    uint32_t payload_bytes;
+
+    // Number of the call that asked for the id, counted from 0 for each trace
+    uint32_t call;
+
+    // HTTP status, or 0 if no answer was received
+    uint16_t status;
+
+    // lookup_outcome of the result
+    uint8_t outcome;
+
+    // lookup_trace_source in the low two bits, lookup_priority in the next two
+    uint8_t flags;
+
+    lookup_trace_source source() const
+    {
+        return (lookup_trace_source)(flags & 3);
+    }
+
+    unsigned int priority() const
+    {
+        return (flags >> 2) & 3;
+    }
+};
+
+static_assert(sizeof(lookup_trace_record) == 40, "lookup_trace_record is written as is");
+
+struct lookup_trace_header
+{
+    char magic[8] = {'l', 'o', 'o', 'k', 'u', 'p', 't', 'r'};
+    uint32_t version = 1;
+    uint32_t record_size = sizeof(lookup_trace_record);
+};
+
+// Hash identifying an id in a trace
+inline uint64_t lookup_trace_hash(std::string_view id)
+{
+    // FNV-1a, 64 bit
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : id)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Collects trace records from any number of threads and writes them to a file
+class lookup_trace_writer
+{
+public:
+    lookup_trace_writer(const lookup_trace_options &options)
+        : options(options), started(std::chrono::steady_clock::now())
+    {
+        block.reserve(options.block_records);
+        flushing.reserve(options.block_records);
+    }
+
+    ~lookup_trace_writer()
+    {
+        if (fd >= 0)
+        {
+            flush();
+            close(fd);
+        }
+    }
+
+    lookup_trace_writer(const lookup_trace_writer &) = delete;
+    lookup_trace_writer &operator=(const lookup_trace_writer &) = delete;
+
+    // Create the file and write its header.  The trace's clock starts at construction.
+    bool open()
+    {
+        fd = ::open(options.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        lookup_trace_header header;
+        if (!write_all(&header, sizeof(header)))
+        {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Number a new call
+    uint32_t next_call()
+    {
+        std::lock_guard<std::mutex> lock(block_accessor);
+        return calls++;
+    }
+
+    // Record the delivery, now, of result to the caller that asked for its id at submitted
+    void record(const lookup_result &result, std::chrono::steady_clock::time_point submitted, uint32_t call,
+                unsigned int priority)
+    {
+        auto now = std::chrono::steady_clock::now();
+        lookup_trace_source source;
+        if (result.timestamp < submitted)
+        {
+            // Answered before the caller asked
+            source = lookup_trace_source::cached;
+        }
+        else
+        {
+            source = (result.created >= submitted) ? lookup_trace_source::requested : lookup_trace_source::joined;
+        }
+
+        lookup_trace_record record;
+        record.id_hash = lookup_trace_hash(result.id);
+        record.submitted = (uint64_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(submitted - started).count());
+        record.slot_wait = (source != lookup_trace_source::cached && result.dispatched > submitted)
+                               ? microseconds(result.dispatched - submitted)
+                               : 0;
+        record.completed = microseconds(now - submitted);
+        record.latency = (source == lookup_trace_source::cached) ? 0 : microseconds(result.timings.total);
+        record.payload_bytes = (uint32_t)std::min<size_t>(result.payload.size(), UINT32_MAX);
+        record.call = call;
+        record.status = (uint16_t)result.status;
+        record.outcome = (uint8_t)result.outcome;
+        record.flags = (uint8_t)((unsigned int)source | ((priority & 3) << 2));
+
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(block_accessor);
+            block.push_back(record);
+            full = block.size() >= options.block_records;
+        }
+        if (full)
+        {
+            flush();
+        }
+    }
+
+    // Write out everything collected so far
+    void flush()
+    {
+        std::lock_guard<std::mutex> output(output_accessor);
+        {
+            std::lock_guard<std::mutex> lock(block_accessor);
+            block.swap(flushing);
+        }
+        if (!flushing.empty() && !error)
+        {
+            write_all(flushing.data(), flushing.size() * sizeof(lookup_trace_record));
+        }
+        flushing.clear();
+    }
+
+    // A write failed.  Later records are discarded.
+    bool failed()
+    {
+        std::lock_guard<std::mutex> output(output_accessor);
+        return error != 0;
+    }
+
+private:
+    template <typename Duration>
+    static uint32_t microseconds(Duration duration)
+    {
+        int64_t count = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        return (uint32_t)std::min<int64_t>(std::max<int64_t>(count, 0), UINT32_MAX);
+    }
+
+    bool write_all(const void *data, size_t size)
+    {
+        const char *bytes = (const char *)data;
+        while (size)
+        {
+            ssize_t count = ::write(fd, bytes, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                error = errno;
+                return false;
+            }
+            bytes += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    const lookup_trace_options options;
+    const std::chrono::steady_clock::time_point started;
+    int fd = -1;
+
+    // Records being collected, guarded by block_accessor
+    std::mutex block_accessor;
+    std::vector<lookup_trace_record> block;
+    uint32_t calls = 0;
+
+    // The block being written, guarded by output_accessor
+    std::mutex output_accessor;
+    std::vector<lookup_trace_record> flushing;
+    int error = 0;
+};
+
+// Read every record of the trace at path.  Returns false if the file cannot
+// be read or is not a trace.  A record cut short by a crash is dropped.
+inline bool lookup_read_trace(const std::string &path, std::vector<lookup_trace_record> &records)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    std::vector<char> data;
+    char chunk[64 * 1024];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) != 0)
+    {
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        data.insert(data.end(), chunk, chunk + count);
+    }
+    close(fd);
+
+    lookup_trace_header expected, header;
+    if (data.size() < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+        header.record_size != expected.record_size)
+    {
+        return false;
+    }
+    size_t count_records = (data.size() - sizeof(header)) / sizeof(lookup_trace_record);
+    records.resize(count_records);
+    memcpy(records.data(), data.data() + sizeof(header), count_records * sizeof(lookup_trace_record));
+    return true;
+}
+
+#endif /* LOOKUP_TRACE_CPP_INCLUDED */
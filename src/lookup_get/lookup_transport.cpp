@@ -0,0 +1,290 @@
+#ifndef LOOKUP_TRANSPORT_CPP_INCLUDED
+#define LOOKUP_TRANSPORT_CPP_INCLUDED
+
+// lookup_transport
+// Author: Jordan Chandler
+
+// Transport policies of basic_lookup_get: what sends a request for an id and
+// reports how it ended.
+//
+// lookup_curl_transport sends real HTTP requests through pooled libcurl easy
+// handles and is the only transport the multi engine can drive.
+// lookup_fake_transport answers in process, after a configurable latency,
+// without touching the network, so the scheduling and caching paths can be
+// measured on their own and recorded server latencies can be played back.
+//
+// A transport provides a handle type and
+//   handle acquire()                 - a handle for one worker, or a null one
+//   void release(handle)
+//   void configure(handle, connect_timeout, request_timeout, flight, body)
+//                                    - flight is the worker's variable holding
+//                                      the flight it requests, and body the
+//                                      buffer the response body is appended
+//                                      to, or null to discard it
+//   void aim(handle, endpoint, id, url)
+//   CURLcode perform(handle)         - send the request and wait for it;
+//                                      CURLE_ABORTED_BY_CALLBACK once every
+//                                      caller of the flight has stopped waiting
+//   void read(handle, code, transfer)
+// and a static constexpr bool multiplexed telling whether the multi engine
+// can drive it.  Failures are reported as the CURLcode libcurl would give.
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <string_view>
+#include <curl/curl.h>
+
+#include "lookup_result.cpp"
+#include "lookup_flight.cpp"
+#include "lookup_pool.cpp"
+
+// What a transport reports about one finished request
+struct lookup_transfer
+{
+    CURLcode code = CURLE_OK;
+
+    // Status of the response, or 0 if none was received
+    long http_code = 0;
+
+    lookup_timings timings;
+
+    // Body bytes as they crossed the wire, before any content encoding was decoded
+    uint64_t received_bytes = 0;
+};
+
+// Requests sent with libcurl through a lookup_pool
+class lookup_curl_transport
+{
+public:
+    static constexpr bool multiplexed = true;
+    typedef CURL *handle;
+
+    lookup_curl_transport(const lookup_pool_options &options)
+        : pool(options) {}
+
+    CURL *acquire()
+    {
+        return pool.acquire();
+    }
+
+    void release(CURL *curl)
+    {
+        pool.release(curl);
+    }
+
+    void configure(CURL *curl, std::chrono::milliseconds connect_timeout, std::chrono::milliseconds request_timeout,
+                   std::shared_ptr<lookup_flight> *flight, std::string *body)
+    {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body ? write_callback : discard_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)body);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)connect_timeout.count());
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)request_timeout.count());
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)flight);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    }
+
+    // Point a handle at the URL for id on endpoint
+    static void aim(CURL *curl, const lookup_endpoint &endpoint, const std::string &id, std::string &url)
+    {
+        url.assign(endpoint.base_url).append(id);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_PORT, endpoint.port);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, endpoint.headers);
+    }
+
+    static CURLcode perform(CURL *curl)
+    {
+        return curl_easy_perform(curl);
+    }
+
+    static void read(CURL *curl, CURLcode code, lookup_transfer &transfer)
+    {
+        transfer.code = code;
+        transfer.http_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &transfer.http_code);
+
+        curl_off_t value;
+        std::pair<CURLINFO, std::chrono::microseconds *> phases[] = {
+            {CURLINFO_NAMELOOKUP_TIME_T, &transfer.timings.name_lookup},
+            {CURLINFO_CONNECT_TIME_T, &transfer.timings.connect},
+            {CURLINFO_APPCONNECT_TIME_T, &transfer.timings.tls_connect},
+            {CURLINFO_PRETRANSFER_TIME_T, &transfer.timings.pre_transfer},
+            {CURLINFO_STARTTRANSFER_TIME_T, &transfer.timings.first_byte},
+            {CURLINFO_TOTAL_TIME_T, &transfer.timings.total}};
+        for (auto &phase : phases)
+        {
+            value = 0;
+            curl_easy_getinfo(curl, phase.first, &value);
+            *phase.second = std::chrono::microseconds(value);
+        }
+
+        value = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &value);
+        transfer.received_bytes = (uint64_t)value;
+    }
+
+    // Handles and their shared caches.  The multiplexor() adds the handles to
+    // its multi handle directly.
+    lookup_pool pool;
+
+private:
+    // callback function to append chunks of curl response data to the requesting worker's body buffer.
+    // The buffer is cleared rather than freed between requests, so once it has grown
+    // to the size of a typical response no further allocation is made.
+    static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp)
+    {
+        std::string *body = (std::string *)userp;
+        size_t realsize = size * nmemb;
+        try
+        {
+            body->append((const char *)contents, realsize);
+        }
+        catch (const std::bad_alloc &)
+        {
+            /* out of memory! */
+            printf("not enough memory (std::string::append threw std::bad_alloc)\n");
+            return 0;
+        }
+        return realsize;
+    }
+
+    // Drop the response body as it arrives
+    static size_t discard_callback(void *, size_t size, size_t nmemb, void *)
+    {
+        return size * nmemb;
+    }
+
+    // Progress callback aborting a running transfer once every caller has stopped waiting for it
+    static int progress_callback(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+    {
+        const std::shared_ptr<lookup_flight> &flight = *(const std::shared_ptr<lookup_flight> *)clientp;
+        return (flight && flight->interest.load(std::memory_order_relaxed) == 0) ? 1 : 0;
+    }
+};
+
+// The answer lookup_fake_transport gives for one request
+struct lookup_fake_response
+{
+    long status = 200;
+    std::chrono::microseconds latency{0};
+    std::string payload;
+};
+
+struct lookup_fake_options
+{
+    // Answer every request with status, after latency, with payload
+    long status = 200;
+    std::chrono::microseconds latency{0};
+    std::string payload = "{\"result\":\"Item is in inventory.\"}";
+
+    // If set, called instead to fill in the answer for each id, starting from
+    // the answer above.  May be called concurrently from several workers.
+    std::function<void(std::string_view id, lookup_fake_response &response)> respond;
+};
+
+// Requests answered in process, with nothing sent over the network.
+// A request longer than the request timeout ends in CURLE_OPERATION_TIMEDOUT
+// once the timeout has passed, and one whose callers have all stopped waiting
+// is aborted before it starts.  Only the threaded engine can use it.
+class lookup_fake_transport
+{
+public:
+    static constexpr bool multiplexed = false;
+
+    // State of one worker's requests
+    struct fake_handle
+    {
+        std::string id;
+        std::shared_ptr<lookup_flight> *flight = nullptr;
+        std::string *body = nullptr;
+        std::chrono::milliseconds request_timeout{0};
+        lookup_fake_response response;
+        std::chrono::microseconds elapsed{0};
+    };
+    typedef fake_handle *handle;
+
+    // Answer with the defaults of lookup_fake_options
+    lookup_fake_transport(const lookup_pool_options &)
+        : lookup_fake_transport(lookup_fake_options()) {}
+
+    lookup_fake_transport(const lookup_fake_options &options)
+        : options(options) {}
+
+    fake_handle *acquire()
+    {
+        return new fake_handle();
+    }
+
+    void release(fake_handle *h)
+    {
+        delete h;
+    }
+
+    void configure(fake_handle *h, std::chrono::milliseconds, std::chrono::milliseconds request_timeout,
+                   std::shared_ptr<lookup_flight> *flight, std::string *body)
+    {
+        h->flight = flight;
+        h->body = body;
+        h->request_timeout = request_timeout;
+    }
+
+    static void aim(fake_handle *h, const lookup_endpoint &endpoint, const std::string &id, std::string &url)
+    {
+        url.assign(endpoint.base_url).append(id);
+        h->id = id;
+    }
+
+    CURLcode perform(fake_handle *h)
+    {
+        const std::shared_ptr<lookup_flight> &flight = *h->flight;
+        h->elapsed = std::chrono::microseconds(0);
+        if (flight && flight->interest.load(std::memory_order_relaxed) == 0)
+        {
+            return CURLE_ABORTED_BY_CALLBACK;
+        }
+
+        h->response.status = options.status;
+        h->response.latency = options.latency;
+        h->response.payload.assign(options.payload);
+        if (options.respond)
+        {
+            options.respond(h->id, h->response);
+        }
+
+        bool timed_out = h->request_timeout.count() != 0 && h->response.latency > h->request_timeout;
+        h->elapsed = timed_out ? std::chrono::duration_cast<std::chrono::microseconds>(h->request_timeout)
+                               : h->response.latency;
+        if (h->elapsed.count() != 0)
+        {
+            std::this_thread::sleep_for(h->elapsed);
+        }
+        if (timed_out)
+        {
+            return CURLE_OPERATION_TIMEDOUT;
+        }
+        if (h->body && h->response.status == 200)
+        {
+            h->body->append(h->response.payload);
+        }
+        return CURLE_OK;
+    }
+
+    static void read(fake_handle *h, CURLcode code, lookup_transfer &transfer)
+    {
+        transfer.code = code;
+        transfer.http_code = (code == CURLE_OK) ? h->response.status : 0;
+        transfer.timings = lookup_timings();
+        transfer.timings.first_byte = h->elapsed;
+        transfer.timings.total = h->elapsed;
+        transfer.received_bytes = (code == CURLE_OK && h->response.status == 200) ? h->response.payload.size() : 0;
+    }
+
+private:
+    const lookup_fake_options options;
+};
+
+#endif /* LOOKUP_TRANSPORT_CPP_INCLUDED */
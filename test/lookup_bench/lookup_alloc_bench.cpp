@@ -0,0 +1,235 @@
+// lookup_alloc_bench
+// Author: Jordan Chandler
+
+// Allocation-counting benchmark of lookup_get's response path.
+//
+// Interposes malloc, calloc, realloc and free (operator new and libcurl both
+// allocate through them) and counts the calls and bytes made by the calling
+// thread and lookup_get's workers while a batch of unique ids is requested
+// from a minimal keep-alive HTTP server run inside the benchmark.  Each engine
+// is warmed up first so pooled handles and connections are not charged to the
+// batch, then measured fetching every id, answering every id from the response
+// cache, fetching new ids through the request() overload that returns a map,
+// and fetching and re-reading ids as typed results through request_results().
+// The server's own threads are not counted.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_alloc_bench.cpp -lpthread -lcurl -lz -o lookup_alloc_bench
+//
+// Usage: lookup_alloc_bench [unique ids] [payload bytes]
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<uint64_t> allocated_bytes{0};
+
+// Set on threads whose allocations are not charged to lookup_get
+static thread_local bool uncounted = false;
+
+static void count(size_t size)
+{
+    if (!uncounted)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+extern "C" void *malloc(size_t size)
+{
+    count(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count_, size_t size)
+{
+    count(count_ * size);
+    return __libc_calloc(count_, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    count(size);
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer)
+{
+    __libc_free(pointer);
+}
+
+#include "lookup_get.cpp"
+
+// Answer every request on a connection with the same 200 response until the client closes it
+static void serve_connection(int connection, const std::string *reply)
+{
+    uncounted = true;
+    char request[8192];
+    size_t buffered = 0;
+    while (true)
+    {
+        ssize_t received = recv(connection, request + buffered, sizeof(request) - buffered, 0);
+        if (received <= 0)
+        {
+            break;
+        }
+        buffered += received;
+
+        // Reply once per complete request head; requests carry no body
+        char *end;
+        while ((end = (char *)memmem(request, buffered, "\r\n\r\n", 4)))
+        {
+            size_t consumed = end + 4 - request;
+            memmove(request, request + consumed, buffered - consumed);
+            buffered -= consumed;
+            send(connection, reply->data(), reply->size(), MSG_NOSIGNAL);
+        }
+        if (buffered == sizeof(request))
+        {
+            break;
+        }
+    }
+    close(connection);
+}
+
+// Accept connections on listener, serving each on its own thread
+static void serve(int listener, const std::string *reply)
+{
+    uncounted = true;
+    while (true)
+    {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0)
+        {
+            break;
+        }
+        int on = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        std::thread(serve_connection, connection, reply).detach();
+    }
+}
+
+static std::vector<std::string> unique_ids(const std::string &prefix, size_t count)
+{
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < count; i++)
+    {
+        ids.push_back(prefix + std::to_string(i));
+    }
+    return ids;
+}
+
+// Ways of receiving the responses
+enum class delivery
+{
+    // JSON envelopes streamed to a sink that discards them
+    json_sink,
+    // JSON envelopes collected into the returned map
+    json_map,
+    // Typed results streamed to a sink that discards them
+    result_sink
+};
+
+static void measure(const char *engine_name, const char *phase, lookup_get &get,
+                    const std::vector<std::string> &ids, unsigned long port, delivery how)
+{
+    uint64_t allocations_before = allocations.load();
+    uint64_t bytes_before = allocated_bytes.load();
+
+    switch (how)
+    {
+    case delivery::json_sink:
+        get.request(ids, "http://127.0.0.1/items/", port, "TOKEN", 5,
+                    [](const std::string &, std::string) {});
+        break;
+    case delivery::json_map:
+        get.request(ids, "http://127.0.0.1/items/", port, "TOKEN", 5);
+        break;
+    case delivery::result_sink:
+        get.request_results(ids, "http://127.0.0.1/items/", port, "TOKEN", 5,
+                            [](const lookup_result_ptr &) {});
+        break;
+    }
+
+    uint64_t counted = allocations.load() - allocations_before;
+    uint64_t bytes = allocated_bytes.load() - bytes_before;
+    std::cout << engine_name << ","
+              << phase << ","
+              << ids.size() << ","
+              << counted << ","
+              << bytes << ","
+              << (double)counted / ids.size() << ","
+              << (double)bytes / ids.size() << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t id_count = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 10000;
+    size_t payload_bytes = (argc > 2) ? std::strtoul(argv[2], NULL, 10) : 0;
+
+    // The lookup_server item, or a padded item of the requested size
+    std::string payload = "{\"result\":\"Item is in inventory.\"}";
+    if (payload_bytes > payload.size())
+    {
+        payload = "{\"result\":\"" + std::string(payload_bytes - 13, 'x') + "\"}";
+    }
+    std::string reply = "HTTP/1.1 200 OK\r\nContent-Type: text/json\r\nContent-Length: " +
+                        std::to_string(payload.size()) + "\r\n\r\n" + payload;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_size = sizeof(address);
+    if (listener < 0 ||
+        bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 128) != 0 ||
+        getsockname(listener, (sockaddr *)&address, &address_size) != 0)
+    {
+        std::cerr << "cannot listen on the loopback interface" << std::endl;
+        return EXIT_FAILURE;
+    }
+    unsigned long port = ntohs(address.sin_port);
+    std::thread(serve, listener, &reply).detach();
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    std::cout << "engine,phase,ids,allocations,bytes,allocations_per_lookup,bytes_per_lookup" << std::endl;
+    for (lookup_engine engine : {lookup_engine::threaded, lookup_engine::multi})
+    {
+        const char *engine_name = (engine == lookup_engine::threaded) ? "threaded" : "multi";
+        lookup_options options;
+        options.engine = engine;
+        lookup_get get(options);
+
+        // Open the pooled handles and connections
+        get.request(unique_ids(std::string(engine_name) + "-warmup-", 100), "http://127.0.0.1/items/", port, "TOKEN", 5,
+                    [](const std::string &, std::string) {});
+
+        // Ids of equal length in every phase, so none is charged more for its ids
+        std::string prefix = std::string(1, engine_name[0]);
+        std::vector<std::string> ids = unique_ids(prefix + "-j-", id_count);
+        measure(engine_name, "fetch", get, ids, port, delivery::json_sink);
+        measure(engine_name, "cached", get, ids, port, delivery::json_sink);
+        measure(engine_name, "fetch_map", get, unique_ids(prefix + "-m-", id_count), port, delivery::json_map);
+        measure(engine_name, "fetch_results", get, unique_ids(prefix + "-r-", id_count), port, delivery::result_sink);
+        measure(engine_name, "cached_results", get, ids, port, delivery::result_sink);
+    }
+    return EXIT_SUCCESS;
+}
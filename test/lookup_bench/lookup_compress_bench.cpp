@@ -0,0 +1,223 @@
+// lookup_compress_bench
+// Author: Jordan Chandler
+
+// Bytes per item on the wire and in the response cache, and request slot hold
+// time, with and without compression.
+//
+// For each payload size the benchmark starts its own server, either the native
+// lookup_server or lookup_server.js under node, with -b size and -z, so items
+// are stock records generated from their ids and are sent compressed to
+// clients that accept it.  Then, for each transfer mode and cache mode, a
+// fresh lookup_get requests one batch of new ids and requests it again:
+//   transfer  identity    - lookup_pool_options::accept_compressed off
+//             compressed  - accept_compressed on; the server gzips each item
+//   cache     plain       - payloads cached as received
+//             deflate     - lookup_cache_options::compress without a dictionary
+//             dictionary  - compress with the dictionary trained from the
+//                           first dictionary_bytes of payloads
+// The first pass measures the transfer: body bytes received and delivered per
+// item from lookup_get's received_bytes and payload_bytes counters, and the
+// mean and p99 of libcurl's total transfer time, for which each request holds
+// its slot.  The second pass is answered entirely by the response cache and
+// measures the time per hit, which includes inflating compressed entries.
+// The cache's bytes per item are its charged bytes over its entries.
+//
+// Over loopback the wire is never the bottleneck, so hold times here show the
+// cost of compressing and decoding; the bytes saved are what shortens
+// transfers on a network with limited bandwidth.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_compress_bench.cpp -lpthread -lcurl -lz -lrt -o lookup_compress_bench
+//
+// Usage: lookup_compress_bench server [port] [payload sizes] [ids] [limit]
+//   e.g. lookup_compress_bench ../lookup_server/lookup_server 8098 200,1000,4000 2000 5
+//   server is the lookup_server executable or lookup_server.js, which needs
+//   node on the PATH and lookup_server's node modules installed.
+//   Lists are comma separated.
+//
+// Prints CSV: payload_bytes,transfer,cache,ids,wire_bytes_per_item,payload_bytes_per_item,cache_bytes_per_item,hold_mean_ms,hold_p99_ms,hit_us
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "lookup_get.cpp"
+
+const std::string authorization_token = "lookup_compress_bench";
+
+static std::vector<std::string> split(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Check whether the server answers its /stats route
+static bool server_ready(unsigned long port)
+{
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/stats");
+    curl_easy_setopt(curl, CURLOPT_PORT, port);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 500L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)[](char *, size_t size, size_t nmemb, void *) {
+        return size * nmemb;
+    });
+    long http_code = 0;
+    CURLcode code = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_cleanup(curl);
+    return code == CURLE_OK && http_code == 200;
+}
+
+// Start the server padding items to payload_bytes and compressing them, and
+// wait until it answers.  Returns its pid, or -1.
+static pid_t start_server(const std::string &server, unsigned long port, size_t payload_bytes, long server_limit)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // The server logs every request; keep that out of the CSV
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        std::string port_text = std::to_string(port);
+        std::string payload_text = std::to_string(payload_bytes);
+        std::string limit_text = std::to_string(server_limit);
+        bool script = server.size() > 3 && server.compare(server.size() - 3, 3, ".js") == 0;
+        if (script)
+        {
+            execlp("node", "node", server.c_str(), "-p", port_text.c_str(), "-a", authorization_token.c_str(),
+                   "-b", payload_text.c_str(), "-z", "-l", limit_text.c_str(), (char *)NULL);
+        }
+        else
+        {
+            execl(server.c_str(), server.c_str(), "-p", port_text.c_str(), "-a", authorization_token.c_str(),
+                  "-b", payload_text.c_str(), "-z", "-l", limit_text.c_str(), (char *)NULL);
+        }
+        _exit(127);
+    }
+    if (pid < 0)
+    {
+        return -1;
+    }
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        if (server_ready(port))
+        {
+            return pid;
+        }
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+        {
+            return -1;
+        }
+        usleep(100 * 1000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+static std::vector<std::string> make_batch(size_t size, size_t run)
+{
+    std::vector<std::string> batch;
+    batch.reserve(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        batch.push_back("compress-" + std::to_string(run) + "-" + std::to_string(i));
+    }
+    return batch;
+}
+
+int main(int argc, char *args[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: lookup_compress_bench server [port] [payload sizes] [ids] [limit]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string server_path = args[1];
+    unsigned long port = (argc > 2) ? strtoul(args[2], nullptr, 10) : 8098;
+    std::vector<std::string> sizes = split((argc > 3) ? args[3] : "200,1000,4000");
+    size_t ids = (argc > 4) ? strtoul(args[4], nullptr, 10) : 2000;
+    unsigned int limit = (argc > 5) ? (unsigned int)strtoul(args[5], nullptr, 10) : 5;
+
+    const char *transfers[] = {"identity", "compressed"};
+    const char *caches[] = {"plain", "deflate", "dictionary"};
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    std::cout << "payload_bytes,transfer,cache,ids,wire_bytes_per_item,payload_bytes_per_item,cache_bytes_per_item,"
+                 "hold_mean_ms,hold_p99_ms,hit_us"
+              << std::endl;
+
+    size_t run = 0;
+    for (const auto &size : sizes)
+    {
+        size_t payload_bytes = strtoul(size.c_str(), nullptr, 10);
+        pid_t server = start_server(server_path, port, payload_bytes, limit);
+        if (server < 0)
+        {
+            std::cerr << "cannot start " << server_path << " on port " << port << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (const char *transfer : transfers)
+        {
+            for (const char *cache : caches)
+            {
+                std::vector<std::string> batch = make_batch(ids, run++);
+
+                lookup_options options;
+                options.pool.accept_compressed = (transfer[0] == 'c');
+                options.cache.max_bytes = (size_t)1 << 32;
+                options.cache.compress = (cache[0] != 'p');
+                options.cache.dictionary_bytes = (cache[0] == 'd' && cache[1] == 'i') ? 16 * 1024 : 0;
+                lookup_get get(options);
+
+                get.request_results(batch, "http://localhost/items/", port, authorization_token, limit,
+                                    [](const lookup_result_ptr &) {});
+                lookup_metrics_snapshot transferred = get.metrics();
+
+                auto start = std::chrono::steady_clock::now();
+                get.request_results(batch, "http://localhost/items/", port, authorization_token, limit,
+                                    [](const lookup_result_ptr &) {});
+                std::chrono::duration<double, std::micro> hits = std::chrono::steady_clock::now() - start;
+                lookup_cache_stats cached = get.cache_stats();
+
+                const lookup_histogram_snapshot &hold = transferred.timer(lookup_timer::total);
+                double requests = std::max<uint64_t>(1, transferred.counter(lookup_counter::requests));
+                std::cout << payload_bytes << "," << transfer << "," << cache << "," << ids << ","
+                          << std::fixed << std::setprecision(1)
+                          << transferred.counter(lookup_counter::received_bytes) / requests << ","
+                          << transferred.counter(lookup_counter::payload_bytes) / requests << ","
+                          << (double)cached.bytes / std::max<size_t>(1, cached.entries) << ","
+                          << std::setprecision(3) << hold.mean().count() / 1000.0 << ","
+                          << hold.quantile(0.99).count() / 1000.0 << ","
+                          << std::setprecision(2) << hits.count() / ids
+                          << std::defaultfloat << std::endl;
+            }
+        }
+        stop_server(server);
+    }
+    curl_global_cleanup();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+// lookup_ids_bench
+// Author: Jordan Chandler
+
+// Memory and time of holding and deduplicating a very large batch of ids, by
+// representation.
+//
+// Builds a batch shaped like lookup_client's (random 32 character tokens, each
+// offered twice in a row, then the whole list offered again) and makes it
+// unique, as request_results() does before submitting anything:
+//   strings     - a std::vector<std::string> deduplicated through a
+//                 std::unordered_set<std::string_view>, as lookup_get did before
+//                 lookup_ids.cpp
+//   handle_set  - the same vector deduplicated through a lookup_handle_set of
+//                 indices, as unique_indices() does now
+//   arena       - ids interned into a lookup_id_arena as they are made, which
+//                 leaves nothing to deduplicate
+// Each representation runs in its own child process, so its peak resident set
+// size is its own.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_ids_bench.cpp -o lookup_ids_bench
+//
+// Usage: lookup_ids_bench [ids]
+//
+// Prints CSV: representation,ids,unique,build_seconds,dedup_seconds,ids_per_second,peak_rss_kb,bytes_per_id
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_set>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "lookup_ids.cpp"
+
+// Deterministic random 32 character tokens, like lookup_client's random_string()
+class token_source
+{
+public:
+    std::string next()
+    {
+        static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        std::string token(32, ' ');
+        for (char &c : token)
+        {
+            c = alphabet[generator() % (sizeof(alphabet) - 1)];
+        }
+        return token;
+    }
+
+private:
+    std::mt19937_64 generator{42};
+};
+
+struct outcome
+{
+    size_t unique = 0;
+    double build_seconds = 0;
+    double dedup_seconds = 0;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The batch as lookup_client built it before ids were interned
+static std::vector<std::string> string_batch(size_t ids)
+{
+    token_source tokens;
+    std::vector<std::string> first;
+    first.reserve(ids / 2);
+    for (size_t i = 0; i < ids / 4; i++)
+    {
+        std::string id = tokens.next();
+        first.push_back(id);
+        first.push_back(id);
+    }
+    std::vector<std::string> batch;
+    batch.reserve(first.size() * 2);
+    batch.insert(batch.end(), first.begin(), first.end());
+    batch.insert(batch.end(), first.begin(), first.end());
+    return batch;
+}
+
+static outcome run_strings(size_t ids)
+{
+    outcome result;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> batch = string_batch(ids);
+    result.build_seconds = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    std::unordered_set<std::string_view> seen(batch.size());
+    std::vector<uint32_t> unique;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (seen.insert(batch[i]).second)
+        {
+            unique.push_back(i);
+        }
+    }
+    result.dedup_seconds = seconds_since(start);
+    result.unique = unique.size();
+    return result;
+}
+
+struct batch_index
+{
+    const std::vector<std::string> *ids;
+
+    std::string_view operator()(lookup_id_handle index) const
+    {
+        return (*ids)[index];
+    }
+};
+
+static outcome run_handle_set(size_t ids)
+{
+    outcome result;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> batch = string_batch(ids);
+    result.build_seconds = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    lookup_handle_set<batch_index> seen(batch_index{&batch});
+    std::vector<uint32_t> unique;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (seen.insert(i) == i)
+        {
+            unique.push_back(i);
+        }
+    }
+    result.dedup_seconds = seconds_since(start);
+    result.unique = unique.size();
+    return result;
+}
+
+static outcome run_arena(size_t ids)
+{
+    outcome result;
+    auto start = std::chrono::steady_clock::now();
+    token_source tokens;
+    lookup_id_arena arena;
+    for (size_t i = 0; i < ids / 4; i++)
+    {
+        std::string id = tokens.next();
+        arena.intern(id);
+        arena.intern(id);
+    }
+    size_t unique = arena.size();
+    for (size_t i = 0; i < unique; i++)
+    {
+        arena.intern(arena[i]);
+        arena.intern(arena[i]);
+    }
+    result.build_seconds = seconds_since(start);
+    result.unique = arena.size();
+    return result;
+}
+
+// Run one representation in a child process and print its row
+static bool measure(const char *representation, outcome (*run)(size_t), size_t ids)
+{
+    int channel[2];
+    if (pipe(channel) != 0)
+    {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(channel[0]);
+        outcome result = run(ids);
+        ssize_t written = write(channel[1], &result, sizeof(result));
+        _exit(written == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(channel[1]);
+    outcome result;
+    bool received = pid > 0 && read(channel[0], &result, sizeof(result)) == sizeof(result);
+    close(channel[0]);
+    int status = 0;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) != pid || !received)
+    {
+        return false;
+    }
+
+    double seconds = result.build_seconds + result.dedup_seconds;
+    std::cout << representation << "," << ids << "," << result.unique << ","
+              << std::fixed << std::setprecision(3) << result.build_seconds << "," << result.dedup_seconds << ","
+              << std::setprecision(0) << ids / seconds << "," << usage.ru_maxrss << ","
+              << std::setprecision(1) << usage.ru_maxrss * 1024.0 / ids
+              << std::defaultfloat << std::endl;
+    return true;
+}
+
+int main(int argc, char *args[])
+{
+    size_t ids = (argc > 1) ? strtoul(args[1], nullptr, 10) : 10000000;
+
+    std::cout << "representation,ids,unique,build_seconds,dedup_seconds,ids_per_second,peak_rss_kb,bytes_per_id" << std::endl;
+    bool ok = measure("strings", run_strings, ids) &&
+              measure("handle_set", run_handle_set, ids) &&
+              measure("arena", run_arena, ids);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
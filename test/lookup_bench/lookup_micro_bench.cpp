@@ -0,0 +1,251 @@
+// lookup_micro_bench
+// Author: Jordan Chandler
+
+// Microbenchmarks of the structures on lookup_get's hot path, measured on
+// their own without curl or a server.
+//
+// semaphore: threads repeatedly take and return one of 5 request slots, as
+// workers do around each request, through the mutex/condition variable
+// semaphore, fast_semaphore, and std::counting_semaphore when compiled as
+// C++20.
+// queue: threads each queue a value and take the next one, as submitters
+// and workers do, through lookup_queue (the lock-free queue lookup_get used
+// before lookup_scheduler, kept beside this file), a mutex guarded
+// std::deque and lookup_scheduler.
+// cache: threads look up ids held by lookup_cache, ids it does not hold,
+// and replace held ids.
+//
+// Compile with:
+//      g++ -std=c++20 -O2 -I../../src/lookup_get lookup_micro_bench.cpp -lpthread -lcurl -lz -lrt -o lookup_micro_bench
+//
+// Usage: lookup_micro_bench [operations per thread]
+//
+// Prints CSV: structure,implementation,operation,threads,operations,operations_per_second,ns_per_operation
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+#if __cplusplus >= 202002L && __has_include(<semaphore>)
+#include <semaphore>
+#endif
+
+#include "lookup_get.cpp"
+#include "lookup_queue.cpp"
+
+#ifdef __cpp_lib_semaphore
+// std::counting_semaphore behind the interface of lookup_get's semaphores
+class std_semaphore
+{
+public:
+    std_semaphore(int count)
+        : slots(count) {}
+
+    void post()
+    {
+        slots.release();
+    }
+
+    void wait()
+    {
+        slots.acquire();
+    }
+
+private:
+    std::counting_semaphore<> slots;
+};
+#endif
+
+// The queue a mutex protected std::deque would give
+template <typename T>
+class mutex_queue
+{
+public:
+    mutex_queue(size_t) {}
+
+    bool push(T value)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        values.push_back(std::move(value));
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        if (values.empty())
+        {
+            return false;
+        }
+        value = std::move(values.front());
+        values.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex accessor;
+    std::deque<T> values;
+};
+
+const unsigned int thread_counts[] = {1, 2, 4, 8};
+
+// Run operation(thread, i) operations times on each of thread_count threads
+// started together, and print one CSV row
+template <class Operation>
+void measure(const char *structure, const char *implementation, const char *operation_name,
+             unsigned int thread_count, size_t operations, Operation operation)
+{
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < thread_count; t++)
+    {
+        threads.emplace_back([&, t]() {
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < operations; i++)
+            {
+                operation(t, i);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double total = (double)operations * thread_count;
+    std::cout << structure << "," << implementation << "," << operation_name << ","
+              << thread_count << "," << (size_t)total << ","
+              << std::fixed << std::setprecision(0) << total / elapsed.count() << ","
+              << std::setprecision(1) << elapsed.count() * 1e9 * thread_count / total
+              << std::defaultfloat << std::endl;
+}
+
+// Take and return one of 5 request slots
+template <class Semaphore>
+void bench_semaphore(const char *implementation, size_t operations)
+{
+    for (unsigned int threads : thread_counts)
+    {
+        Semaphore slots(5);
+        measure("semaphore", implementation, "wait_post", threads, operations, [&](unsigned int, size_t) {
+            slots.wait();
+            slots.post();
+        });
+    }
+}
+
+// Queue a value and take the next one, keeping whatever was taken for the next push
+template <class Queue>
+void bench_queue(const char *implementation, size_t operations)
+{
+    for (unsigned int threads : thread_counts)
+    {
+        Queue queue(1024);
+        std::vector<uint32_t> held(threads);
+        for (unsigned int t = 0; t < threads; t++)
+        {
+            held[t] = t;
+        }
+        measure("queue", implementation, "push_pop", threads, operations, [&](unsigned int t, size_t) {
+            // Either side may briefly find the cell it needs held by a
+            // preempted thread a lap behind or ahead
+            while (!queue.push(held[t]))
+            {
+                std::this_thread::yield();
+            }
+            while (!queue.pop(held[t]))
+            {
+                std::this_thread::yield();
+            }
+        });
+    }
+}
+
+void bench_scheduler(size_t operations)
+{
+    auto endpoint = std::make_shared<const lookup_endpoint>("http://localhost/items/", 8080, "");
+    for (unsigned int threads : thread_counts)
+    {
+        lookup_scheduler scheduler(1024, lookup_scheduler_options());
+        std::vector<std::shared_ptr<lookup_flight>> held;
+        for (unsigned int t = 0; t < threads; t++)
+        {
+            held.push_back(std::make_shared<lookup_flight>(std::to_string(t), endpoint));
+        }
+        lookup_dispatch dispatch;
+        measure("queue", "lookup_scheduler", "push_pop", threads, operations, [&](unsigned int t, size_t) {
+            bool expired;
+            scheduler.push(held[t], dispatch);
+            while (!scheduler.pop(held[t], expired))
+            {
+                std::this_thread::yield();
+            }
+        });
+    }
+}
+
+void bench_cache(size_t operations)
+{
+    const size_t id_count = 64 * 1024;
+    std::vector<lookup_result_ptr> results;
+    std::vector<std::string> absent;
+    for (size_t i = 0; i < id_count; i++)
+    {
+        auto result = std::make_shared<lookup_result>();
+        result->id = "item-" + std::to_string(i);
+        result->status = 200;
+        result->payload = "{\"result\":\"Item is in inventory.\"}";
+        results.push_back(result);
+        absent.push_back("absent-" + std::to_string(i));
+    }
+
+    for (unsigned int threads : thread_counts)
+    {
+        lookup_cache cache;
+        for (const auto &result : results)
+        {
+            cache.insert(result);
+        }
+        // Each thread strides through the ids from its own offset
+        auto index = [&](unsigned int t, size_t i) { return (i * 7919 + t * 4099) % id_count; };
+        measure("cache", "lookup_cache", "find_hit", threads, operations, [&](unsigned int t, size_t i) {
+            cache.find(results[index(t, i)]->id);
+        });
+        measure("cache", "lookup_cache", "find_miss", threads, operations, [&](unsigned int t, size_t i) {
+            cache.find(absent[index(t, i)]);
+        });
+        measure("cache", "lookup_cache", "insert", threads, operations, [&](unsigned int t, size_t i) {
+            cache.insert(results[index(t, i)]);
+        });
+    }
+}
+
+int main(int argc, char *args[])
+{
+    size_t operations = (argc > 1) ? strtoul(args[1], nullptr, 10) : 200000;
+
+    std::cout << "structure,implementation,operation,threads,operations,operations_per_second,ns_per_operation" << std::endl;
+    bench_semaphore<semaphore>("semaphore", operations);
+    bench_semaphore<fast_semaphore>("fast_semaphore", operations);
+#ifdef __cpp_lib_semaphore
+    bench_semaphore<std_semaphore>("std_counting_semaphore", operations);
+#endif
+    bench_queue<lookup_queue<uint32_t>>("lookup_queue", operations);
+    bench_queue<mutex_queue<uint32_t>>("mutex_deque", operations);
+    bench_scheduler(operations);
+    bench_cache(operations);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+// lookup_policy_bench
+// Author: Jordan Chandler
+
+// Time lookup_get spends per lookup on its own scheduling and caching paths,
+// by choice of policies, with every request answered in process by
+// lookup_fake_transport so no network or server is involved.
+//
+// Each configuration is a basic_lookup_get instance:
+//   full    - lookup_cache, lookup_scheduler, lookup_limiter, lookup_payload_result:
+//             everything lookup_get does, but with a fake transport
+//   status  - the same, keeping only each response's status
+//   lean    - lookup_no_cache, lookup_fifo_scheduler, lookup_fixed_limiter,
+//             lookup_status_result
+// For each, a batch of distinct ids is requested twice through request_results().
+// The first pass (miss) sends every id through the transport, the second
+// (repeat) is answered from the cache where there is one, which is sized to
+// hold the whole batch.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_policy_bench.cpp -lpthread -lcurl -lz -lrt -o lookup_policy_bench
+//
+// Usage: lookup_policy_bench [ids] [request slots]
+//
+// Prints CSV: configuration,pass,ids,slots,seconds,lookups_per_second,ns_per_lookup
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+
+#include "lookup_get.cpp"
+
+// Distinct 32 character ids
+static std::vector<std::string> make_ids(size_t count)
+{
+    std::vector<std::string> ids;
+    ids.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string id = std::to_string(i);
+        ids.push_back(std::string(32 - id.size(), '0') + id);
+    }
+    return ids;
+}
+
+// Request ids twice through a fresh instance and print one row per pass
+template <typename Lookup>
+void measure(const char *configuration, const std::vector<std::string> &ids, unsigned int slots)
+{
+    lookup_options options;
+    options.max_requests = slots;
+    // Room for the whole batch, well above what each entry is charged, so
+    // the repeat pass measures hits rather than misses after evictions
+    options.cache.max_bytes = std::max<size_t>(options.cache.max_bytes, ids.size() * 4096);
+    Lookup lookup(options, lookup_fake_options());
+
+    const char *passes[] = {"miss", "repeat"};
+    for (const char *pass : passes)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<lookup_result_ptr> results = lookup.request_results(ids, "http://fake/", 0, "", slots);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (results.size() != ids.size())
+        {
+            std::cerr << configuration << ": " << results.size() << " results for " << ids.size() << " ids" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        std::cout << configuration << "," << pass << "," << ids.size() << "," << slots << ","
+                  << std::fixed << std::setprecision(4) << seconds << ","
+                  << std::setprecision(0) << ids.size() / seconds << ","
+                  << std::setprecision(0) << seconds * 1e9 / ids.size()
+                  << std::defaultfloat << std::endl;
+    }
+}
+
+int main(int argc, char *args[])
+{
+    size_t count = (argc > 1) ? strtoul(args[1], nullptr, 10) : 200000;
+    unsigned int slots = (argc > 2) ? (unsigned int)strtoul(args[2], nullptr, 10) : 8;
+    std::vector<std::string> ids = make_ids(count);
+
+    std::cout << "configuration,pass,ids,slots,seconds,lookups_per_second,ns_per_lookup" << std::endl;
+    measure<basic_lookup_get<lookup_cache, lookup_scheduler, lookup_limiter, lookup_fake_transport>>(
+        "full", ids, slots);
+    measure<basic_lookup_get<lookup_cache, lookup_scheduler, lookup_limiter, lookup_fake_transport, lookup_status_result>>(
+        "status", ids, slots);
+    measure<basic_lookup_get<lookup_no_cache, lookup_fifo_scheduler, lookup_fixed_limiter, lookup_fake_transport, lookup_status_result>>(
+        "lean", ids, slots);
+    return EXIT_SUCCESS;
+}
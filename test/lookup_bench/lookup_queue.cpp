@@ -0,0 +1,125 @@
+#ifndef LOOKUP_QUEUE_CPP_INCLUDED
+#define LOOKUP_QUEUE_CPP_INCLUDED
+
+// lookup_queue
+// Author: Jordan Chandler
+
+// Bounded lock-free multi-producer multi-consumer queue of small values.
+// Algorithm by Dmitry Vyukov, http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// Each cell carries a sequence number that tells producers and consumers
+// whether the cell is free for the current lap of the ring, so push() and
+// pop() only contend on a single compare-and-swap of their own position.
+// lookup_get queued its flights through it before lookup_scheduler took its
+// place; it is kept here as a baseline for lookup_micro_bench.
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+template <typename T = uint32_t>
+class lookup_queue
+{
+public:
+    // capacity is rounded up to a power of two
+    lookup_queue(size_t capacity)
+    {
+        size_t count = 2;
+        while (count < capacity)
+        {
+            count <<= 1;
+        }
+        cells.reset(new cell[count]);
+        for (size_t i = 0; i < count; i++)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask = count - 1;
+        enqueue_position.store(0, std::memory_order_relaxed);
+        dequeue_position.store(0, std::memory_order_relaxed);
+    }
+
+    // Append value.  Returns false if the queue is full.
+    bool push(T value)
+    {
+        cell *c;
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &cells[position & mask];
+            size_t sequence = c->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+            if (difference == 0)
+            {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = std::move(value);
+        c->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Remove the oldest value.  Returns false if the queue is empty.
+    bool pop(T &value)
+    {
+        cell *c;
+        size_t position = dequeue_position.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &cells[position & mask];
+            size_t sequence = c->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (difference == 0)
+            {
+                if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = dequeue_position.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(c->value);
+        c->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Number of queued values.  Only exact when no push() or pop() is in progress.
+    size_t size() const
+    {
+        size_t enqueued = enqueue_position.load(std::memory_order_relaxed);
+        size_t dequeued = dequeue_position.load(std::memory_order_relaxed);
+        return (enqueued > dequeued) ? enqueued - dequeued : 0;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+
+    // Producer and consumer positions on separate cache lines
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) std::atomic<size_t> dequeue_position;
+};
+
+#endif /* LOOKUP_QUEUE_CPP_INCLUDED */
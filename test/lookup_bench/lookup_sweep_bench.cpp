@@ -0,0 +1,246 @@
+// lookup_sweep_bench
+// Author: Jordan Chandler
+
+// End-to-end benchmark of lookup_get against lookup_server over a grid of
+// settings, for comparing changes run to run.
+//
+// For each server delay the benchmark starts its own server, either the
+// native lookup_server or lookup_server.js under node, with -t delay and
+// -l server_limit, then for every engine,
+// request slot limit, batch size and duplicate ratio it builds a fresh
+// lookup_get and requests one batch through request_results().  A batch of
+// size n with duplicate ratio r holds n * (1 - r) unique ids, each repeated
+// in adjacent positions as lookup_client's batches are, and the ids of every
+// run are new so nothing is answered from a cache.
+//
+// Reported per run: lookups per second (batch size over wall time), the
+// p50, p99 and p999 time from the call to each unique id's delivery, the 429
+// responses lookup_get received, and the process's user plus system CPU time
+// per lookup, which covers lookup_get's workers but not the server.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_sweep_bench.cpp -lpthread -lcurl -lz -lrt -o lookup_sweep_bench
+//
+// Usage: lookup_sweep_bench server [port] [limits] [batch sizes] [duplicate ratios] [server delays ms] [server limit] [engines]
+//   e.g. lookup_sweep_bench ../lookup_server/lookup_server 8097 1,5,10 100,1000 0,0.5,0.75 0,10 5 threaded,multi
+//   server is the lookup_server executable or lookup_server.js, which needs
+//   node on the PATH and lookup_server's node modules installed.
+//   Lists are comma separated.
+//
+// Prints CSV: engine,limit,batch,duplicate_ratio,server_delay_ms,server_limit,seconds,lookups_per_second,p50_ms,p99_ms,p999_ms,responses_429,cpu_us_per_lookup
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "lookup_get.cpp"
+
+const std::string authorization_token = "lookup_sweep_bench";
+
+static std::vector<std::string> split(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Check whether the server answers its /stats route
+static bool server_ready(unsigned long port)
+{
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/stats");
+    curl_easy_setopt(curl, CURLOPT_PORT, port);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 500L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)[](char *, size_t size, size_t nmemb, void *) {
+        return size * nmemb;
+    });
+    long http_code = 0;
+    CURLcode code = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_cleanup(curl);
+    return code == CURLE_OK && http_code == 200;
+}
+
+// Start the server and wait until it answers.  Returns its pid, or -1.
+static pid_t start_server(const std::string &server, unsigned long port, long delay_ms, long server_limit)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // The server logs every request; keep that out of the CSV
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        std::string port_text = std::to_string(port);
+        std::string delay_text = std::to_string(delay_ms);
+        std::string limit_text = std::to_string(server_limit);
+        bool script = server.size() > 3 && server.compare(server.size() - 3, 3, ".js") == 0;
+        if (script)
+        {
+            execlp("node", "node", server.c_str(), "-p", port_text.c_str(), "-a", authorization_token.c_str(),
+                   "-t", delay_text.c_str(), "-l", limit_text.c_str(), (char *)NULL);
+        }
+        else
+        {
+            execl(server.c_str(), server.c_str(), "-p", port_text.c_str(), "-a", authorization_token.c_str(),
+                  "-t", delay_text.c_str(), "-l", limit_text.c_str(), (char *)NULL);
+        }
+        _exit(127);
+    }
+    if (pid < 0)
+    {
+        return -1;
+    }
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        if (server_ready(port))
+        {
+            return pid;
+        }
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+        {
+            return -1;
+        }
+        usleep(100 * 1000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+static std::chrono::microseconds cpu_time()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// Batch of size ids with the given share of duplicates, each id repeated in adjacent positions
+static std::vector<std::string> make_batch(size_t size, double duplicate_ratio, size_t run)
+{
+    size_t unique = std::max<size_t>(1, (size_t)(size * (1.0 - duplicate_ratio) + 0.5));
+    std::vector<std::string> batch;
+    batch.reserve(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        batch.push_back("sweep-" + std::to_string(run) + "-" + std::to_string(i * unique / size));
+    }
+    return batch;
+}
+
+static double percentile_ms(const std::vector<std::chrono::microseconds> &sorted, double q)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t rank = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[rank].count() / 1000.0;
+}
+
+int main(int argc, char *args[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: lookup_sweep_bench server [port] [limits] [batch sizes] [duplicate ratios] "
+                     "[server delays ms] [server limit] [engines]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string server_path = args[1];
+    unsigned long port = (argc > 2) ? strtoul(args[2], nullptr, 10) : 8097;
+    std::vector<std::string> limits = split((argc > 3) ? args[3] : "1,5,10");
+    std::vector<std::string> batches = split((argc > 4) ? args[4] : "100,1000");
+    std::vector<std::string> ratios = split((argc > 5) ? args[5] : "0,0.5,0.75");
+    std::vector<std::string> delays = split((argc > 6) ? args[6] : "0,10");
+    long server_limit = (argc > 7) ? strtol(args[7], nullptr, 10) : 5;
+    std::vector<std::string> engines = split((argc > 8) ? args[8] : "threaded,multi");
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    std::cout << "engine,limit,batch,duplicate_ratio,server_delay_ms,server_limit,seconds,lookups_per_second,"
+                 "p50_ms,p99_ms,p999_ms,responses_429,cpu_us_per_lookup"
+              << std::endl;
+
+    size_t run = 0;
+    for (const auto &delay : delays)
+    {
+        pid_t server = start_server(server_path, port, strtol(delay.c_str(), nullptr, 10), server_limit);
+        if (server < 0)
+        {
+            std::cerr << "cannot start " << server_path << " on port " << port << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (const auto &engine : engines)
+        {
+            for (const auto &limit : limits)
+            {
+                for (const auto &batch_size : batches)
+                {
+                    for (const auto &ratio : ratios)
+                    {
+                        std::vector<std::string> batch = make_batch(
+                            strtoul(batch_size.c_str(), nullptr, 10), strtod(ratio.c_str(), nullptr), run++);
+
+                        lookup_options options;
+                        options.engine = (engine[0] == 'm') ? lookup_engine::multi : lookup_engine::threaded;
+                        lookup_get get(options);
+
+                        // Time from the call to each unique id's delivery
+                        std::vector<std::chrono::microseconds> latencies;
+                        std::mutex latencies_accessor;
+                        auto cpu_start = cpu_time();
+                        auto start = std::chrono::steady_clock::now();
+                        get.request_results(batch, "http://localhost/items/", port, authorization_token,
+                                            (unsigned int)strtoul(limit.c_str(), nullptr, 10),
+                                            [&](const lookup_result_ptr &) {
+                                                auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                                                    std::chrono::steady_clock::now() - start);
+                                                std::lock_guard<std::mutex> lock(latencies_accessor);
+                                                latencies.push_back(latency);
+                                            });
+                        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                        auto cpu = cpu_time() - cpu_start;
+                        std::sort(latencies.begin(), latencies.end());
+
+                        std::cout << engine << "," << limit << "," << batch.size() << "," << ratio << ","
+                                  << delay << "," << server_limit << ","
+                                  << std::fixed << std::setprecision(3) << elapsed.count() << ","
+                                  << std::setprecision(0) << batch.size() / elapsed.count() << ","
+                                  << std::setprecision(3) << percentile_ms(latencies, 0.5) << ","
+                                  << percentile_ms(latencies, 0.99) << ","
+                                  << percentile_ms(latencies, 0.999) << ","
+                                  << get.metrics().counter(lookup_counter::rate_limited) << ","
+                                  << std::setprecision(2) << (double)cpu.count() / batch.size()
+                                  << std::defaultfloat << std::endl;
+                    }
+                }
+            }
+        }
+        stop_server(server);
+    }
+    curl_global_cleanup();
+    return EXIT_SUCCESS;
+}
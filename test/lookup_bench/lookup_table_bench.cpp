@@ -0,0 +1,131 @@
+// lookup_table_bench
+// Author: Jordan Chandler
+
+// Microbenchmark of the store request() collects its responses in.
+//
+// Replays the publish-then-take pattern of request() for a batch shaped like
+// lookup_client's (each id requested twice in a row, then the whole list
+// repeated) from 1 to 64 threads: workers publish every response, then the
+// caller takes the whole store as an ordered map.  The original std::map
+// guarded by a single mutex is compared against the sharded lookup_table.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_table_bench.cpp -lpthread -o lookup_table_bench
+//
+// Usage: lookup_table_bench [unique ids]
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+#include "lookup_table.cpp"
+
+// The store lookup_get used before lookup_table
+class mutex_map_table
+{
+public:
+    void publish(const std::string &id, std::string response)
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        entries[id] = std::move(response);
+    }
+
+    std::map<std::string, std::string> take()
+    {
+        std::lock_guard<std::mutex> lock(accessor);
+        return std::move(entries);
+    }
+
+private:
+    std::map<std::string, std::string> entries;
+    std::mutex accessor;
+};
+
+std::vector<std::string> make_batch(size_t unique_ids)
+{
+    const std::string characters("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
+    std::mt19937 generator(42);
+    std::vector<std::string> pairs;
+    pairs.reserve(unique_ids * 2);
+    for (size_t i = 0; i < unique_ids; i++)
+    {
+        std::string id(32, ' ');
+        for (auto &c : id)
+        {
+            c = characters[generator() % characters.size()];
+        }
+        pairs.push_back(id);
+        pairs.push_back(id);
+    }
+    std::vector<std::string> batch(pairs);
+    batch.insert(batch.end(), pairs.begin(), pairs.end());
+    return batch;
+}
+
+// Run the workers' publish loop and the caller's take, and return operations per second
+template <class Table>
+double run(const std::vector<std::string> &batch, unsigned int thread_count)
+{
+    Table table;
+    const std::string response = "{\"result\":\"Item is in inventory.\"}";
+    std::atomic<size_t> next{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < thread_count; t++)
+    {
+        threads.emplace_back([&]() {
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            // Claim small runs of the batch, as workers pull from the shared queue
+            const size_t run_length = 16;
+            size_t begin;
+            while ((begin = next.fetch_add(run_length, std::memory_order_relaxed)) < batch.size())
+            {
+                size_t end = std::min(begin + run_length, batch.size());
+                for (size_t i = begin; i < end; i++)
+                {
+                    table.publish(batch[i], response);
+                }
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::map<std::string, std::string> taken = table.take();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return batch.size() / elapsed.count();
+}
+
+int main(int argc, char *args[])
+{
+    size_t unique_ids = (argc > 1) ? strtoul(args[1], nullptr, 10) : 250000;
+    std::vector<std::string> batch = make_batch(unique_ids);
+
+    std::cout << "threads,std_map_mutex_ops_per_sec,lookup_table_ops_per_sec,speedup" << std::endl;
+    for (unsigned int threads = 1; threads <= 64; threads *= 2)
+    {
+        double baseline = run<mutex_map_table>(batch, threads);
+        double sharded = run<lookup_table>(batch, threads);
+        std::cout << threads << ","
+                  << std::fixed << std::setprecision(0) << baseline << ","
+                  << sharded << ","
+                  << std::setprecision(2) << sharded / baseline << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,18 @@
+# run_benchmark
+# Author: Jordan Chandler
+
+# Runs one benchmark for the benchmark target, writing its CSV to OUTPUT and
+# echoing it.  ARGUMENTS separates the benchmark's arguments with |.
+#
+# Usage: cmake -DBENCHMARK=program -DOUTPUT=file [-DARGUMENTS=a|b|c] -P run_benchmark.cmake
+
+string(REPLACE "|" ";" arguments "${ARGUMENTS}")
+execute_process(COMMAND ${BENCHMARK} ${arguments}
+                OUTPUT_FILE ${OUTPUT}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${BENCHMARK} failed: ${result}")
+endif()
+file(READ ${OUTPUT} csv)
+message("${csv}")
+message(STATUS "Wrote ${OUTPUT}")
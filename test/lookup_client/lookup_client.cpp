@@ -6,8 +6,14 @@
 #include <limits>
 #include <queue>
 #include <vector>
+#include <mutex>
+#include <chrono>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "lookup_get.cpp"
+#include "lookup_stream.cpp"
 
 std::string random_string()
 {
@@ -40,23 +46,46 @@ void print_error(std::string message)
 
 // Input confirmation message displayed after input is verified
 void print_input(
+    std::ostream &out,
     const std::string url, 
-    unsigned long port, 
+    const std::vector<unsigned long> &ports, 
     std::string authorization_token,
     unsigned int request_count, 
-    unsigned int limit)
+    unsigned int limit,
+    lookup_engine engine,
+    bool stream,
+    unsigned int ceiling,
+    const std::string directory,
+    const std::string segment,
+    const std::string metrics,
+    const std::string input,
+    size_t window,
+    const std::string trace)
 {
-    std::cout << "lookup-client"
+    out << "lookup-client"
               << " -Url "
               << url
-              << " -Port"
-              << port
+              << " -Port";
+    for (size_t p = 0; p < ports.size(); p++)
+    {
+        out << (p ? "," : "") << ports[p];
+    }
+    out
               << " -Authorization"
               << authorization_token
               << " -Requests"
               << request_count
               << " -Limit "
               << limit
+              << " -Engine "
+              << ((engine == lookup_engine::multi) ? "multi" : "threaded")
+              << (stream ? " -Stream" : "")
+              << (ceiling ? " -Ceiling " + std::to_string(ceiling) : "")
+              << (directory.empty() ? "" : " -Directory " + directory)
+              << (segment.empty() ? "" : " -Global " + segment)
+              << (metrics.empty() ? "" : " -Metrics " + metrics)
+              << (input.empty() ? "" : " -Input " + input + " -Window " + std::to_string(window))
+              << (trace.empty() ? "" : " -Trace " + trace)
               << "\n"
               << std::endl;
 }
@@ -65,15 +94,33 @@ void print_input(
 void print_usage()
 {
     std::cout
-        << "lookup_client -Url <url> [-Port port] [-Authorization token] [-Requests count] [-Limit limit]"
+        << "lookup_client -Url <url> [-Port port] [-Authorization token] [-Requests count] [-Limit limit] [-Engine engine] [-Stream] [-Ceiling ceiling] [-Directory directory] [-Global segment] [-Metrics format] [-Input file] [-Window window] [-Trace file]"
         << std::endl
         << std::endl
         << "Items not enclosed enclosed in <> are required.  Items enclosed in [] are optional."
         << "If optional switches are not provided the following defaults are used:" << std::endl
-        << "    [port]:   8080" << std::endl
+        << "    [port]:   8080, or a comma separated list of replicas such as 8081,8082,8083" << std::endl
         << "    [token]:" << std::endl
         << "    [count]:  100" << std::endl
         << "    [limit]:  5" << std::endl
+        << "    [engine]: threaded (one blocking thread per request slot) or multi (single curl multi event loop)" << std::endl
+        << "    [format]: summary (counters and latency percentiles) or prometheus (text exposition format)" << std::endl
+        << "    [window]: 10000" << std::endl
+        << std::endl
+        << "  -Stream prints each response as soon as it is ready instead of after all requests complete." << std::endl
+        << "  Time to first result, total time and peak memory are reported on stderr." << std::endl
+        << "  Several ports spread the requests over replicas of the server, each allowed limit simultaneous" << std::endl
+        << "  requests, ejecting replicas that keep failing.  Requests per replica are reported on stderr." << std::endl
+        << "  -Ceiling adapts the number of simultaneous requests to the server, starting at limit and never" << std::endl
+        << "  exceeding ceiling.  The final limit is reported on stderr." << std::endl
+        << "  -Directory keeps responses in a persistent cache in directory so they survive restarts." << std::endl
+        << "  -Global shares limit request slots and a response cache with every process using the shared" << std::endl
+        << "  memory segment, such as /lookup_get, so together they never exceed limit." << std::endl
+        << "  -Metrics reports the lookup pipeline's counters, gauges and latency histograms on stderr." << std::endl
+        << "  -Input looks up the newline separated ids in file, or /dev/stdin, instead of count random ids," << std::endl
+        << "  writing one JSON line per id to stdout as each completes.  At most window ids are outstanding" << std::endl
+        << "  at a time, so memory stays flat however large the file is.  Throughput is reported on stderr." << std::endl
+        << "  -Trace records a binary trace of every lookup in file, for lookup_replay." << std::endl
         << std::endl
         << "Notes:" << std::endl
         << "  Switches may be abbreviated using the first letter of the switch." << std::endl
@@ -85,15 +132,24 @@ void print_usage()
 int main(int argc, char *args[])
 {
     std::string base_url = "http://localhost/items/";
-    unsigned long port = 8080;
+    std::vector<unsigned long> ports = {8080};
     std::string authorization_token = "";
     unsigned int limit = 5;
     unsigned int request_count = 100;
+    lookup_engine engine = lookup_engine::threaded;
+    bool stream = false;
+    unsigned int ceiling = 0;
+    std::string directory = "";
+    std::string segment = "";
+    std::string metrics = "";
+    std::string input = "";
+    size_t window = 10000;
+    std::string trace = "";
 
-    std::vector<char> switch_letters = {'u', 'p', 'a', 'r', 'l', 'h'};
+    std::vector<char> switch_letters = {'u', 'p', 'a', 'r', 'l', 'e', 's', 'c', 'd', 'g', 'm', 'i', 'w', 't', 'h'};
     std::reverse(switch_letters.begin(), switch_letters.end());
 
-    std::map<char, int> switch_values = {{'u', 1}, {'p', 1}, {'a', 1}, {'r', 1}, {'l', 1}, {'h', 0}};
+    std::map<char, int> switch_values = {{'u', 1}, {'p', 1}, {'a', 1}, {'r', 1}, {'l', 1}, {'e', 1}, {'s', 0}, {'c', 1}, {'d', 1}, {'g', 1}, {'m', 1}, {'i', 1}, {'w', 1}, {'t', 1}, {'h', 0}};
 
     char switch_letter = '\0';
 
@@ -124,7 +180,7 @@ int main(int argc, char *args[])
 
             // Consume the values for this switch
             auto arg_it = switch_values.find(switch_letter);
-            int expected_count = (arg_it == switch_values.end()) ? 0 : arg_it->second;
+            size_t expected_count = (arg_it == switch_values.end()) ? 0 : arg_it->second;
             while ((values.size() < expected_count) && ((((i < argc) ? args[i] : "-")[0]) != '-'))
             {
                 std::string value = args[i];
@@ -178,20 +234,20 @@ int main(int argc, char *args[])
             base_url = values[0];
             break;
         case 'p':
-            number = strtol(values[0].c_str(), &end, 10);
-            if (false)
-            {
-                std::cout << "ERROR The value for switch: [-p] could not be converted to a number."
-                          << std::endl;
-                return EXIT_FAILURE;
-            }
-            if (!is_counting<long>(number) || (number > 65535))
+            ports.clear();
+            end = &values[0][0];
+            do
             {
-                std::cout << "ERROR The value for switch: [-p] was not a valid positive number between 1 and 65535."
-                          << std::endl;
-                return EXIT_FAILURE;
-            }
-            port = number;
+                number = strtol((*end == ',') ? end + 1 : end, &end, 10);
+                if (!is_counting<long>(number) || (number > 65535) || (*end != ',' && *end != '\0'))
+                {
+                    std::cout << "ERROR The value for switch: [-p] was not a valid positive number between 1 and 65535"
+                              << " or a comma separated list of them."
+                              << std::endl;
+                    return EXIT_FAILURE;
+                }
+                ports.push_back(number);
+            } while (*end == ',');
             break;
         case 'a':
             authorization_token = values[0];
@@ -228,6 +284,73 @@ int main(int argc, char *args[])
             }
             limit = number;
             break;
+        case 'e':
+            if (std::tolower(values[0].at(0)) == 'm')
+            {
+                engine = lookup_engine::multi;
+            }
+            else if (std::tolower(values[0].at(0)) == 't')
+            {
+                engine = lookup_engine::threaded;
+            }
+            else
+            {
+                std::cout << "ERROR The value for switch: [-e] must be threaded or multi."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            stream = true;
+            break;
+        case 'c':
+            number = strtol(values[0].c_str(), &end, 10);
+            if (!is_counting<int>(number))
+            {
+                std::cout << "ERROR The value for switch: [-c] was not a valid non-zero positive number."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            ceiling = number;
+            break;
+        case 'd':
+            directory = values[0];
+            break;
+        case 'g':
+            segment = values[0];
+            break;
+        case 'm':
+            if (std::tolower(values[0].at(0)) == 's')
+            {
+                metrics = "summary";
+            }
+            else if (std::tolower(values[0].at(0)) == 'p')
+            {
+                metrics = "prometheus";
+            }
+            else
+            {
+                std::cout << "ERROR The value for switch: [-m] must be summary or prometheus."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            input = values[0];
+            break;
+        case 'w':
+            number = strtol(values[0].c_str(), &end, 10);
+            if (!is_counting<int>(number))
+            {
+                std::cout << "ERROR The value for switch: [-w] was not a valid non-zero positive number."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            window = number;
+            break;
+        case 't':
+            trace = values[0];
+            break;
         case 'h':
             print_usage();
             break;
@@ -241,31 +364,209 @@ int main(int argc, char *args[])
         return EXIT_FAILURE;
     };
 
-    print_input(base_url, port, authorization_token, request_count, limit);
+    int input_fd = -1;
+    if (!input.empty())
+    {
+        input_fd = open(input.c_str(), O_RDONLY);
+        if (input_fd < 0)
+        {
+            std::cout << "ERROR The file for switch: [-i] could not be opened: " << input << "."
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        posix_fadvise(input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // Leave stdout to the results when they are streamed from a file
+    print_input(input.empty() ? std::cout : std::cerr, base_url, ports, authorization_token, request_count, limit,
+                engine, stream, ceiling, directory, segment, metrics, input, window, trace);
 
-    // Simulate a batch of requests
-    std::vector<std::string> requests_1;
-    for (int i = 0; i < request_count; i++)
+    // Simulate a batch of requests unless they are read from a file.
+    // Ids are interned as they are made, so each is stored once however often it repeats.
+    lookup_id_arena requests;
+    if (input.empty())
     {
-        std::string id = random_string();
-        requests_1.push_back(id);
-        // Simulate a closely space duplicate request
-        requests_1.push_back(id);
+        requests.reserve(request_count, 32);
+        for (unsigned int i = 0; i < request_count; i++)
+        {
+            std::string id = random_string();
+            requests.intern(id);
+            // Simulate a closely space duplicate request
+            requests.intern(id);
+        }
+        // Simulate non-closely spaced duplicate requests by repeating the set of requests
+        size_t unique = requests.size();
+        for (size_t i = 0; i < unique; i++)
+        {
+            requests.intern(requests[i]);
+            requests.intern(requests[i]);
+        }
     }
-    // Simulate non-closely spaced duplicate requests by appending to sets of requests
-    std::vector<std::string> requests;
-    requests.insert(requests.end(),requests_1.begin(), requests_1.end());
-    requests.insert(requests.end(),requests_1.begin(), requests_1.end());
 
     // Issue the requests
-    lookup_get *get = new lookup_get();
-    std::map<std::string, std::string> responses = get->request(requests, base_url, port, authorization_token, limit);
+    lookup_options options;
+    options.engine = engine;
+    if (ceiling)
+    {
+        options.limiter.adaptive = true;
+        options.limiter.max_limit = ceiling;
+    }
+    options.disk_cache.directory = directory;
+    options.shared.name = segment;
+    options.trace.path = trace;
+    options.shared.slots = limit;
+    unsigned long port = ports[0];
+    if (ports.size() > 1)
+    {
+        // Requests naming the first replica are spread over all of them
+        options.base_url = base_url;
+        options.port = port;
+        options.authorization_token = authorization_token;
+        for (unsigned long replica_port : ports)
+        {
+            lookup_replica_options replica;
+            replica.base_url = base_url;
+            replica.port = replica_port;
+            replica.authorization_token = authorization_token;
+            replica.max_requests = limit;
+            options.replicas.push_back(replica);
+        }
+    }
+    lookup_get *get = new lookup_get(options);
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point first_result;
+    uint64_t ids_read = 0, bytes_read = 0, lines_written = 0, bytes_written = 0;
+    bool input_failed = false, output_failed = false;
+    if (!input.empty())
+    {
+        // Stream ids from the file and results to stdout, holding at most window ids at a time
+        lookup_id_reader reader(input_fd);
+        lookup_ndjson_writer writer(STDOUT_FILENO);
+        std::once_flag first;
+        get->request_stream([&reader](std::string &id) { return reader.next(id); },
+                            base_url, port, authorization_token, limit, window,
+                            [&](const lookup_result_ptr &result) {
+                                std::call_once(first, [&]() { first_result = std::chrono::steady_clock::now(); });
+                                writer.write(*result);
+                            });
+        writer.flush();
+        close(input_fd);
+        ids_read = reader.ids_read();
+        bytes_read = reader.bytes_read();
+        lines_written = writer.lines_written();
+        bytes_written = writer.bytes_written();
+        input_failed = reader.failed();
+        output_failed = writer.failed();
+    }
+    else if (stream)
+    {
+        // Display each result as it arrives
+        std::mutex output_accessor;
+        bool first = true;
+        get->request_results(requests, base_url, port, authorization_token, limit,
+                             [&](const lookup_result_ptr &result) {
+                                 std::lock_guard<std::mutex> lock(output_accessor);
+                                 if (first)
+                                 {
+                                     first_result = std::chrono::steady_clock::now();
+                                     first = false;
+                                 }
+                                 result->write_json(std::cout);
+                                 std::cout.put('\n');
+                             });
+        std::cout.flush();
+    }
+    else
+    {
+        std::vector<lookup_result_ptr> results = get->request_results(requests, base_url, port, authorization_token, limit);
+        first_result = std::chrono::steady_clock::now();
+
+        // Display the results as newline delimited JSON
+        write_ndjson(std::cout, results);
+        std::cout.flush();
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    // Report latency and memory use
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cerr << "time to first result: "
+              << std::chrono::duration_cast<std::chrono::microseconds>(first_result - start).count() / 1000.0
+              << " ms, total time: "
+              << std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count() / 1000.0
+              << " ms, peak memory: "
+              << usage.ru_maxrss
+              << " KB"
+              << std::endl;
+    if (!input.empty())
+    {
+        double seconds = std::chrono::duration<double>(finish - start).count();
+        std::cerr << "throughput: "
+                  << ids_read << " ids and " << bytes_read << " bytes read, "
+                  << lines_written << " lines and " << bytes_written << " bytes written, "
+                  << (uint64_t)(seconds > 0 ? ids_read / seconds : 0) << " ids/s, "
+                  << (seconds > 0 ? bytes_written / seconds / (1024 * 1024) : 0) << " MB/s out"
+                  << std::endl;
+        if (input_failed)
+        {
+            std::cerr << "ERROR Reading " << input << " failed before its end." << std::endl;
+        }
+        if (output_failed)
+        {
+            std::cerr << "ERROR Writing the results failed; later results were discarded." << std::endl;
+        }
+    }
+    if (ceiling)
+    {
+        std::cerr << "adapted limit: "
+                  << get->request_limit()
+                  << std::endl;
+    }
+    for (const auto &replica : get->replica_stats())
+    {
+        std::cerr << "replica " << replica.port << ": "
+                  << replica.requests << " requests, "
+                  << replica.failures << " failures, "
+                  << replica.rate_limited << " rate limited, "
+                  << replica.ejections << " ejections"
+                  << (replica.ejected ? ", ejected" : "")
+                  << std::endl;
+    }
+    if (!directory.empty())
+    {
+        lookup_disk_cache_stats disk = get->disk_cache_stats();
+        std::cerr << "disk cache: "
+                  << disk.hits << " hits, "
+                  << disk.misses << " misses, "
+                  << disk.entries << " entries, "
+                  << disk.log_bytes << " log bytes, "
+                  << disk.recovered << " recovered, "
+                  << disk.truncated_bytes << " truncated bytes"
+                  << std::endl;
+    }
+    if (!segment.empty())
+    {
+        lookup_shared_stats shared = get->shared_stats();
+        std::cerr << "shared segment: "
+                  << shared.held << " of " << shared.slots << " slots held, "
+                  << shared.hits << " hits, "
+                  << shared.misses << " misses, "
+                  << shared.insertions << " insertions, "
+                  << shared.reclaimed << " reclaimed slots"
+                  << std::endl;
+    }
 
-    // Display the results
-    for (auto response : responses)
+    if (metrics == "summary")
     {
-        std::cout << response.second << std::endl;
+        get->metrics().write_summary(std::cerr);
     }
+    else if (metrics == "prometheus")
+    {
+        get->metrics().write_prometheus(std::cerr);
+    }
+
+    // Flushes responses still queued for the disk cache
+    delete get;
 
-    return EXIT_SUCCESS;
+    return (input_failed || output_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
\ No newline at end of file
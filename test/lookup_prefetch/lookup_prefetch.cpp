@@ -0,0 +1,83 @@
+// lookup_prefetch
+// Author: Jordan Chandler
+
+// Test that prefetches only use idle request slots on the threaded engine.
+//
+// A large prefetch is queued on an instance with an adaptive limiter, whose
+// workers outnumber its request slots, and interactive lookups are then made
+// one after another while the prefetch is still being requested.  Every
+// request is answered in process by lookup_fake_transport after a fixed
+// latency.  An interactive lookup may wait for one request to free its slot
+// and then takes its own, so it must complete within two latencies, plus a
+// latency of slack for the test host's scheduling.  A worker that held a
+// prefetched id while it waited for a slot would put the interactive lookup
+// behind every such id instead.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_prefetch.cpp -lpthread -lcurl -lz -lrt -o lookup_prefetch
+//
+// Usage: lookup_prefetch [prefetched ids] [interactive lookups] [latency ms]
+//
+// Prints each interactive lookup's time and exits with failure if any took too long
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+
+#include "lookup_get.cpp"
+
+int main(int argc, char *args[])
+{
+    size_t prefetched = (argc > 1) ? strtoul(args[1], nullptr, 10) : 1000;
+    size_t lookups = (argc > 2) ? strtoul(args[2], nullptr, 10) : 10;
+    std::chrono::milliseconds latency((argc > 3) ? strtoul(args[3], nullptr, 10) : 50);
+
+    lookup_options options;
+    options.base_url = "http://prefetch/";
+    options.max_requests = 2;
+    options.limiter.adaptive = true;
+    lookup_fake_options fake;
+    fake.latency = latency;
+    basic_lookup_get<lookup_cache, lookup_scheduler, lookup_limiter, lookup_fake_transport> lookup(options, fake);
+
+    std::vector<std::string> ids;
+    ids.reserve(prefetched);
+    for (size_t i = 0; i < prefetched; i++)
+    {
+        ids.push_back("prefetch" + std::to_string(i));
+    }
+    lookup.prefetch(ids);
+
+    // Let the prefetch fill every slot
+    std::this_thread::sleep_for(latency / 2);
+
+    auto allowed = latency * 3;
+    size_t slow = 0;
+    for (size_t i = 0; i < lookups; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        lookup_result_ptr result = lookup.submit("interactive" + std::to_string(i)).get();
+        auto took = std::chrono::steady_clock::now() - start;
+        bool too_long = took > allowed || !result || result->status != 200;
+        slow += too_long ? 1 : 0;
+        std::cout << "interactive " << i << ": "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(took).count() << " ms"
+                  << (too_long ? " - too long" : "") << std::endl;
+    }
+
+    // The lookups only show something if the prefetch was still being requested
+    if (lookup.scheduler_stats().queued == 0)
+    {
+        std::cout << "the prefetch finished before the interactive lookups, use more ids" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (slow != 0)
+    {
+        std::cout << slow << " of " << lookups << " interactive lookups took longer than "
+                  << allowed.count() << " ms" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
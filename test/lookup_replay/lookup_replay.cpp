@@ -0,0 +1,334 @@
+// lookup_replay
+// Author: Jordan Chandler
+
+// Deterministic replay of a lookup trace (lookup_trace.cpp), to measure a
+// build against a recorded workload rather than lookup_client's synthetic one.
+//
+// play drives a fresh lookup_get with the trace's calls, each submitted at
+// its recorded offset from the start, so the duplicate ratio, the bursts and
+// the gaps between them are those of the recording.  Calls are replayed open
+// loop through submit() and prefetch(), in their recorded priority class,
+// whatever call made them originally.  Ids are named by their hashes, and
+// each id is answered with the status, server latency and payload size of
+// its first recorded answer:
+//   - by lookup_fake_transport, in process, when no server is given.  Only
+//     the threaded engine can drive it.
+//   - by a running lookup_server otherwise, which is asked to take the
+//     recorded time through a ?time= query.  The server decides the status
+//     and the payload.
+// The replayed run records a trace of its own, which play summarizes and
+// compare sets against another run's, so two builds are compared by playing
+// the same trace with each and comparing their outputs.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_replay.cpp -lpthread -lcurl -lz -lrt -o lookup_replay
+//
+// Usage: lookup_replay summary trace
+//        lookup_replay play trace output_trace [limit] [engine t|m] [base_url port authorization_token]
+//        lookup_replay compare baseline_trace candidate_trace
+//   e.g. lookup_replay play production.trace candidate.trace 5 t http://localhost/items/ 8080 Y1JGMmR2RFpRc211MzdXR2dLNk1UY0w3WGpl
+//
+// Prints CSV: metric,value, or for compare metric,baseline,candidate,change_percent
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+
+#include "lookup_get.cpp"
+
+// Ids one call asked for, in the order it asked for them
+struct replay_call
+{
+    uint64_t submitted = UINT64_MAX;
+    unsigned int priority = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> ids;
+};
+
+// How the server answered an id
+struct replay_answer
+{
+    long status = 200;
+    std::chrono::microseconds latency{0};
+    size_t payload_bytes = 0;
+};
+
+// A trace's calls, ordered by when they were made, and the answer for each id
+struct replay_workload
+{
+    std::vector<replay_call> calls;
+    std::unordered_map<uint64_t, replay_answer> answers;
+    replay_answer fallback;
+};
+
+static std::string id_of(uint64_t hash)
+{
+    char id[17];
+    snprintf(id, sizeof(id), "%016llx", (unsigned long long)hash);
+    return id;
+}
+
+template <typename T>
+static T median(std::vector<T> values)
+{
+    if (values.empty())
+    {
+        return T();
+    }
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+static replay_workload load_workload(const std::vector<lookup_trace_record> &records)
+{
+    replay_workload workload;
+    std::map<uint32_t, replay_call> calls;
+    std::vector<std::chrono::microseconds> latencies;
+    std::vector<size_t> payloads;
+    for (const auto &record : records)
+    {
+        replay_call &call = calls[record.call];
+        call.submitted = std::min(call.submitted, record.submitted);
+        call.priority = record.priority();
+        call.ids.emplace_back(record.submitted, record.id_hash);
+
+        bool answered = record.source() != lookup_trace_source::cached && record.outcome == (uint8_t)lookup_outcome::completed;
+        if (answered && workload.answers.find(record.id_hash) == workload.answers.end())
+        {
+            replay_answer &answer = workload.answers[record.id_hash];
+            answer.status = record.status;
+            answer.latency = std::chrono::microseconds(record.latency);
+            answer.payload_bytes = record.payload_bytes;
+            latencies.push_back(answer.latency);
+            payloads.push_back(answer.payload_bytes);
+        }
+    }
+
+    // Ids answered before the trace started get a typical answer
+    workload.fallback.latency = median(latencies);
+    workload.fallback.payload_bytes = median(payloads);
+
+    for (auto &entry : calls)
+    {
+        std::stable_sort(entry.second.ids.begin(), entry.second.ids.end(),
+                         [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b) { return a.first < b.first; });
+        workload.calls.push_back(std::move(entry.second));
+    }
+    std::stable_sort(workload.calls.begin(), workload.calls.end(),
+                     [](const replay_call &a, const replay_call &b) { return a.submitted < b.submitted; });
+    return workload;
+}
+
+static const replay_answer &answer_for(const replay_workload &workload, uint64_t hash)
+{
+    auto it = workload.answers.find(hash);
+    return (it == workload.answers.end()) ? workload.fallback : it->second;
+}
+
+// Submit every call at its recorded offset and wait for all of them
+template <typename Lookup>
+static void play(Lookup &lookup, const replay_workload &workload, bool timed_ids)
+{
+    std::vector<lookup_future> futures;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &call : workload.calls)
+    {
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(call.submitted));
+        std::vector<std::string> ids;
+        ids.reserve(call.ids.size());
+        for (const auto &id : call.ids)
+        {
+            ids.push_back(id_of(id.second));
+            if (timed_ids)
+            {
+                ids.back().append("?time=").append(std::to_string(answer_for(workload, id.second).latency.count()));
+            }
+        }
+        if (call.priority == (unsigned int)lookup_priority::prefetch)
+        {
+            lookup.prefetch(ids);
+            continue;
+        }
+        lookup_dispatch dispatch;
+        dispatch.priority = (lookup_priority)call.priority;
+        for (auto &future : lookup.submit(ids, dispatch))
+        {
+            futures.push_back(std::move(future));
+        }
+    }
+    for (auto &future : futures)
+    {
+        future.wait();
+    }
+}
+
+// The figures compared between two traces, in order
+static std::vector<std::pair<std::string, double>> summarize(const std::vector<lookup_trace_record> &records)
+{
+    std::vector<double> completed, slot_wait, latency;
+    uint64_t first = UINT64_MAX, last = 0;
+    size_t sources[3] = {};
+    size_t failed = 0;
+    uint32_t calls = 0;
+    for (const auto &record : records)
+    {
+        first = std::min(first, record.submitted);
+        last = std::max<uint64_t>(last, record.submitted + record.completed * 1000ULL);
+        sources[(size_t)record.source()]++;
+        calls = std::max(calls, record.call + 1);
+        failed += (record.status != 200) ? 1 : 0;
+        completed.push_back(record.completed / 1000.0);
+        if (record.source() == lookup_trace_source::requested)
+        {
+            slot_wait.push_back(record.slot_wait / 1000.0);
+            latency.push_back(record.latency / 1000.0);
+        }
+    }
+    for (auto *values : {&completed, &slot_wait, &latency})
+    {
+        std::sort(values->begin(), values->end());
+    }
+    auto percentile = [](const std::vector<double> &sorted, double q) {
+        return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+    };
+    double seconds = records.empty() ? 0.0 : (last - first) / 1e9;
+
+    return {{"lookups", (double)records.size()},
+            {"calls", (double)calls},
+            {"requested", (double)sources[(size_t)lookup_trace_source::requested]},
+            {"joined", (double)sources[(size_t)lookup_trace_source::joined]},
+            {"cached", (double)sources[(size_t)lookup_trace_source::cached]},
+            {"not_ok", (double)failed},
+            {"seconds", seconds},
+            {"lookups_per_second", seconds > 0 ? records.size() / seconds : 0.0},
+            {"completed_p50_ms", percentile(completed, 0.5)},
+            {"completed_p90_ms", percentile(completed, 0.9)},
+            {"completed_p99_ms", percentile(completed, 0.99)},
+            {"completed_max_ms", completed.empty() ? 0.0 : completed.back()},
+            {"slot_wait_p50_ms", percentile(slot_wait, 0.5)},
+            {"slot_wait_p99_ms", percentile(slot_wait, 0.99)},
+            {"latency_p50_ms", percentile(latency, 0.5)},
+            {"latency_p99_ms", percentile(latency, 0.99)}};
+}
+
+static bool read_trace(const std::string &path, std::vector<lookup_trace_record> &records)
+{
+    if (!lookup_read_trace(path, records))
+    {
+        std::cerr << "cannot read the trace " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static void print_summary(const std::vector<lookup_trace_record> &records)
+{
+    std::cout << "metric,value" << std::endl
+              << std::fixed << std::setprecision(3);
+    for (const auto &figure : summarize(records))
+    {
+        std::cout << figure.first << "," << figure.second << std::endl;
+    }
+}
+
+static void usage()
+{
+    std::cerr << "Usage: lookup_replay summary trace" << std::endl
+              << "       lookup_replay play trace output_trace [limit] [engine t|m] [base_url port authorization_token]" << std::endl
+              << "       lookup_replay compare baseline_trace candidate_trace" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string mode = (argc > 1) ? argv[1] : "";
+    std::vector<lookup_trace_record> records;
+    if (mode == "summary" && argc == 3)
+    {
+        if (!read_trace(argv[2], records))
+        {
+            return EXIT_FAILURE;
+        }
+        print_summary(records);
+        return EXIT_SUCCESS;
+    }
+
+    if (mode == "compare" && argc == 4)
+    {
+        std::vector<lookup_trace_record> candidate;
+        if (!read_trace(argv[2], records) || !read_trace(argv[3], candidate))
+        {
+            return EXIT_FAILURE;
+        }
+        auto baseline_figures = summarize(records);
+        auto candidate_figures = summarize(candidate);
+        std::cout << "metric,baseline,candidate,change_percent" << std::endl
+                  << std::fixed << std::setprecision(3);
+        for (size_t i = 0; i < baseline_figures.size(); i++)
+        {
+            double before = baseline_figures[i].second;
+            double after = candidate_figures[i].second;
+            std::cout << baseline_figures[i].first << "," << before << "," << after << ",";
+            if (before != 0)
+            {
+                std::cout << std::setprecision(1) << (after - before) * 100 / before << std::setprecision(3);
+            }
+            std::cout << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (mode != "play" || (argc != 4 && argc != 5 && argc != 6 && argc != 9))
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (!read_trace(argv[2], records))
+    {
+        return EXIT_FAILURE;
+    }
+    replay_workload workload = load_workload(records);
+
+    lookup_options options;
+    options.trace.path = argv[3];
+    options.max_requests = (argc > 4) ? (unsigned int)std::strtoul(argv[4], NULL, 10) : 5;
+    options.engine = (argc > 5 && argv[5][0] == 'm') ? lookup_engine::multi : lookup_engine::threaded;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (argc == 9)
+    {
+        options.base_url = argv[6];
+        options.port = std::strtoul(argv[7], NULL, 10);
+        options.authorization_token = argv[8];
+        lookup_get lookup(options);
+        play(lookup, workload, true);
+    }
+    else
+    {
+        lookup_fake_options fake;
+        fake.respond = [&workload](std::string_view id, lookup_fake_response &response) {
+            const replay_answer &answer = answer_for(workload, std::strtoull(std::string(id).c_str(), nullptr, 16));
+            response.status = answer.status;
+            response.latency = answer.latency;
+            response.payload.assign(answer.payload_bytes, ' ');
+        };
+        options.base_url = "http://replay/";
+        basic_lookup_get<lookup_cache, lookup_scheduler, lookup_limiter, lookup_fake_transport> lookup(options, fake);
+        play(lookup, workload, false);
+    }
+    curl_global_cleanup();
+
+    // The instance is gone, so its trace is complete
+    if (!read_trace(options.trace.path, records))
+    {
+        return EXIT_FAILURE;
+    }
+    print_summary(records);
+    return EXIT_SUCCESS;
+}
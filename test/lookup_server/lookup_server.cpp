@@ -0,0 +1,934 @@
+// lookup_server
+// Author: Jordan Chandler
+
+// Native stand-in for lookup_server.js that can outrun the clients it tests.
+//
+// Serves the same routes with the same rules: GET /items/:id answers 200 with
+// a JSON item after the processing time, or 404 without an id; a request
+// arriving while limit requests are in progress is answered 429 at once; a
+// wrong Authorization header is answered 403; PUT /limit/:n changes the limit
+// and GET /stats reports it with the accepted and rejected counts.
+//
+// Each of several threads runs its own epoll loop on its own SO_REUSEPORT
+// listening socket, so the kernel spreads connections over the threads and no
+// lock is taken per request.  Processing time is a timer in the owning
+// thread's loop rather than a sleeping thread.  On top of lookup_server.js's
+// fixed processing time it can draw each request's time from a distribution,
+// pad the payload, inject 500 errors and 429s at random, and close or drop
+// connections, so client benchmarks are limited by the client.
+//
+// A request for /items/:id?time=us is processed for us microseconds instead
+// of a drawn time, so lookup_replay can play back recorded server latencies.
+//
+// Padded items are stock records generated from the id, the same ones
+// lookup_server.js generates, so they compress like real JSON rather than
+// like a run of one character.  With --compress, items are sent gzip or
+// deflate encoded when the request's Accept-Encoding allows it.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 lookup_server.cpp -lpthread -lz -o lookup_server
+//
+// Usage: lookup_server -a token [options]
+//   -p, --port n            TCP port (8080)
+//   -r, --route path        route served (/items/)
+//   -a, --authorization t   expected Authorization header (required)
+//   -t, --time ms           processing time of each request (0)
+//   -d, --distribution d    fixed, uniform (0 to 2 x time), exponential (mean time)
+//                           or lognormal (median time) (fixed)
+//   -s, --sigma x           shape of the lognormal distribution (1.0)
+//       --slow-rate p       share of requests taking --slow-time instead (0)
+//       --slow-time ms      processing time of slow requests (1000)
+//   -l, --limit n           simultaneous requests before answering 429 (5)
+//   -b, --payload-bytes n   pad 200 responses to about n bytes of stock records (unpadded)
+//   -z, --compress          gzip or deflate items for clients that accept it
+//   -e, --error-rate p      share of requests answered 500 (0)
+//   -q, --reject-rate p     share of requests answered 429 regardless of the limit (0)
+//   -c, --close-rate p      share of responses that close the connection (0)
+//   -x, --drop-rate p       share of requests whose connection is closed unanswered (0)
+//   -w, --threads n         event loop threads (hardware threads)
+//       --seed n            seed of the random choices (random)
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+enum class latency_distribution
+{
+    fixed,
+    uniform,
+    exponential,
+    lognormal
+};
+
+struct server_options
+{
+    unsigned short port = 8080;
+    std::string route = "items";
+    std::string authorization_token;
+    double time_ms = 0;
+    latency_distribution distribution = latency_distribution::fixed;
+    double sigma = 1.0;
+    double slow_rate = 0;
+    double slow_time_ms = 1000;
+    size_t payload_bytes = 0;
+    bool compress = false;
+    double error_rate = 0;
+    double reject_rate = 0;
+    double close_rate = 0;
+    double drop_rate = 0;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t seed = std::random_device{}();
+};
+
+// Counters and limit shared by every thread
+struct server_state
+{
+    std::atomic<long> limit{5};
+    std::atomic<long> in_progress{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+enum class content_encoding
+{
+    identity,
+    gzip,
+    deflate
+};
+
+// One client connection, owned by the thread that accepted it
+struct connection
+{
+    int fd;
+    std::string in;
+    std::string out;
+    size_t written = 0;
+
+    // A request is being processed and the connection reads no further requests
+    bool busy = false;
+    // The request holds one of the limit's slots until it is answered
+    bool holds_slot = false;
+    // Close once the response is written
+    bool closing = false;
+    // The item named by the request being processed, if it named one
+    bool found = false;
+    std::string item_id;
+    // Content encoding the request being processed accepts for its item
+    content_encoding encoding = content_encoding::identity;
+    // Guards timers of a previous request or connection on the same descriptor
+    uint64_t generation = 0;
+};
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool header_is(const std::string &line, size_t colon, const char *name)
+{
+    return colon == strlen(name) && strncasecmp(line.data(), name, colon) == 0;
+}
+
+// The encoding to send an item in given a request's Accept-Encoding header.
+// Quality values are not weighed; an encoding listed at all is accepted.
+static content_encoding accepted_encoding(const std::string &value)
+{
+    if (strcasestr(value.c_str(), "gzip"))
+    {
+        return content_encoding::gzip;
+    }
+    if (strcasestr(value.c_str(), "deflate"))
+    {
+        return content_encoding::deflate;
+    }
+    return content_encoding::identity;
+}
+
+// An item of about payload_bytes bytes for id: stock records whose values
+// are drawn from a generator seeded with the id's FNV-1a hash, computed
+// exactly as lookup_server.js does
+static std::string padded_item(const std::string &id, size_t payload_bytes)
+{
+    static const char *warehouses[] = {"north", "south", "east", "west", "central", "harbor", "airport", "depot"};
+    uint32_t state = 2166136261u;
+    for (unsigned char c : id)
+    {
+        state = (state ^ c) * 16777619u;
+    }
+    if (state == 0)
+    {
+        state = 1;
+    }
+    auto next = [&state]() {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+
+    std::string item = "{\"result\":\"Item is in inventory.\",\"id\":\"" + id + "\",\"stock\":[";
+    char record[128];
+    bool first = true;
+    while (item.size() + 2 < payload_bytes)
+    {
+        uint32_t sku = next();
+        const char *warehouse = warehouses[next() % 8];
+        uint32_t quantity = next() % 1000;
+        int length = snprintf(record, sizeof(record), "%s{\"sku\":\"%08x\",\"warehouse\":\"%s\",\"quantity\":%u}",
+                              first ? "" : ",", sku, warehouse, quantity);
+        item.append(record, length);
+        first = false;
+    }
+    item += "]}";
+    return item;
+}
+
+static const char *reason(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 429:
+        return "Too Many Requests";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+class event_loop
+{
+public:
+    event_loop(const server_options &options, server_state &state, unsigned int index)
+        : options(options), state(state), random(options.seed + index)
+    {
+        item = "{\"result\":\"Item is in inventory.\"}";
+    }
+
+    ~event_loop()
+    {
+        for (auto &entry : deflaters)
+        {
+            if (entry.second)
+            {
+                deflateEnd(&entry.first);
+            }
+        }
+        for (auto &entry : connections)
+        {
+            close(entry.first);
+        }
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        if (epoll >= 0)
+        {
+            close(epoll);
+        }
+    }
+
+    // Listen on the port alongside the other threads, over IPv6 and IPv4 as
+    // node does, or IPv4 alone where IPv6 is unavailable
+    bool open()
+    {
+        epoll = epoll_create1(0);
+        if (epoll < 0 || !(listen_on(AF_INET6) || listen_on(AF_INET)))
+        {
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listener;
+        return epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) == 0;
+    }
+
+    void run(const std::atomic<bool> &stopping)
+    {
+        epoll_event events[256];
+        while (!stopping.load(std::memory_order_relaxed))
+        {
+            int count = epoll_wait(epoll, events, 256, timeout_ms());
+            for (int i = 0; i < count; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == listener)
+                {
+                    accept_all();
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                {
+                    continue;
+                }
+                connection &c = *it->second;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    drop(c);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !flush(c))
+                {
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    receive(c);
+                }
+                else
+                {
+                    // A response finished writing; go on with requests already read
+                    handle_requests(c);
+                }
+            }
+            fire_timers();
+        }
+    }
+
+private:
+    bool listen_on(int family)
+    {
+        listener = socket(family, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            return false;
+        }
+        int one = 1, zero = 0;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        sockaddr_storage address{};
+        socklen_t length;
+        if (family == AF_INET6)
+        {
+            setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+            sockaddr_in6 &v6 = (sockaddr_in6 &)address;
+            v6.sin6_family = AF_INET6;
+            v6.sin6_addr = in6addr_any;
+            v6.sin6_port = htons(options.port);
+            length = sizeof(v6);
+        }
+        else
+        {
+            sockaddr_in &v4 = (sockaddr_in &)address;
+            v4.sin_family = AF_INET;
+            v4.sin_addr.s_addr = htonl(INADDR_ANY);
+            v4.sin_port = htons(options.port);
+            length = sizeof(v4);
+        }
+        if (bind(listener, (sockaddr *)&address, length) != 0 || listen(listener, 1024) != 0 ||
+            !set_nonblocking(listener))
+        {
+            close(listener);
+            listener = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // A response due once its processing time has passed
+    struct timer
+    {
+        std::chrono::steady_clock::time_point due;
+        int fd;
+        uint64_t generation;
+
+        bool operator>(const timer &other) const
+        {
+            return due > other.due;
+        }
+    };
+
+    int timeout_ms()
+    {
+        if (timers.empty())
+        {
+            return 100;
+        }
+        auto until = std::chrono::duration_cast<std::chrono::milliseconds>(timers.top().due - std::chrono::steady_clock::now());
+        return (int)std::max<long long>(0, std::min<long long>(100, until.count() + 1));
+    }
+
+    void accept_all()
+    {
+        while (true)
+        {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0)
+            {
+                return;
+            }
+            set_nonblocking(fd);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<connection> c(new connection());
+            c->fd = fd;
+            c->generation = ++generations;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+            connections[fd] = std::move(c);
+        }
+    }
+
+    // Close a connection, giving back the slot of a request it abandoned
+    void drop(connection &c)
+    {
+        if (c.holds_slot)
+        {
+            state.in_progress.fetch_sub(1, std::memory_order_relaxed);
+        }
+        epoll_ctl(epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        connections.erase(c.fd);
+    }
+
+    void receive(connection &c)
+    {
+        char buffer[16 * 1024];
+        while (true)
+        {
+            ssize_t count = read(c.fd, buffer, sizeof(buffer));
+            if (count > 0)
+            {
+                c.in.append(buffer, count);
+                continue;
+            }
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                drop(c);
+                return;
+            }
+            break;
+        }
+        handle_requests(c);
+    }
+
+    // Handle buffered requests one at a time, in order
+    void handle_requests(connection &c)
+    {
+        while (!c.busy && c.out.empty())
+        {
+            size_t end = c.in.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                return;
+            }
+
+            // Request line and the headers that matter
+            std::string method, path, version, authorization;
+            content_encoding encoding = content_encoding::identity;
+            bool keep_alive = true;
+            size_t content_length = 0;
+            size_t line_end = c.in.find("\r\n");
+            {
+                std::string line = c.in.substr(0, line_end);
+                size_t first = line.find(' ');
+                size_t second = line.find(' ', first + 1);
+                method = line.substr(0, first);
+                path = line.substr(first + 1, second - first - 1);
+                version = (second == std::string::npos) ? "" : line.substr(second + 1);
+                keep_alive = (version != "HTTP/1.0");
+            }
+            size_t position = line_end + 2;
+            while (position < end)
+            {
+                size_t next = c.in.find("\r\n", position);
+                std::string line = c.in.substr(position, next - position);
+                position = next + 2;
+                size_t colon = line.find(':');
+                if (colon == std::string::npos)
+                {
+                    continue;
+                }
+                size_t value_start = line.find_first_not_of(' ', colon + 1);
+                std::string value = (value_start == std::string::npos) ? "" : line.substr(value_start);
+                if (header_is(line, colon, "authorization"))
+                {
+                    authorization = value;
+                }
+                else if (header_is(line, colon, "connection"))
+                {
+                    keep_alive = strncasecmp(value.c_str(), "close", 5) != 0 &&
+                                 (version != "HTTP/1.0" || strncasecmp(value.c_str(), "keep-alive", 10) == 0);
+                }
+                else if (header_is(line, colon, "content-length"))
+                {
+                    content_length = strtoul(value.c_str(), nullptr, 10);
+                }
+                else if (header_is(line, colon, "accept-encoding") && options.compress)
+                {
+                    encoding = accepted_encoding(value);
+                }
+            }
+            if (c.in.size() < end + 4 + content_length)
+            {
+                return;
+            }
+            c.in.erase(0, end + 4 + content_length);
+            c.closing = !keep_alive;
+            c.encoding = encoding;
+
+            // A time=us query sets the request's processing time
+            long long time_us = -1;
+            size_t query = path.find('?');
+            if (query != std::string::npos)
+            {
+                size_t time = path.find("time=", query);
+                if (time != std::string::npos && (path[time - 1] == '?' || path[time - 1] == '&'))
+                {
+                    time_us = strtoll(path.c_str() + time + 5, nullptr, 10);
+                }
+                path.erase(query);
+            }
+            std::vector<std::string> parts;
+            size_t start = 0;
+            while (true)
+            {
+                size_t slash = path.find('/', start);
+                parts.push_back(path.substr(start, slash - start));
+                if (slash == std::string::npos)
+                {
+                    break;
+                }
+                start = slash + 1;
+            }
+            if (!handle(c, method, parts, authorization, time_us))
+            {
+                return;
+            }
+        }
+    }
+
+    // Answer or schedule one request, processed for time_us if it is not negative.
+    // Returns false if the connection was dropped.
+    bool handle(connection &c, const std::string &method, const std::vector<std::string> &parts,
+                const std::string &authorization, long long time_us)
+    {
+        // Change the simultaneous request limit - PUT /limit/:n
+        if (method == "PUT" && parts.size() > 2 && parts[1] == "limit")
+        {
+            long limit = strtol(parts[2].c_str(), nullptr, 10);
+            if (limit <= 0)
+            {
+                return respond(c, 400, "");
+            }
+            state.limit.store(limit);
+            return respond(c, 200, "{\"limit\":" + std::to_string(limit) + "}");
+        }
+
+        // Report request counters - GET /stats
+        if (method == "GET" && parts.size() > 1 && parts[1] == "stats")
+        {
+            return respond(c, 200, "{\"limit\":" + std::to_string(state.limit.load()) +
+                                       ",\"accepted\":" + std::to_string(state.accepted.load()) +
+                                       ",\"rejected\":" + std::to_string(state.rejected.load()) +
+                                       ",\"errors\":" + std::to_string(state.errors.load()) +
+                                       ",\"dropped\":" + std::to_string(state.dropped.load()) + "}");
+        }
+
+        // Ignore non-route queries - return status NOT FOUND
+        if (parts.size() < 2 || parts[1] != options.route)
+        {
+            return respond(c, 404, "");
+        }
+
+        // Limit simultaneous requests - return status TOO MANY REQUESTS
+        if (state.in_progress.fetch_add(1, std::memory_order_relaxed) >= state.limit.load(std::memory_order_relaxed) ||
+            chance(options.reject_rate))
+        {
+            state.in_progress.fetch_sub(1, std::memory_order_relaxed);
+            state.rejected.fetch_add(1, std::memory_order_relaxed);
+            return respond(c, 429, "");
+        }
+
+        // Verify the authorization header
+        if (authorization != options.authorization_token)
+        {
+            state.in_progress.fetch_sub(1, std::memory_order_relaxed);
+            return respond(c, 403, "");
+        }
+
+        state.accepted.fetch_add(1, std::memory_order_relaxed);
+        c.holds_slot = true;
+        c.busy = true;
+        c.found = parts.size() > 2 && !parts[2].empty();
+        if (c.found)
+        {
+            c.item_id = parts[2];
+        }
+        std::chrono::microseconds time = (time_us >= 0) ? std::chrono::microseconds(time_us) : processing_time();
+        timers.push(timer{std::chrono::steady_clock::now() + time, c.fd, c.generation});
+        return true;
+    }
+
+    bool chance(double rate)
+    {
+        return rate > 0 && std::uniform_real_distribution<double>(0, 1)(random) < rate;
+    }
+
+    std::chrono::microseconds processing_time()
+    {
+        double ms = options.time_ms;
+        if (chance(options.slow_rate))
+        {
+            ms = options.slow_time_ms;
+        }
+        else if (ms > 0)
+        {
+            switch (options.distribution)
+            {
+            case latency_distribution::uniform:
+                ms = std::uniform_real_distribution<double>(0, 2 * ms)(random);
+                break;
+            case latency_distribution::exponential:
+                ms = std::exponential_distribution<double>(1 / ms)(random);
+                break;
+            case latency_distribution::lognormal:
+                ms = std::lognormal_distribution<double>(std::log(ms), options.sigma)(random);
+                break;
+            case latency_distribution::fixed:
+                break;
+            }
+        }
+        return std::chrono::microseconds((long long)(ms * 1000));
+    }
+
+    // Answer requests whose processing time has passed
+    void fire_timers()
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.top().due <= now)
+        {
+            timer t = timers.top();
+            timers.pop();
+            auto it = connections.find(t.fd);
+            if (it == connections.end() || it->second->generation != t.generation || !it->second->busy)
+            {
+                continue;
+            }
+            connection &c = *it->second;
+            c.busy = false;
+            c.holds_slot = false;
+            state.in_progress.fetch_sub(1, std::memory_order_relaxed);
+
+            if (chance(options.drop_rate))
+            {
+                state.dropped.fetch_add(1, std::memory_order_relaxed);
+                drop(c);
+                continue;
+            }
+            if (chance(options.error_rate))
+            {
+                state.errors.fetch_add(1, std::memory_order_relaxed);
+                if (!respond(c, 500, ""))
+                {
+                    continue;
+                }
+            }
+            else if (!(c.found ? respond_item(c) : respond(c, 404, "")))
+            {
+                continue;
+            }
+            handle_requests(c);
+        }
+    }
+
+    // Answer with the requested item, encoded as the request allows
+    bool respond_item(connection &c)
+    {
+        std::string body = (options.payload_bytes > item.size()) ? padded_item(c.item_id, options.payload_bytes) : item;
+        if (c.encoding != content_encoding::identity && compress(c.encoding, body))
+        {
+            return respond(c, 200, body, (c.encoding == content_encoding::gzip) ? "gzip" : "deflate");
+        }
+        return respond(c, 200, body);
+    }
+
+    // Replace body with its gzip or zlib (HTTP deflate) encoding.  Each
+    // format's stream is set up once per thread and reset between bodies.
+    bool compress(content_encoding encoding, std::string &body)
+    {
+        std::pair<z_stream, bool> &deflater = deflaters[encoding == content_encoding::gzip ? 0 : 1];
+        if (!deflater.second)
+        {
+            deflater.first = z_stream();
+            int window_bits = (encoding == content_encoding::gzip) ? MAX_WBITS + 16 : MAX_WBITS;
+            deflater.second = deflateInit2(&deflater.first, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+                                           Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+        z_stream &stream = deflater.first;
+        if (!deflater.second || deflateReset(&stream) != Z_OK)
+        {
+            return false;
+        }
+        std::string encoded(deflateBound(&stream, (uLong)body.size()), '\0');
+        stream.next_in = (Bytef *)body.data();
+        stream.avail_in = (uInt)body.size();
+        stream.next_out = (Bytef *)&encoded[0];
+        stream.avail_out = (uInt)encoded.size();
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        {
+            return false;
+        }
+        encoded.resize(stream.total_out);
+        body.swap(encoded);
+        return true;
+    }
+
+    // Queue a response and start writing it.  Returns false if the connection was dropped.
+    bool respond(connection &c, int status, const std::string &body, const char *encoding = nullptr)
+    {
+        if (chance(options.close_rate))
+        {
+            c.closing = true;
+        }
+        c.out = "HTTP/1.1 " + std::to_string(status) + " " + reason(status) +
+                "\r\nContent-Type: text/json\r\nContent-Length: " + std::to_string(body.size()) +
+                (options.compress ? "\r\nVary: Accept-Encoding" : "") +
+                (encoding ? std::string("\r\nContent-Encoding: ") + encoding : std::string()) +
+                (c.closing ? "\r\nConnection: close" : "") + "\r\n\r\n" + body;
+        c.written = 0;
+        return flush(c);
+    }
+
+    // Write as much of the pending response as the socket takes.
+    // Returns false if the connection was dropped.
+    bool flush(connection &c)
+    {
+        while (c.written < c.out.size())
+        {
+            ssize_t count = write(c.fd, c.out.data() + c.written, c.out.size() - c.written);
+            if (count > 0)
+            {
+                c.written += count;
+                continue;
+            }
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                watch(c, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            drop(c);
+            return false;
+        }
+        c.out.clear();
+        c.written = 0;
+        if (c.closing)
+        {
+            drop(c);
+            return false;
+        }
+        watch(c, EPOLLIN);
+        return true;
+    }
+
+    void watch(connection &c, uint32_t events)
+    {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = c.fd;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &event);
+    }
+
+    const server_options &options;
+    server_state &state;
+    std::mt19937_64 random;
+    std::string item;
+
+    // gzip and deflate streams, and whether each has been set up
+    std::pair<z_stream, bool> deflaters[2] = {{z_stream(), false}, {z_stream(), false}};
+
+    int epoll = -1;
+    int listener = -1;
+    uint64_t generations = 0;
+    std::unordered_map<int, std::unique_ptr<connection>> connections;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+};
+
+static std::atomic<bool> stopping{false};
+
+static void print_usage()
+{
+    std::cout << "Usage: lookup_server -a token [-p port] [-r route] [-t ms] [-d fixed|uniform|exponential|lognormal] [-s sigma]\n"
+                 "       [--slow-rate p] [--slow-time ms] [-l limit] [-b payload bytes] [-z] [-e error rate] [-q 429 rate]\n"
+                 "       [-c close rate] [-x drop rate] [-w threads] [--seed n]"
+              << std::endl;
+}
+
+int main(int argc, char *args[])
+{
+    server_options options;
+    long limit = 5;
+    const option long_options[] = {
+        {"port", required_argument, nullptr, 'p'},
+        {"route", required_argument, nullptr, 'r'},
+        {"authorization", required_argument, nullptr, 'a'},
+        {"time", required_argument, nullptr, 't'},
+        {"distribution", required_argument, nullptr, 'd'},
+        {"sigma", required_argument, nullptr, 's'},
+        {"slow-rate", required_argument, nullptr, 'S'},
+        {"slow-time", required_argument, nullptr, 'T'},
+        {"limit", required_argument, nullptr, 'l'},
+        {"payload-bytes", required_argument, nullptr, 'b'},
+        {"compress", no_argument, nullptr, 'z'},
+        {"error-rate", required_argument, nullptr, 'e'},
+        {"reject-rate", required_argument, nullptr, 'q'},
+        {"close-rate", required_argument, nullptr, 'c'},
+        {"drop-rate", required_argument, nullptr, 'x'},
+        {"threads", required_argument, nullptr, 'w'},
+        {"seed", required_argument, nullptr, 'R'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+
+    int choice;
+    while ((choice = getopt_long(argc, args, "p:r:a:t:d:s:l:b:ze:q:c:x:w:h", long_options, nullptr)) != -1)
+    {
+        switch (choice)
+        {
+        case 'p':
+            options.port = (unsigned short)strtoul(optarg, nullptr, 10);
+            break;
+        case 'r':
+        {
+            // Top level routes only, as lookup_server.js
+            std::string route = optarg;
+            route.erase(0, route.find_first_not_of('/'));
+            route.erase(route.find_last_not_of('/') + 1);
+            if (route.empty() || route.find('/') != std::string::npos)
+            {
+                std::cerr << "lookup_server routes must be top level routes with only one component" << std::endl;
+                return EXIT_FAILURE;
+            }
+            options.route = route;
+            break;
+        }
+        case 'a':
+            options.authorization_token = optarg;
+            break;
+        case 't':
+            options.time_ms = strtod(optarg, nullptr);
+            break;
+        case 'd':
+            if (strcmp(optarg, "fixed") == 0)
+                options.distribution = latency_distribution::fixed;
+            else if (strcmp(optarg, "uniform") == 0)
+                options.distribution = latency_distribution::uniform;
+            else if (strcmp(optarg, "exponential") == 0)
+                options.distribution = latency_distribution::exponential;
+            else if (strcmp(optarg, "lognormal") == 0)
+                options.distribution = latency_distribution::lognormal;
+            else
+            {
+                std::cerr << "unknown distribution " << optarg << std::endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            options.sigma = strtod(optarg, nullptr);
+            break;
+        case 'S':
+            options.slow_rate = strtod(optarg, nullptr);
+            break;
+        case 'T':
+            options.slow_time_ms = strtod(optarg, nullptr);
+            break;
+        case 'l':
+            limit = strtol(optarg, nullptr, 10);
+            break;
+        case 'b':
+            options.payload_bytes = strtoul(optarg, nullptr, 10);
+            break;
+        case 'z':
+            options.compress = true;
+            break;
+        case 'e':
+            options.error_rate = strtod(optarg, nullptr);
+            break;
+        case 'q':
+            options.reject_rate = strtod(optarg, nullptr);
+            break;
+        case 'c':
+            options.close_rate = strtod(optarg, nullptr);
+            break;
+        case 'x':
+            options.drop_rate = strtod(optarg, nullptr);
+            break;
+        case 'w':
+            options.threads = std::max(1ul, strtoul(optarg, nullptr, 10));
+            break;
+        case 'R':
+            options.seed = strtoull(optarg, nullptr, 10);
+            break;
+        default:
+            print_usage();
+            return (choice == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (options.authorization_token.empty() || limit <= 0)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    server_state state;
+    state.limit.store(limit);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, [](int) { stopping.store(true); });
+    signal(SIGTERM, [](int) { stopping.store(true); });
+
+    std::vector<std::unique_ptr<event_loop>> loops;
+    for (unsigned int i = 0; i < options.threads; i++)
+    {
+        loops.emplace_back(new event_loop(options, state, i));
+        if (!loops.back()->open())
+        {
+            std::cerr << "cannot listen on port " << options.port << ": " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::cout << "lookup_server listening for .../" << options.route << "/:id on port " << options.port
+              << " requiring authorization token " << options.authorization_token << " with processing time "
+              << options.time_ms << " and limit " << limit << " on " << options.threads << " threads." << std::endl;
+
+    std::vector<std::thread> threads;
+    for (auto &loop : loops)
+    {
+        threads.emplace_back([&loop]() { loop->run(stopping); });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    return EXIT_SUCCESS;
+}
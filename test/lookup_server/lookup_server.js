@@ -1,134 +1,245 @@
-// lookup-client
-// Author: Jordan Chandler
-
-// Simple node based web api server rate limited to 5 ongoing requests.
-//  API syntax  localhost[:port]/item/:id
-
-// A request takes 2 seconds to complete.
-// Status 429 and a json status returned if rate limit is exceeded.
-// Otherwise json item with requested information is returned.
-
-// Test with curl
-// curl -s -o /dev/null -w "%{http_code}" http://localhost:3000/items/123 -H "Authorization: Y1JGMmR2RFpRc211MzdXR2dLNk1UY0w3WGpl"
-
-const http = require('http');
-const { URL } = require('url');
-
-let route = "/items/";
-let port = 8080;
-let authorization_token; 
-let timeout = 0;
-
-// Parse arguments
-const argv = require('yargs/yargs')(process.argv.slice(2))
-    .usage('Usage: $0 [-p num] [-t num]')
-    .help('help').alias('help', 'h')
-    .option('p', {
-        alias: 'port',
-        demandOption: false,
-        default: 8080,
-        describe: 'TCP/IP port number that server will monitor for requests.',
-        type: 'number',
-        nargs: 1
-    })
-    .option('r', {
-        alias: 'route',
-        demandOption: false,
-        default: '/items/',
-        describe: 'Relative URL route to monitor.',
-        type: 'string',
-        nargs: 1
-    })
-    .option('a', {
-        alias: 'authorization',
-        demandOption: true,
-        describe: 'Authorization token expected in HTTP authorization header.',
-        type: 'string',
-        nargs: 1
-    })
-    .option('t', {
-        alias: 'time',
-        demandOption: false,
-        default: 0,
-        describe: 'Time in milliseconds to process each request',
-        type: 'number',
-        nargs: 1
-    })
-    .strict()
-    .argv
-
-port = argv.p;
-route = argv.r.trim();
-authorization_token = argv.a.trim();
-timeout = argv.t;
-
-if (!route.startsWith("/"))
-{
-    route = "/" + route;
-}
-if (!route.endsWith("/"))
-{
-    route = route + "/";
-}
-
-const routeParts = route.split("/");
-if (routeParts.length > 3)
-{
-    console.log ("lookup-server routes must be top level routes with only one component");
-    return;
-}
-routeParts.filter(function(value, index, arr){ 
-    return value.trim() !=="";});
- 
-route = routeParts.join("");   
-
-console.log("lookup-server listening for .../" + route + "/:id on port " + port + " requiring authorization token " + authorization_token + " with processing time " + timeout + ".\n")
-
-global.requestCount = 0;
-
-const app = http.createServer((request, response) => {
-    const query = new URL(request.url, "http://localhost/");
-    const pathName = query.pathname;
-    const pathParts = pathName.split("/");
-
-    // Ignore non-route queries - return status NOT FOUND
-    if ((pathParts.length > 0) && (pathParts[1] !== route)) {
-        response.writeHead(404, { "Content-Type": "text/json" });
-        response.end();
-        return;
-    }
-
-    // Limit simultaneous requests - return status TOO MANY REQUESTS
-    if (++global.requestCount > 5) {
-        response.writeHead(429, { "Content-Type": "text/json" });
-        response.end();
-        global.requestCount--;
-        return;
-    }
-
-    // Verify base64 encoded authorization header
-    if ((request.headers.authorization || "") != authorization_token) {
-        // Authentication header not
-        response.writeHead(403, { "Content-Type": "text/json" });
-        response.end();
-        global.requestCount--;
-        return;
-    }
-
-    // Process requests
-    setTimeout(() => {
-        if ((pathParts.length > 2) && (pathParts[2] != "")) {
-            // Requests fulfiulled - return status OK and JSON payload
-            let item = { result: "Item is in inventory." };
-            response.writeHead(200, { "Content-Type": "text/json" });
-            response.write(JSON.stringify(item));
-        } else {
-            // Item not provided - return status NOT FOUND
-            response.writeHead(404, { "Content-Type": "text/json" });
-        }
-        response.end();
-        global.requestCount--;
-    }, timeout)
-});
-
+// lookup-client
+// Author: Jordan Chandler
+
+// Simple node based web api server rate limited to 5 ongoing requests.
+//  API syntax  localhost[:port]/item/:id
+//
+// The limit can be set with -l and changed while running with
+// curl -X PUT http://localhost:8080/limit/3
+// and the number of requests accepted and rejected so far read with
+// curl http://localhost:8080/stats
+
+// A request takes 2 seconds to complete.
+// Status 429 and a json status returned if rate limit is exceeded.
+// Otherwise json item with requested information is returned.
+// With -b the item is padded with stock records generated from the id, and
+// with -z it is sent gzip or deflate encoded to clients that accept it.
+
+// Test with curl
+// curl -s -o /dev/null -w "%{http_code}" http://localhost:3000/items/123 -H "Authorization: Y1JGMmR2RFpRc211MzdXR2dLNk1UY0w3WGpl"
+
+const http = require('http');
+const zlib = require('zlib');
+const { URL } = require('url');
+
+let route = "/items/";
+let port = 8080;
+let authorization_token; 
+let timeout = 0;
+let limit = 5;
+let payloadBytes = 0;
+let compress = false;
+
+// Parse arguments
+const argv = require('yargs/yargs')(process.argv.slice(2))
+    .usage('Usage: $0 [-p num] [-t num] [-l num] [-b num] [-z]')
+    .help('help').alias('help', 'h')
+    .option('p', {
+        alias: 'port',
+        demandOption: false,
+        default: 8080,
+        describe: 'TCP/IP port number that server will monitor for requests.',
+        type: 'number',
+        nargs: 1
+    })
+    .option('r', {
+        alias: 'route',
+        demandOption: false,
+        default: '/items/',
+        describe: 'Relative URL route to monitor.',
+        type: 'string',
+        nargs: 1
+    })
+    .option('a', {
+        alias: 'authorization',
+        demandOption: true,
+        describe: 'Authorization token expected in HTTP authorization header.',
+        type: 'string',
+        nargs: 1
+    })
+    .option('t', {
+        alias: 'time',
+        demandOption: false,
+        default: 0,
+        describe: 'Time in milliseconds to process each request',
+        type: 'number',
+        nargs: 1
+    })
+    .option('l', {
+        alias: 'limit',
+        demandOption: false,
+        default: 5,
+        describe: 'Simultaneous requests allowed before responding with status 429. Change at runtime with PUT /limit/:n',
+        type: 'number',
+        nargs: 1
+    })
+    .option('b', {
+        alias: 'payload-bytes',
+        demandOption: false,
+        default: 0,
+        describe: 'Pad items to about this many bytes of stock records generated from the id.',
+        type: 'number',
+        nargs: 1
+    })
+    .option('z', {
+        alias: 'compress',
+        demandOption: false,
+        default: false,
+        describe: 'Send items gzip or deflate encoded to clients that accept it.',
+        type: 'boolean'
+    })
+    .strict()
+    .argv
+
+port = argv.p;
+route = argv.r.trim();
+authorization_token = argv.a.trim();
+timeout = argv.t;
+limit = argv.l;
+payloadBytes = argv.b;
+compress = argv.z;
+
+if (!route.startsWith("/"))
+{
+    route = "/" + route;
+}
+if (!route.endsWith("/"))
+{
+    route = route + "/";
+}
+
+const routeParts = route.split("/");
+if (routeParts.length > 3)
+{
+    console.log ("lookup-server routes must be top level routes with only one component");
+    return;
+}
+routeParts.filter(function(value, index, arr){ 
+    return value.trim() !=="";});
+ 
+route = routeParts.join("");   
+
+console.log("lookup-server listening for .../" + route + "/:id on port " + port + " requiring authorization token " + authorization_token + " with processing time " + timeout + " and limit " + limit + ".\n")
+
+// An item of about payloadBytes bytes for id: stock records whose values are
+// drawn from a generator seeded with the id's FNV-1a hash, the same records
+// the native lookup_server generates
+const warehouses = ["north", "south", "east", "west", "central", "harbor", "airport", "depot"];
+function paddedItem(id) {
+    let state = 2166136261;
+    for (const c of Buffer.from(id)) {
+        state = Math.imul(state ^ c, 16777619) >>> 0;
+    }
+    if (state === 0) {
+        state = 1;
+    }
+    const next = () => {
+        // xorshift32
+        state = (state ^ (state << 13)) >>> 0;
+        state = (state ^ (state >>> 17)) >>> 0;
+        state = (state ^ (state << 5)) >>> 0;
+        return state;
+    };
+
+    let item = '{"result":"Item is in inventory.","id":"' + id + '","stock":[';
+    let first = true;
+    while (Buffer.byteLength(item) + 2 < payloadBytes) {
+        const sku = next().toString(16).padStart(8, "0");
+        const warehouse = warehouses[next() % 8];
+        const quantity = next() % 1000;
+        item += (first ? "" : ",") + '{"sku":"' + sku + '","warehouse":"' + warehouse + '","quantity":' + quantity + '}';
+        first = false;
+    }
+    return item + "]}";
+}
+
+global.requestCount = 0;
+global.rejectedCount = 0;
+global.acceptedCount = 0;
+
+const app = http.createServer((request, response) => {
+    const query = new URL(request.url, "http://localhost/");
+    const pathName = query.pathname;
+    const pathParts = pathName.split("/");
+
+    // Change the simultaneous request limit - PUT /limit/:n
+    if ((request.method === "PUT") && (pathParts.length > 2) && (pathParts[1] === "limit")) {
+        const newLimit = parseInt(pathParts[2], 10);
+        if (!(newLimit > 0)) {
+            response.writeHead(400, { "Content-Type": "text/json" });
+            response.end();
+            return;
+        }
+        console.log("limit changed from " + limit + " to " + newLimit + " after " + global.rejectedCount + " status 429 responses");
+        limit = newLimit;
+        response.writeHead(200, { "Content-Type": "text/json" });
+        response.end(JSON.stringify({ limit: limit }));
+        return;
+    }
+
+    // Report request counters - GET /stats
+    if ((request.method === "GET") && (pathParts[1] === "stats")) {
+        response.writeHead(200, { "Content-Type": "text/json" });
+        response.end(JSON.stringify({ limit: limit, accepted: global.acceptedCount, rejected: global.rejectedCount }));
+        return;
+    }
+
+    // Ignore non-route queries - return status NOT FOUND
+    if ((pathParts.length > 0) && (pathParts[1] !== route)) {
+        response.writeHead(404, { "Content-Type": "text/json" });
+        response.end();
+        return;
+    }
+
+    // Limit simultaneous requests - return status TOO MANY REQUESTS
+    if (++global.requestCount > limit) {
+        global.rejectedCount++;
+        response.writeHead(429, { "Content-Type": "text/json" });
+        response.end();
+        global.requestCount--;
+        return;
+    }
+
+    // Verify base64 encoded authorization header
+    if ((request.headers.authorization || "") != authorization_token) {
+        // Authentication header not
+        response.writeHead(403, { "Content-Type": "text/json" });
+        response.end();
+        global.requestCount--;
+        return;
+    }
+
+    // Process requests
+    global.acceptedCount++;
+    setTimeout(() => {
+        if ((pathParts.length > 2) && (pathParts[2] != "")) {
+            // Requests fulfiulled - return status OK and JSON payload
+            let item = JSON.stringify({ result: "Item is in inventory." });
+            if (payloadBytes > item.length) {
+                item = paddedItem(pathParts[2]);
+            }
+            const headers = { "Content-Type": "text/json" };
+            if (compress) {
+                // Quality values are not weighed; an encoding listed at all is accepted
+                const accepted = (request.headers["accept-encoding"] || "").toLowerCase();
+                headers["Vary"] = "Accept-Encoding";
+                if (accepted.includes("gzip")) {
+                    headers["Content-Encoding"] = "gzip";
+                    item = zlib.gzipSync(item);
+                } else if (accepted.includes("deflate")) {
+                    headers["Content-Encoding"] = "deflate";
+                    item = zlib.deflateSync(item);
+                }
+            }
+            response.writeHead(200, headers);
+            response.write(item);
+        } else {
+            // Item not provided - return status NOT FOUND
+            response.writeHead(404, { "Content-Type": "text/json" });
+        }
+        response.end();
+        global.requestCount--;
+    }, timeout)
+});
+
 app.listen(port);
\ No newline at end of file
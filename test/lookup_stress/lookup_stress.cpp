@@ -0,0 +1,183 @@
+// lookup_stress
+// Author: Jordan Chandler
+
+// Multi-process stress test of lookup_get's shared memory mode.
+//
+// Forks several independent processes that each build their own lookup_get,
+// with a slot budget equal to the server's limit, and request the same ids in
+// different orders from a running lookup_server.  With a shared memory segment
+// the processes together never exceed the budget, so the server rejects no
+// requests, and an id fetched by one process is answered from the shared
+// cache for the others.  Without one ("-") each process spends the whole
+// budget on its own and the server rejects the excess with 429s.
+// One extra process, started first so it is holding slots, is killed partway
+// through its batch to show its slots are reclaimed rather than lost.
+//
+// The server's accepted and rejected counters are read from its /stats route
+// before and after the run.
+//
+// Compile with:
+//      g++ -std=c++17 -O2 -I../../src/lookup_get lookup_stress.cpp -lpthread -lcurl -lz -lrt -o lookup_stress
+//
+// Usage: lookup_stress base_url port authorization_token [processes] [ids] [segment name or -] [engine t|m]
+//   e.g. lookup_stress http://localhost/items/ 8080 Y1JGMmR2RFpRc211MzdXR2dLNk1UY0w3WGpl 8 200 /lookup_stress
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <cstdlib>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "lookup_get.cpp"
+
+// Server's accepted and rejected request counters
+static bool server_stats(const std::string &base_url, unsigned long port, long long &accepted, long long &rejected)
+{
+    // The /stats route is at the root of the server named by base_url
+    size_t path = base_url.find('/', base_url.find("//") + 2);
+    std::string url = base_url.substr(0, path) + "/stats";
+    std::string body;
+
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_PORT, port);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)[](char *contents, size_t size, size_t nmemb, void *userp) {
+        ((std::string *)userp)->append(contents, size * nmemb);
+        return size * nmemb;
+    });
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+    CURLcode code = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+
+    size_t a = body.find("\"accepted\":");
+    size_t r = body.find("\"rejected\":");
+    if (code != CURLE_OK || a == std::string::npos || r == std::string::npos)
+    {
+        return false;
+    }
+    accepted = std::atoll(body.c_str() + a + 11);
+    rejected = std::atoll(body.c_str() + r + 11);
+    return true;
+}
+
+// Body of one forked process.  Exits non-zero if any id did not come back 200.
+static int run_process(int number, const std::string &base_url, unsigned long port, const std::string &token,
+                       size_t id_count, const std::string &segment, lookup_engine engine)
+{
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < id_count; i++)
+    {
+        ids.push_back("stress-" + std::to_string(i));
+    }
+    std::shuffle(ids.begin(), ids.end(), std::mt19937(number));
+
+    lookup_options options;
+    options.engine = engine;
+    if (segment != "-")
+    {
+        options.shared.name = segment;
+        options.shared.slots = 5;
+    }
+    lookup_get get(options);
+
+    size_t failed = 0;
+    for (const auto &result : get.request_results(ids, base_url, port, token, 5))
+    {
+        failed += (result->status != 200);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: lookup_stress base_url port authorization_token [processes] [ids] [segment name or -] [engine t|m]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string base_url = argv[1];
+    unsigned long port = std::strtoul(argv[2], NULL, 10);
+    std::string token = argv[3];
+    int process_count = (argc > 4) ? std::atoi(argv[4]) : 8;
+    size_t id_count = (argc > 5) ? std::strtoul(argv[5], NULL, 10) : 200;
+    std::string segment = (argc > 6) ? argv[6] : "/lookup_stress";
+    lookup_engine engine = (argc > 7 && argv[7][0] == 'm') ? lookup_engine::multi : lookup_engine::threaded;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    // Start from an empty segment, kept open here to read its counters afterwards
+    std::unique_ptr<lookup_shared> shared;
+    if (segment != "-")
+    {
+        lookup_shared::unlink(segment);
+        lookup_shared_options shared_options;
+        shared_options.name = segment;
+        shared_options.slots = 5;
+        shared.reset(new lookup_shared(shared_options));
+        if (!shared->open())
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    long long accepted_before, rejected_before;
+    if (!server_stats(base_url, port, accepted_before, rejected_before))
+    {
+        std::cerr << "cannot read /stats from the server" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pid_t> children;
+    for (int number = 0; number <= process_count; number++)
+    {
+        if (number == 1)
+        {
+            // Let the extra process take the gate's slots
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            _exit(run_process(number, base_url, port, token, id_count, segment, engine));
+        }
+        children.push_back(pid);
+    }
+
+    // The extra process dies abruptly partway through its batch
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    kill(children.front(), SIGKILL);
+
+    int failed = 0;
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        int status = 0;
+        waitpid(children[i], &status, 0);
+        if (i > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+        {
+            failed++;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long long accepted_after, rejected_after;
+    server_stats(base_url, port, accepted_after, rejected_after);
+
+    lookup_shared_stats stats = shared ? shared->stats() : lookup_shared_stats();
+    std::cout << "segment,engine,processes,ids,failed_processes,server_requests,server_429s,shared_hits,reclaimed_slots,seconds" << std::endl;
+    std::cout << segment << "," << ((engine == lookup_engine::multi) ? "multi" : "threaded") << ","
+              << process_count << "," << id_count << "," << failed << ","
+              << (accepted_after - accepted_before) << "," << (rejected_after - rejected_before) << ","
+              << stats.hits << "," << stats.reclaimed << "," << seconds << std::endl;
+
+    if (shared)
+    {
+        lookup_shared::unlink(segment);
+    }
+    curl_global_cleanup();
+    return (failed == 0 && (!shared || rejected_after == rejected_before)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}